@@ -9,7 +9,14 @@
  * constants and variables are compiled as an opcode with an offset into the
  * auxiliary consts and vars arrays.
  *
- * this is not reentrant, but new expressions can be compiled as desired.
+ * the stack program is then translated to code for a simple register machine,
+ * folding operations on constants and reusing the result of any operation
+ * that has already been done on the same operands, so each evaluation does
+ * just the arithmetic that depends on the operands with no stack to check.
+ *
+ * each expression is compiled into its own Expr context from newExpr() so
+ * any number may be in use at once. the original functions without an Expr
+ * argument use one built-in context.
  */
 
 #include <stdio.h>
@@ -18,12 +25,24 @@
 #include <stdlib.h>
 #include <string.h>
 
-static int next_token (void);
-static int chk_funcs (void);
-static void skip_double (void);
-static int compile (int prec);
-static int execute (double *result);
-static int parse_fieldname (char name[], int len);
+#include "compiler.h"
+
+static int next_token (Expr *x);
+static int chk_funcs (Expr *x);
+static void skip_double (Expr *x);
+static int compile (Expr *x, int prec);
+static int compile1 (Expr *x, int prec);
+#ifdef COMPILER_BENCH
+static int execute (Expr *x, double *result);
+#endif
+static int parse_fieldname (Expr *x, char name[], int len);
+static void regCompile (Expr *x);
+static int constReg (Expr *x, double v);
+static int opReg (Expr *x, int op, int a, int b);
+static double apply (int op, double a, double b);
+static int rexecute (Expr *x, double *result);
+static void *shrink (void *p, int n, int size);
+static Expr *defExpr (void);
 
 /* parser tokens and opcodes, as necessary */
 enum {
@@ -82,96 +101,166 @@ enum {
 static int precedence[] = {0,5,5,6,6,2,1,4,4,3,3,4,4};
 #define	UNI_PREC	7	/* unary ops have highest precedence */
 
-/* execute-time operand stack */
-#define	MAX_STACK	32
-static double stack[MAX_STACK], *sp;
-
-/* space for compiled opcodes - the "program".
- * opcodes go in lower 8 bits.
- * when an opcode has an operand (as CONST and VAR) it is really an array
- *   index in the remaining upper bits.
+/* limits, the arrays are trimmed to what is used once compiled.
+ * CONST and VAR opcodes hold an array index in the bits above OP_SHIFT so
+ *   MAX_OPX < 1 << ((sizeof(int)-1)*8)
+ * the stack can never be deeper than the program is long.
+ * each paren, unary op, function argument and higher precedence operand
+ *   recurses once in compile(), so MAX_NEST bounds them all.
  */
-#define	MAX_PROG 32
-static int program[MAX_PROG], *pc;
+#define	MAX_PROG	4096	/* max opcodes in program */
+#define	MAX_OPX		1024	/* max number of operands, ie, vars or consts */
+#define	MAX_STACK	MAX_PROG
+#define	MAX_REGS	(MAX_OPX + MAX_PROG)
+#define	MAX_NEST	256	/* max compile() recursion */
+#define	MAXFLDLEN	64	/* longest allowed operand name */
 #define	OP_SHIFT	8
 #define	OP_MASK		0xff
 
-/* auxiliary operand info.
- * the operands (all but lower 8 bits) of CONST and VAR are really indeces
- * into these arrays. thus, no point in making them any longer than you have
- * bits more than 8 in your machine's int to index into it, ie, make
- *    MAX_OPX < 1 << ((sizeof(int)-1)*8)
- */
-#define	MAX_OPX		64	/* max number of operands */
-#define	MAXFLDLEN	64	/* longest allowed operand name */
+/* one operand */
 typedef struct {
-    int set;			/* 1 when v has been set */
+    int set;			/* 1 when regs[] value has been set */
     char name[MAXFLDLEN];	/* name of operand */
-    double v;			/* last known value of this operand */
 } Var;
-static Var vars[MAX_OPX];	/* operands */
-static int nvars;		/* number of vars[] in actual use */
-static double consts[MAX_OPX];	/* constants */
-static int nconsts;		/* number of consts[] in actual use */
 
-/* these are global just for easy/rapid access */
-static int parens_nest;	/* to check that parens end up nested */
-static char *err_msg;   /* caller provides storage; we point at it with this */
-static char *cexpr, *lcexpr; /* pointers that move along caller's expression */
+/* the register machine.
+ * each instruction applies op, one of the opcodes above, to registers a and,
+ *   if binary, b and puts the result in a register no other instruction uses.
+ * the value of vars[i] is always in regs[i], followed by the constants then
+ *   the result of each instruction.
+ */
+typedef struct {
+    int op;			/* opcode */
+    int dst, a, b;		/* regs[] indices */
+} RInstr;
+
+/* everything about one expression */
+struct Expr {
+    /* the stack program.
+     * opcodes go in lower 8 bits. when an opcode has an operand (as CONST
+     * and VAR) it is really an array index in the remaining upper bits.
+     */
+    int *program;		/* opcodes, ending with HALT */
+    int *pc;			/* next program[] while compiling */
+
+    /* auxiliary operand info */
+    Var *vars;			/* operands, each name just once */
+    int nvars;			/* number of vars[] in actual use */
+    double *consts;		/* constants */
+    int nconsts;		/* number of consts[] in actual use */
+
+    /* the register program */
+    RInstr *rcode;		/* instructions */
+    int nrcode;			/* number of rcode[] in use */
+    double *regs;		/* register file */
+    char *isconst;		/* set if regs[i] is a constant */
+    int nregs;			/* number of regs[] in use */
+    int resreg;			/* regs[] holding the result */
+
+    /* parser state */
+    int parens_nest;		/* to check that parens end up nested */
+    int depth;			/* compile() recursion depth */
+    char *err_msg;		/* caller provides storage, we point at it */
+    char *cexpr, *lcexpr;	/* pointers that move along caller's expression */
+};
+#define	VARV(x,i)	((x)->regs[i])	/* value of x->vars[i] */
 
-/* compile the given c-style expression.
+/* return a new empty Expr context, ready for exprCompile().
+ */
+Expr *
+newExpr ()
+{
+	return ((Expr *) calloc (1, sizeof(Expr)));
+}
+
+/* free x and all it holds.
+ */
+void
+delExpr (Expr *x)
+{
+	free (x->program);
+	free (x->vars);
+	free (x->consts);
+	free (x->rcode);
+	free (x->regs);
+	free (x->isconst);
+	free (x);
+}
+
+/* compile the given c-style expression into x.
  * return 0 if ok, else return -1 and a reason message in errbuf.
  */
 int
-compileExpr (char *exp, char *errbuf)
+exprCompile (Expr *x, char *exp, char *errbuf)
 {
-	/* init the globals.
-	 * also delete any flogs used in the previous program.
-	 */
-	cexpr = exp;
-	err_msg = errbuf;
-	pc = program;
-	nvars = nconsts = 0;
-	parens_nest = 0;
-
-	pc = program;
-	if (compile(0) == ERR) {
-	    (void) sprintf (err_msg + strlen(err_msg), " near `%.10s'", lcexpr);
+	int nprog;
+
+	/* start fresh with room for the largest possible program */
+	free (x->program);
+	free (x->vars);
+	free (x->consts);
+	free (x->rcode);
+	free (x->regs);
+	free (x->isconst);
+	x->program = (int *) malloc (MAX_PROG * sizeof(int));
+	x->vars = (Var *) malloc (MAX_OPX * sizeof(Var));
+	x->consts = (double *) malloc (MAX_OPX * sizeof(double));
+	x->rcode = (RInstr *) malloc (MAX_PROG * sizeof(RInstr));
+	x->regs = (double *) calloc (MAX_REGS, sizeof(double));
+	x->isconst = (char *) malloc (MAX_REGS);
+	x->nvars = x->nconsts = x->nrcode = x->nregs = 0;
+
+	x->cexpr = exp;
+	x->err_msg = errbuf;
+	x->parens_nest = 0;
+	x->depth = 0;
+	x->pc = x->program;
+	if (compile (x, 0) == ERR) {
+	    (void) sprintf (x->err_msg + strlen(x->err_msg), " near `%.10s'", x->lcexpr);
 	    return (-1);
 	}
-	if (pc == program) {
-	    (void) sprintf (err_msg, "Null program");
+	if (x->pc == x->program) {
+	    (void) sprintf (x->err_msg, "Null program");
 	    return (-1);
 	}
-	*pc++ = HALT;
+	*x->pc++ = HALT;
+	regCompile (x);
+
+	/* trim to fit */
+	nprog = x->pc - x->program;
+	x->program = (int *) shrink (x->program, nprog, sizeof(int));
+	x->pc = x->program + nprog;
+	x->vars = (Var *) shrink (x->vars, x->nvars, sizeof(Var));
+	x->consts = (double *) shrink (x->consts, x->nconsts, sizeof(double));
+	x->rcode = (RInstr *) shrink (x->rcode, x->nrcode, sizeof(RInstr));
+	x->regs = (double *) shrink (x->regs, x->nregs, sizeof(double));
+	x->isconst = (char *) shrink (x->isconst, x->nregs, 1);
 	return (0);
 }
 
-/* execute the expression previously compiled with compileExpr().
+/* execute the expression previously compiled into x with exprCompile().
  * return 0 with *vp set to the answer if ok, else return -1 with a reason
  * why not message in errbuf.
  */
 int
-evalExpr (double *vp, char *errbuf)
+exprEval (Expr *x, double *vp, char *errbuf)
 {
-	err_msg = errbuf;
-	sp = stack + MAX_STACK;	/* grows towards lower addresses */
-	pc = program;
-	return (execute(vp));
+	x->err_msg = errbuf;
+	return (rexecute (x, vp));
 }
 
-/* set the value for an operand with the given name to the given value.
+/* set the value for the operand of x with the given name to the given value.
  * return 0 if found else -1.
  */
 int
-setOperand (char *name, double valu)
+exprSetOperand (Expr *x, char *name, double valu)
 {
 	int i;
 
-	for (i = 0; i < nvars; i++) {
-	    if (strcmp (name, vars[i].name) == 0) {
-		vars[i].v = valu;
-		vars[i].set = 1;
+	for (i = 0; i < x->nvars; i++) {
+	    if (strcmp (name, x->vars[i].name) == 0) {
+		VARV(x,i) = valu;
+		x->vars[i].set = 1;
 		return(0);
 	    }
 	}
@@ -179,14 +268,37 @@ setOperand (char *name, double valu)
 	return (-1);
 }
 
-/* return 0 if all operands are set, else -1 */
+/* return the index of the operand of x with the given name, for use with
+ * exprSetOperandIndex(), else -1.
+ */
+int
+exprOperandIndex (Expr *x, char *name)
+{
+	int i;
+
+	for (i = 0; i < x->nvars; i++)
+	    if (strcmp (name, x->vars[i].name) == 0)
+		return (i);
+	return (-1);
+}
+
+/* set the value of operand i of x, as from exprOperandIndex().
+ */
+void
+exprSetOperandIndex (Expr *x, int i, double valu)
+{
+	VARV(x,i) = valu;
+	x->vars[i].set = 1;
+}
+
+/* return 0 if all operands of x are set, else -1 */
 int 
-allOperandsSet ()
+exprAllOperandsSet (Expr *x)
 {
 	int i;
 
-	for (i = 0; i < nvars; i++)
-	    if (!vars[i].set)
+	for (i = 0; i < x->nvars; i++)
+	    if (!x->vars[i].set)
 		return (-1);
 	return (0);
 }
@@ -195,31 +307,31 @@ allOperandsSet ()
  * N.B. caller must free array, and not modify names.
  */
 int
-getAllOperands (char ***ops)
+exprGetAllOperands (Expr *x, char ***ops)
 {
 	int i;
 
-	*ops = (char **) malloc (nvars * sizeof(char *));
+	*ops = (char **) malloc (x->nvars * sizeof(char *));
 
-	for (i = 0; i < nvars; i++)
-	    (*ops)[i] = vars[i].name;
+	for (i = 0; i < x->nvars; i++)
+	    (*ops)[i] = x->vars[i].name;
 
-	return (nvars);
+	return (x->nvars);
 }
 
 /* return a malloced array of each initialized operand name.
  * N.B. caller must free array, and not modify the names.
  */
 int
-getSetOperands (char ***ops)
+exprGetSetOperands (Expr *x, char ***ops)
 {
 	int i, n;
 
-	*ops = (char **) malloc (nvars * sizeof(char *));
+	*ops = (char **) malloc (x->nvars * sizeof(char *));
 
-	for (n = i = 0; i < nvars; i++)
-	    if (vars[i].set)
-		(*ops)[n++] = vars[i].name;
+	for (n = i = 0; i < x->nvars; i++)
+	    if (x->vars[i].set)
+		(*ops)[n++] = x->vars[i].name;
 
 	return (n);
 }
@@ -228,33 +340,95 @@ getSetOperands (char ***ops)
  * N.B. caller must free array, and not modify the names.
  */
 int
-getUnsetOperands (char ***ops)
+exprGetUnsetOperands (Expr *x, char ***ops)
 {
 	int i, n;
 
-	*ops = (char **) malloc (nvars * sizeof(char *));
+	*ops = (char **) malloc (x->nvars * sizeof(char *));
 
-	for (n = i = 0; i < nvars; i++)
-	    if (!vars[i].set)
-		(*ops)[n++] = vars[i].name;
+	for (n = i = 0; i < x->nvars; i++)
+	    if (!x->vars[i].set)
+		(*ops)[n++] = x->vars[i].name;
 
 	return (n);
 }
 
+/* the original interface, using one built-in context */
+
+int
+compileExpr (char *exp, char *errbuf)
+{
+	return (exprCompile (defExpr(), exp, errbuf));
+}
+
+int
+evalExpr (double *vp, char *errbuf)
+{
+	return (exprEval (defExpr(), vp, errbuf));
+}
+
+int
+setOperand (char *name, double valu)
+{
+	return (exprSetOperand (defExpr(), name, valu));
+}
+
+int 
+allOperandsSet ()
+{
+	return (exprAllOperandsSet (defExpr()));
+}
+
+int
+getAllOperands (char ***ops)
+{
+	return (exprGetAllOperands (defExpr(), ops));
+}
+
+int
+getSetOperands (char ***ops)
+{
+	return (exprGetSetOperands (defExpr(), ops));
+}
+
+int
+getUnsetOperands (char ***ops)
+{
+	return (exprGetUnsetOperands (defExpr(), ops));
+}
+
 /* called when each different field is written.
  * this is just called by srch_log() to hide the fact from users of srch*
  * that srch is really using our vars array to store values.
  * since this gets called for all fields, it's not an error to not find name.
- * don't stop when see the first one because a term might appear more than once.
  */
 void
 compiler_log (char *name, double value)
 {
-	Var *vp;
+	Expr *x = defExpr();
+	int i;
+
+	for (i = 0; i < x->nvars; i++)
+	    if (strcmp (x->vars[i].name, name) == 0)
+		VARV(x,i) = value;
+}
 
-	for (vp = vars; vp < &vars[nvars]; vp++)
-	    if (strcmp (vp->name, name) == 0)
-		vp->v = value;
+/* return the built-in context, creating it the first time */
+static Expr *
+defExpr ()
+{
+	static Expr *x;
+
+	if (!x)
+	    x = newExpr();
+	return (x);
+}
+
+/* realloc p to n items of the given size, at least 1 */
+static void *
+shrink (void *p, int n, int size)
+{
+	return (realloc (p, (n > 0 ? n : 1) * size));
 }
 
 /* get and return the opcode corresponding to the next token.
@@ -262,7 +436,7 @@ compiler_log (char *name, double value)
  * also watch for mismatches parens and proper operator/operand alternation.
  */
 static int
-next_token ()
+next_token (Expr *x)
 {
 	static char toomv[] = "More than %d variables";
 	static char toomc[] = "More than %d constants";
@@ -270,47 +444,47 @@ next_token ()
 	int tok = ERR;	/* just something illegal */
 	char c;
 
-	while (isspace(c = *cexpr))
-	    cexpr++;
-	lcexpr = cexpr++;
+	while (isspace(c = *x->cexpr))
+	    x->cexpr++;
+	x->lcexpr = x->cexpr++;
 
 	/* mainly check for a binary operator */
 	switch (c) {
 	case ',': tok = COMMA; break;
-	case '\0': --cexpr; tok = HALT; break; /* keep returning HALT */
+	case '\0': --x->cexpr; tok = HALT; break; /* keep returning HALT */
 	case '+': tok = ADD; break; /* compiler knows when it's really unary */
 	case '-': tok = SUB; break; /* compiler knows when it's really negate */
 	case '*': tok = MULT; break;
 	case '/': tok = DIV; break;
-	case '(': parens_nest++; tok = LPAREN; break;
+	case '(': x->parens_nest++; tok = LPAREN; break;
 	case ')':
-	    if (--parens_nest < 0) {
-	        (void) sprintf (err_msg, "Too many right parens");
+	    if (--x->parens_nest < 0) {
+	        (void) sprintf (x->err_msg, "Too many right parens");
 		return (ERR);
 	    } else
 		tok = RPAREN;
 	    break;
 	case '|':
-	    if (*cexpr == '|') { cexpr++; tok = OR; }
-	    else { (void) strcpy (err_msg, badop); return (ERR); }
+	    if (*x->cexpr == '|') { x->cexpr++; tok = OR; }
+	    else { (void) strcpy (x->err_msg, badop); return (ERR); }
 	    break;
 	case '&':
-	    if (*cexpr == '&') { cexpr++; tok = AND; }
-	    else { (void) strcpy (err_msg, badop); return (ERR); }
+	    if (*x->cexpr == '&') { x->cexpr++; tok = AND; }
+	    else { (void) strcpy (x->err_msg, badop); return (ERR); }
 	    break;
 	case '=':
-	    if (*cexpr == '=') { cexpr++; tok = EQ; }
-	    else { (void) strcpy (err_msg, badop); return (ERR); }
+	    if (*x->cexpr == '=') { x->cexpr++; tok = EQ; }
+	    else { (void) strcpy (x->err_msg, badop); return (ERR); }
 	    break;
 	case '!':
-	    if (*cexpr == '=') { cexpr++; tok = NE; } else { tok = NOT; }
+	    if (*x->cexpr == '=') { x->cexpr++; tok = NE; } else { tok = NOT; }
 	    break;
 	case '<':
-	    if (*cexpr == '=') { cexpr++; tok = LE; }
+	    if (*x->cexpr == '=') { x->cexpr++; tok = LE; }
 	    else tok = LT;
 	    break;
 	case '>':
-	    if (*cexpr == '=') { cexpr++; tok = GE; }
+	    if (*x->cexpr == '=') { x->cexpr++; tok = GE; }
 	    else tok = GT;
 	    break;
 	}
@@ -323,38 +497,49 @@ next_token ()
 	    /* looks like a constant.
 	     * leading +- already handled
 	     */
-	    if (nconsts > MAX_OPX) {
-		(void) sprintf (err_msg, toomc, MAX_OPX);
+	    if (x->nconsts >= MAX_OPX) {
+		(void) sprintf (x->err_msg, toomc, MAX_OPX);
 		return (ERR);
 	    }
-	    consts[nconsts] = atof (lcexpr);
-	    tok = CONST | (nconsts++ << OP_SHIFT);
-	    skip_double();
+	    x->consts[x->nconsts] = atof (x->lcexpr);
+	    tok = CONST | (x->nconsts++ << OP_SHIFT);
+	    skip_double (x);
 	} else if (isalpha(c)) {
 	    /* check list of functions */
-	    tok = chk_funcs();
+	    tok = chk_funcs (x);
 	    if (tok == ERR) {
-		(void) sprintf (err_msg, "Bad function");
+		(void) sprintf (x->err_msg, "Bad function");
 		return (ERR);
 	    }
 	} else if (c == '"') {
-	    /* a variable */
-	    if (nvars > MAX_OPX) {
-		(void) sprintf (err_msg, toomv, MAX_OPX);
+	    /* a variable, just one vars[] per name however often it is used */
+	    char name[MAXFLDLEN];
+	    int i;
+
+	    if (parse_fieldname (x, name, MAXFLDLEN) < 0) {
+		(void) sprintf (x->err_msg, "Bad field");
 		return (ERR);
 	    }
-	    if (parse_fieldname (vars[nvars].name, MAXFLDLEN) < 0) {
-		(void) sprintf (err_msg, "Bad field");
-		return (ERR);
-	    } else
-		tok = VAR | (nvars++ << OP_SHIFT);
+	    for (i = 0; i < x->nvars; i++)
+		if (strcmp (name, x->vars[i].name) == 0)
+		    break;
+	    if (i == x->nvars) {
+		if (x->nvars >= MAX_OPX) {
+		    (void) sprintf (x->err_msg, toomv, MAX_OPX);
+		    return (ERR);
+		}
+		strcpy (x->vars[x->nvars].name, name);
+		x->vars[x->nvars].set = 0;
+		x->nvars++;
+	    }
+	    tok = VAR | (i << OP_SHIFT);
 	}
 
 	if (tok != ERR)
 	    return (tok);
 
 	/* what the heck is it? */
-	(void) sprintf (err_msg, "Syntax error");
+	(void) sprintf (x->err_msg, "Syntax error");
 	return (ERR);
 }
 
@@ -362,7 +547,7 @@ next_token ()
  * if find one, update cexpr too.
  */
 static int
-chk_funcs()
+chk_funcs (Expr *x)
 {
 	static struct {
 	    const char *st_name;
@@ -382,8 +567,8 @@ chk_funcs()
 
 	for (i = 0; i < (int)(sizeof(symtab)/sizeof(symtab[0])); i++) {
 	    int l = strlen (symtab[i].st_name);
-	    if (strncmp (lcexpr, symtab[i].st_name, l) == 0) {
-		cexpr += l-1;
+	    if (strncmp (x->lcexpr, symtab[i].st_name, l) == 0) {
+		x->cexpr += l-1;
 		return (symtab[i].st_tok);
 	    }
 	}
@@ -398,18 +583,18 @@ chk_funcs()
  *   have to go ahead and crack it!
  */
 static void
-skip_double()
+skip_double (Expr *x)
 {
 	int sawe = 0;	/* so we can allow '-' or '+' right after an 'e' */
 
 	for (;;) {
-	    char c = *cexpr;
+	    char c = *x->cexpr;
 	    if (isdigit(c) || c=='.' || (sawe && (c=='-' || c=='+'))) {
 		sawe = 0;
-		cexpr++;
+		x->cexpr++;
 	    } else if (c == 'e') {
 		sawe = 1;
-		cexpr++;
+		x->cexpr++;
 	    } else
 		break;
 	}
@@ -422,21 +607,38 @@ skip_double()
  * if error, fill in a message in err_msg[] and return ERR.
  */
 static int
-compile (int prec)
+compile (Expr *x, int prec)
+{
+	int tok;
+
+	if (x->depth >= MAX_NEST) {
+	    (void) sprintf (x->err_msg, "Expression is nested too deeply");
+	    return (ERR);
+	}
+	x->depth++;
+	tok = compile1 (x, prec);
+	x->depth--;
+	return (tok);
+}
+
+/* the body of compile(), which checks how deep it is called.
+ */
+static int
+compile1 (Expr *x, int prec)
 {
 	int expect_binop = 0;	/* set after we have seen any operand.
 				 * used by SUB so it can tell if it really 
 				 * should be taken to be a NEG instead.
 				 */
-	int tok = next_token ();
+	int tok = next_token (x);
 	int *oldpc;
 
 	for (;;) {
 	    int p;
 	    if (tok == ERR)
 		return (ERR);
-	    if (pc - program >= MAX_PROG) {
-		(void) sprintf (err_msg, "Program is too long");
+	    if (x->pc - x->program >= MAX_PROG) {
+		(void) sprintf (x->err_msg, "Program is too long");
 		return (ERR);
 	    }
 
@@ -448,32 +650,36 @@ compile (int prec)
 		if (expect_binop)
 		    break;	/* procede with binary addition */
 		/* just skip a unary positive(?) */
-		tok = next_token();
+		tok = next_token (x);
 		if (tok == HALT) {
-		    (void) sprintf (err_msg, "Term expected after unary +");
+		    (void) sprintf (x->err_msg, "Term expected after unary +");
 		    return (ERR);
 		}
 		continue;
 	    case SUB:
 		if (expect_binop)
 		    break;	/* procede with binary subtract */
-		oldpc = pc;
-		tok = compile (UNI_PREC);
-		if (oldpc == pc) {
-		    (void) sprintf (err_msg, "Term expected after unary -");
+		oldpc = x->pc;
+		tok = compile (x, UNI_PREC);
+		if (tok == ERR)
+		    return (ERR);
+		if (oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "Term expected after unary -");
 		    return (ERR);
 		}
-		*pc++ = NEG;
+		*x->pc++ = NEG;
 		expect_binop = 1;
 		continue;
 	    case NOT:
-		oldpc = pc;
-		tok = compile (UNI_PREC);
-		if (oldpc == pc) {
-		    (void) sprintf (err_msg, "Term expected after unary !");
+		oldpc = x->pc;
+		tok = compile (x, UNI_PREC);
+		if (tok == ERR)
+		    return (ERR);
+		if (oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "Term expected after unary !");
 		    return (ERR);
 		}
-		*pc++ = NOT;
+		*x->pc++ = NOT;
 		expect_binop = 1;
 		continue;
 	    /* one-arg functions */
@@ -481,59 +687,59 @@ compile (int prec)
 	    case ACOS: case ATAN: case DEGRAD: case RADDEG: case LOG:
 	    case LOG10: case EXP: case SQRT:
 		/* eat up the function's parenthesized argument */
-		if (next_token() != LPAREN) {
-		    (void) sprintf (err_msg, "expecting '(' after function");
+		if (next_token (x) != LPAREN) {
+		    (void) sprintf (x->err_msg, "expecting '(' after function");
 		    return (ERR);
 		}
-		oldpc = pc;
-		if (compile (0) != RPAREN || oldpc == pc) {
-		    (void) sprintf (err_msg, "1-arg function arglist error");
+		oldpc = x->pc;
+		if (compile (x, 0) != RPAREN || oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "1-arg function arglist error");
 		    return (ERR);
 		}
-		*pc++ = tok;
-		tok = next_token();
+		*x->pc++ = tok;
+		tok = next_token (x);
 		expect_binop = 1;
 		continue;
 	    /* two-arg functions */
 	    case POW: case ATAN2:
 		/* eat up the function's parenthesized arguments */
-		if (next_token() != LPAREN) {
-		    (void) sprintf (err_msg, "Saw a built-in function: expecting (");
+		if (next_token (x) != LPAREN) {
+		    (void) sprintf (x->err_msg, "Saw a built-in function: expecting (");
 		    return (ERR);
 		}
-		oldpc = pc;
-		if (compile (0) != COMMA || oldpc == pc) {
-		    (void) sprintf (err_msg, "1st of 2-arg function arglist error");
+		oldpc = x->pc;
+		if (compile (x, 0) != COMMA || oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "1st of 2-arg function arglist error");
 		    return (ERR);
 		}
-		oldpc = pc;
-		if (compile (0) != RPAREN || oldpc == pc) {
-		    (void) sprintf (err_msg, "2nd of 2-arg function arglist error");
+		oldpc = x->pc;
+		if (compile (x, 0) != RPAREN || oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "2nd of 2-arg function arglist error");
 		    return (ERR);
 		}
-		*pc++ = tok;
-		tok = next_token();
+		*x->pc++ = tok;
+		tok = next_token (x);
 		expect_binop = 1;
 		continue;
 	    /* constants and variables are just like 0-arg functions w/o ()'s */
             case CONST:
 	    case PITOK:
 	    case VAR:
-		*pc++ = tok;
-		tok = next_token();
+		*x->pc++ = tok;
+		tok = next_token (x);
 		expect_binop = 1;
 		continue;
             case LPAREN:
-		oldpc = pc;
-		if (compile (0) != RPAREN) {
-		    (void) sprintf (err_msg, "Unmatched left paren");
+		oldpc = x->pc;
+		if (compile (x, 0) != RPAREN) {
+		    (void) sprintf (x->err_msg, "Unmatched left paren");
 		    return (ERR);
 		}
-		if (oldpc == pc) {
-		    (void) sprintf (err_msg, "Null expression");
+		if (oldpc == x->pc) {
+		    (void) sprintf (x->err_msg, "Null expression");
 		    return (ERR);
 		}
-		tok = next_token();
+		tok = next_token (x);
 		expect_binop = 1;
 		continue;
             case RPAREN:
@@ -548,15 +754,15 @@ compile (int prec)
 	    p = precedence[tok];
             if (p > prec) {
                 int newtok;
-		oldpc = pc;
-                newtok = compile (p);
+		oldpc = x->pc;
+                newtok = compile (x, p);
 		if (newtok == ERR)
 		    return (ERR);
-		if (oldpc == pc) {
-		    (void) strcpy (err_msg, "Term or factor expected");
+		if (oldpc == x->pc) {
+		    (void) strcpy (x->err_msg, "Term or factor expected");
 		    return (ERR);
 		}
-                *pc++ = tok;
+                *x->pc++ = tok;
 		expect_binop = 1;
                 tok = newtok;
             } else
@@ -564,15 +770,22 @@ compile (int prec)
         }
 }
 
+#ifdef COMPILER_BENCH
 /* "run" the program[] compiled with compile().
  * if ok, return 0 and the final result,
  * else return -1 with a reason why not message in err_msg.
+ * N.B. evalExpr() now uses rexecute(), this is kept to check against.
  */
 static int
-execute(double *result)
+execute (Expr *x, double *result)
 {
+	double stack[MAX_STACK], *sp;
+	int *pc;
 	int instr; 
 
+	sp = stack + MAX_STACK;	/* grows towards lower addresses */
+	pc = x->program;
+
 	do {
 	    instr = *pc++;
 	    switch (instr & OP_MASK) {
@@ -594,8 +807,8 @@ execute(double *result)
 	    case LE:	sp[1] = sp[1] <= sp[0] ? 1 : 0; sp++; break;
 	    case NEG:	*sp = -*sp; break;
 	    case NOT:	*sp = (double)(*sp==0); break;
-	    case CONST:	*--sp = consts[instr >> OP_SHIFT]; break;
-	    case VAR:	*--sp = vars[instr>>OP_SHIFT].v; break;
+	    case CONST:	*--sp = x->consts[instr >> OP_SHIFT]; break;
+	    case VAR:	*--sp = VARV(x,instr>>OP_SHIFT); break;
 	    case PITOK:	*--sp = 4.0*atan(1.0); break;
 	    case ABS:	*sp = fabs (*sp); break;
 	    case FLOOR:	*sp = floor (*sp); break;
@@ -614,27 +827,203 @@ execute(double *result)
 	    case POW:	sp[1] = pow (sp[1], sp[0]); sp++; break;
 	    case ATAN2:	sp[1] = atan2 (sp[1], sp[0]); sp++; break;
 	    default:
-		(void) sprintf (err_msg, "Bug! bad opcode: 0x%x", instr);
+		(void) sprintf (x->err_msg, "Bug! bad opcode: 0x%x", instr);
 		return (-1);
 	    }
 	    if (sp < stack) {
-		(void) sprintf (err_msg, "Runtime stack overflow");
+		(void) sprintf (x->err_msg, "Runtime stack overflow");
 		return (-1);
 	    } else if (sp - stack > MAX_STACK) {
-		(void) sprintf (err_msg, "Bug! runtime stack underflow");
+		(void) sprintf (x->err_msg, "Bug! runtime stack underflow");
 		return (-1);
 	    }
 	} while (instr != HALT);
 
 	/* result should now be on top of stack */
 	if (sp != &stack[MAX_STACK - 1]) {
-	    (void) sprintf (err_msg, "Bug! stack has %ld items",
+	    (void) sprintf (x->err_msg, "Bug! stack has %ld items",
 							(long)MAX_STACK - (sp-stack));
 	    return (-1);
 	}
 	*result = *sp;
 	return (0);
 }
+#endif /* COMPILER_BENCH */
+
+/* translate program[] into rcode[] for rexecute().
+ * N.B. program[] is known to be well formed so no checks are needed here.
+ */
+static void
+regCompile (Expr *x)
+{
+	int rstack[MAX_STACK];	/* regs[] that would be on the stack */
+	int *rsp = rstack;
+	int *ip;
+
+	x->nrcode = 0;
+	x->nregs = x->nvars;
+	memset (x->isconst, 0, x->nvars);
+
+	for (ip = x->program; *ip != HALT; ip++) {
+	    int op = *ip & OP_MASK;
+	    int a, b;
+
+	    switch (op) {
+	    case CONST:	*rsp++ = constReg (x, x->consts[*ip >> OP_SHIFT]); break;
+	    case PITOK:	*rsp++ = constReg (x, 4.0*atan(1.0)); break;
+	    case VAR:	*rsp++ = *ip >> OP_SHIFT; break;
+	    case ADD: case SUB: case MULT: case DIV: case AND: case OR:
+	    case GT: case GE: case EQ: case NE: case LT: case LE:
+	    case POW: case ATAN2:
+		b = *--rsp;
+		a = *--rsp;
+		*rsp++ = opReg (x, op, a, b);
+		break;
+	    default:	/* all the rest are unary */
+		a = *--rsp;
+		*rsp++ = opReg (x, op, a, a);
+		break;
+	    }
+	}
+
+	x->resreg = rstack[0];
+}
+
+/* return the regs[] holding constant v, adding one if new */
+static int
+constReg (Expr *x, double v)
+{
+	int i;
+
+	for (i = x->nvars; i < x->nregs; i++)
+	    if (x->isconst[i] && !memcmp (&x->regs[i], &v, sizeof(v)))
+		return (i);
+	x->isconst[x->nregs] = 1;
+	x->regs[x->nregs] = v;
+	return (x->nregs++);
+}
+
+/* return the regs[] that will hold op applied to regs a and b.
+ * if both are constants the result is just another constant; if the same
+ * op has already been applied to the same regs reuse its result; else add
+ * a new instruction.
+ */
+static int
+opReg (Expr *x, int op, int a, int b)
+{
+	int commutes = op == ADD || op == MULT || op == AND || op == OR
+				    || op == EQ || op == NE;
+	RInstr *rp;
+
+	if (x->isconst[a] && x->isconst[b])
+	    return (constReg (x, apply (op, x->regs[a], x->regs[b])));
+
+	for (rp = x->rcode; rp < &x->rcode[x->nrcode]; rp++)
+	    if (rp->op == op && ((rp->a == a && rp->b == b)
+				    || (commutes && rp->a == b && rp->b == a)))
+		return (rp->dst);
+
+	rp = &x->rcode[x->nrcode++];
+	rp->op = op;
+	rp->a = a;
+	rp->b = b;
+	rp->dst = x->nregs;
+	x->isconst[x->nregs] = 0;
+	return (x->nregs++);
+}
+
+/* return op applied to a and, if binary, b, exactly as execute() would */
+static double
+apply (int op, double a, double b)
+{
+	switch (op) {
+	case ADD:	return (a + b);
+	case SUB:	return (a - b);
+	case MULT:	return (a * b);
+	case DIV:	return (a / b);
+	case AND:	return (a && b ? 1 : 0);
+	case OR:	return (a || b ? 1 : 0);
+	case GT:	return (a >  b ? 1 : 0);
+	case GE:	return (a >= b ? 1 : 0);
+	case EQ:	return (a == b ? 1 : 0);
+	case NE:	return (a != b ? 1 : 0);
+	case LT:	return (a <  b ? 1 : 0);
+	case LE:	return (a <= b ? 1 : 0);
+	case NEG:	return (-a);
+	case NOT:	return ((double)(a==0));
+	case ABS:	return (fabs (a));
+	case FLOOR:	return (floor (a));
+	case SIN:	return (sin (a));
+	case COS:	return (cos (a));
+	case TAN:	return (tan (a));
+	case ASIN:	return (asin (a));
+	case ACOS:	return (acos (a));
+	case ATAN:	return (atan (a));
+	case DEGRAD:	return (a * (atan(1.0)/45.0));
+	case RADDEG:	return (a * (45.0/atan(1.0)));
+	case LOG:	return (log (a));
+	case LOG10:	return (log10 (a));
+	case EXP:	return (exp (a));
+	case SQRT:	return (sqrt (a));
+	case POW:	return (pow (a, b));
+	case ATAN2:	return (atan2 (a, b));
+	}
+	return (0);	/* can't happen */
+}
+
+/* run rcode[] built by regCompile().
+ * return 0 and the result, or -1 with a reason why not message in err_msg.
+ */
+static int
+rexecute (Expr *x, double *result)
+{
+	RInstr *ip, *end = &x->rcode[x->nrcode];
+	double *r = x->regs;
+
+	for (ip = x->rcode; ip < end; ip++) {
+	    double a = r[ip->a], b = r[ip->b];
+	    double *d = &r[ip->dst];
+
+	    switch (ip->op) {
+	    case ADD:	*d = a + b; break;
+	    case SUB:	*d = a - b; break;
+	    case MULT:	*d = a * b; break;
+	    case DIV:	*d = a / b; break;
+	    case AND:	*d = a && b ? 1 : 0; break;
+	    case OR:	*d = a || b ? 1 : 0; break;
+	    case GT:	*d = a >  b ? 1 : 0; break;
+	    case GE:	*d = a >= b ? 1 : 0; break;
+	    case EQ:	*d = a == b ? 1 : 0; break;
+	    case NE:	*d = a != b ? 1 : 0; break;
+	    case LT:	*d = a <  b ? 1 : 0; break;
+	    case LE:	*d = a <= b ? 1 : 0; break;
+	    case NEG:	*d = -a; break;
+	    case NOT:	*d = (double)(a==0); break;
+	    case ABS:	*d = fabs (a); break;
+	    case FLOOR:	*d = floor (a); break;
+	    case SIN:	*d = sin (a); break;
+	    case COS:	*d = cos (a); break;
+	    case TAN:	*d = tan (a); break;
+	    case ASIN:	*d = asin (a); break;
+	    case ACOS:	*d = acos (a); break;
+	    case ATAN:	*d = atan (a); break;
+	    case DEGRAD:*d = a * (atan(1.0)/45.0); break;
+	    case RADDEG:*d = a * (45.0/atan(1.0)); break;
+	    case LOG:	*d = log (a); break;
+	    case LOG10:	*d = log10 (a); break;
+	    case EXP:	*d = exp (a); break;
+	    case SQRT:	*d = sqrt (a); break;
+	    case POW:	*d = pow (a, b); break;
+	    case ATAN2:	*d = atan2 (a, b); break;
+	    default:
+		(void) sprintf (x->err_msg, "Bug! bad register opcode: 0x%x", ip->op);
+		return (-1);
+	    }
+	}
+
+	*result = r[x->resreg];
+	return (0);
+}
 
 /* starting with lcexpr pointing at a string expected to be a field name,
  * ie, at a '"', fill into up to the next '"' into name[], including trailing 0.
@@ -643,13 +1032,13 @@ execute(double *result)
  * when return, leave lcexpr alone but move cexpr to just after the second '"'.
  */
 static int
-parse_fieldname (char name[], int len)
+parse_fieldname (Expr *x, char name[], int len)
 {
 	char c = '\0';
 	int ndots = 0;
 
-	cexpr = lcexpr + 1;
-	while (--len > 0 && (c = *cexpr++) != '"' && c) {
+	x->cexpr = x->lcexpr + 1;
+	while (--len > 0 && (c = *x->cexpr++) != '"' && c) {
 	    *name++ = c;
 	    ndots += c == '.';
 	}
@@ -658,3 +1047,198 @@ parse_fieldname (char name[], int len)
 	*name = '\0';
 	return (0);
 }
+
+#ifdef COMPILER_BENCH
+/* standalone benchmark that reports how fast expressions typical of
+ * interlock watchers evaluate with the register machine compared with the
+ * original stack interpreter, after checking the two agree exactly.
+ * make exprbench
+ */
+
+#include <sys/time.h>
+
+/* return seconds since some epoch */
+static double
+secs(void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec*1e-6);
+}
+
+static const char *bexprs[] = {
+    "\"Mount.Pos.Alt\" > 15 && \"Mount.Pos.Alt\" < 89",
+    "abs(\"Dome.Pos.Az\" - \"Mount.Pos.Az\") < 2 || \"Dome.Pos._STATE\" == 3",
+    "sqrt(pow(\"Mount.Err.X\"*raddeg(1)/3600,2) + pow(\"Mount.Err.Y\"*raddeg(1)/3600,2)) < degrad(0.5)*2*pi",
+    "(\"Enc.Temp.A\" + \"Enc.Temp.B\" + \"Enc.Temp.C\")/3 - \"Enc.Temp.Out\" > 2 && "
+	"(\"Enc.Temp.A\" + \"Enc.Temp.B\" + \"Enc.Temp.C\")/3 < 20 && !\"Enc.Alarm.On\"",
+    "sin(\"Mount.Pos.Alt\"*pi/180)*cos(\"Mount.Pos.Az\"*pi/180) + "
+	"sin(\"Mount.Pos.Alt\"*pi/180)*sin(\"Mount.Pos.Az\"*pi/180) > 0.5*atan2(1,1)",
+    "\"Time.Now.UNIX\" - \"Camera.Expose._TS\" > 3600*24/86400*60",
+};
+#define	NBEXPRS	((int)(sizeof(bexprs)/sizeof(bexprs[0])))
+
+/* return a malloced string of n1 rep1 then n2 rep2 then tail then n3 ) */
+static char *
+repeat (const char *rep1, int n1, const char *rep2, int n2, const char *tail,
+int n3)
+{
+	int l1 = strlen(rep1), l2 = strlen(rep2), tl = strlen(tail);
+	char *s = (char *) malloc (n1*l1 + n2*l2 + tl + n3 + 1);
+	char *p = s;
+	int i;
+
+	for (i = 0; i < n1; i++, p += l1)
+	    memcpy (p, rep1, l1);
+	for (i = 0; i < n2; i++, p += l2)
+	    memcpy (p, rep2, l2);
+	memcpy (p, tail, tl);
+	p += tl;
+	for (i = 0; i < n3; i++)
+	    *p++ = ')';
+	*p = '\0';
+	return (s);
+}
+
+/* check expressions that must be refused stay within program[] and the
+ * stack, and that ones just inside the limits still compile and agree.
+ * return number of failures.
+ */
+static int
+limitCheck (void)
+{
+	static const struct {
+	    const char *rep1;		/* repeated n1 times */
+	    int n1;
+	    const char *rep2;		/* then this n2 times */
+	    int n2;
+	    const char *tail;		/* then this */
+	    int n3;			/* then this many ) */
+	    int ok;			/* whether it should compile */
+	} lc[] = {
+	    {"-", 20000, "", 0, "1", 0, 0},
+	    {"!", 20000, "", 0, "1", 0, 0},
+	    {"(", 2000000, "", 0, "1", 0, 0},
+	    {"abs(", 100000, "", 0, "1", 0, 0},
+	    {"-(", 100, "1+", 5000, "1", 100, 0},
+	    {"!(", 100, "\"a.b.c\"*", 5000, "1", 100, 0},
+	    {"1+", 5000, "", 0, "1", 0, 0},
+	    {"(", MAX_NEST, "", 0, "\"a.b.c\"", MAX_NEST, 0},
+	    {"(", MAX_NEST-1, "", 0, "\"a.b.c\"", MAX_NEST-1, 1},
+	    {"-!", MAX_NEST/2 - 1, "", 0, "\"a.b.c\"", 0, 1},
+	    {"abs(-", MAX_NEST/2 - 1, "", 0, "\"a.b.c\"", MAX_NEST/2 - 1, 1},
+	};
+	char errmsg[1024];
+	int i, nbad = 0;
+
+	for (i = 0; i < (int)(sizeof(lc)/sizeof(lc[0])); i++) {
+	    char *expr = repeat (lc[i].rep1, lc[i].n1, lc[i].rep2, lc[i].n2,
+						    lc[i].tail, lc[i].n3);
+	    Expr *x = newExpr();
+	    double v1, v2;
+	    int r;
+
+	    errmsg[0] = '\0';
+	    r = exprCompile (x, expr, errmsg);
+	    if (x->pc - x->program > MAX_PROG) {
+		printf ("limit %d: program overrun by %ld\n", i,
+					(long)(x->pc - x->program - MAX_PROG));
+		nbad++;
+	    }
+	    if ((r == 0) != lc[i].ok) {
+		printf ("limit %d: %s: %s\n", i, r ? "refused" : "accepted",
+									errmsg);
+		nbad++;
+	    }
+	    if (r == 0) {
+		VARV(x,0) = 3;
+		x->err_msg = errmsg;
+		if (execute (x, &v1) < 0 || rexecute (x, &v2) < 0 || v1 != v2) {
+		    printf ("limit %d: mismatch %g %g\n", i, v1, v2);
+		    nbad++;
+		}
+	    }
+
+	    /* x must still be usable */
+	    if (exprCompile (x, (char *)"1+2", errmsg) < 0
+				|| exprEval (x, &v1, errmsg) < 0 || v1 != 3) {
+		printf ("limit %d: not reusable\n", i);
+		nbad++;
+	    }
+
+	    delExpr (x);
+	    free (expr);
+	}
+
+	return (nbad);
+}
+
+int
+main (int ac, char *av[])
+{
+	int n = ac > 1 ? atoi(av[1]) : 2000000;
+	double tstack = 0, treg = 0;
+	char errmsg[1024];
+	int e, i, j, nbad;
+
+	nbad = limitCheck();
+	printf ("limit check: %s\n", nbad ? "FAILED" : "ok");
+	if (ac > 1 && !strcmp (av[1], "-c"))
+	    return (nbad ? 1 : 0);
+
+	for (e = 0; e < NBEXPRS; e++) {
+	    double t0, t1, t2, v1, v2, sum1, sum2;
+	    char *expr = strcpy ((char *)malloc(strlen(bexprs[e])+1), bexprs[e]);
+	    Expr *x = newExpr();
+
+	    if (exprCompile (x, expr, errmsg) < 0) {
+		printf ("%s: %s\n", bexprs[e], errmsg);
+		return (1);
+	    }
+
+	    /* check agreement over many operand values */
+	    for (i = 0; i < 100000; i++) {
+		for (j = 0; j < x->nvars; j++)
+		    VARV(x,j) = (rand() - RAND_MAX/2) * 200.0 / RAND_MAX;
+		x->err_msg = errmsg;
+		if (execute (x, &v1) < 0 || rexecute (x, &v2) < 0
+					|| memcmp (&v1, &v2, sizeof(v1))) {
+		    if (nbad++ < 10)
+			printf ("mismatch %s: %.17g %.17g\n", bexprs[e], v1, v2);
+		}
+	    }
+
+	    sum1 = 0;
+	    t0 = secs();
+	    for (i = 0; i < n; i++) {
+		VARV(x,0) = i;
+		execute (x, &v1);
+		sum1 += v1;
+	    }
+	    t1 = secs() - t0;
+
+	    sum2 = 0;
+	    t0 = secs();
+	    for (i = 0; i < n; i++) {
+		VARV(x,0) = i;
+		rexecute (x, &v2);
+		sum2 += v2;
+	    }
+	    t2 = secs() - t0;
+	    if (memcmp (&sum1, &sum2, sizeof(sum1)))
+		nbad++;
+
+	    printf ("%2d: %3d ops -> %3d   stack %6.2f M/s   register %6.2f M/s  %.1fx\n",
+		e, (int)(x->pc - x->program), x->nrcode, n/t1/1e6, n/t2/1e6, t1/t2);
+	    tstack += t1;
+	    treg += t2;
+	    delExpr (x);
+	    free (expr);
+	}
+
+	printf ("all: stack %.2f M/s  register %.2f M/s  %.1fx\n",
+	    NBEXPRS*n/tstack/1e6, NBEXPRS*n/treg/1e6, tstack/treg);
+	printf ("%s\n", nbad ? "FAILED" : "ok");
+	return (nbad ? 1 : 0);
+}
+#endif /* COMPILER_BENCH */
@@ -0,0 +1,27 @@
+/* interface to the expression compiler, compiler.c.
+ * each Expr holds one compiled expression and its operand values.
+ */
+
+typedef struct Expr Expr;
+
+extern Expr *newExpr (void);
+extern void delExpr (Expr *x);
+extern int exprCompile (Expr *x, char *exp, char *errbuf);
+extern int exprEval (Expr *x, double *vp, char *errbuf);
+extern int exprSetOperand (Expr *x, char *name, double valu);
+extern int exprOperandIndex (Expr *x, char *name);
+extern void exprSetOperandIndex (Expr *x, int i, double valu);
+extern int exprAllOperandsSet (Expr *x);
+extern int exprGetAllOperands (Expr *x, char ***ops);
+extern int exprGetSetOperands (Expr *x, char ***ops);
+extern int exprGetUnsetOperands (Expr *x, char ***ops);
+
+/* the same using one built-in Expr */
+extern int compileExpr (char *exp, char *errbuf);
+extern int evalExpr (double *vp, char *errbuf);
+extern int setOperand (char *name, double valu);
+extern int allOperandsSet (void);
+extern int getAllOperands (char ***ops);
+extern int getSetOperands (char ***ops);
+extern int getUnsetOperands (char ***ops);
+extern void compiler_log (char *name, double value);
@@ -8,6 +8,11 @@
  * watch for messages until get initial values of each operand
  * evaluate expression, repeat if -w each time an op arrives until true
  * exit val==0
+ *
+ * with -x, compile each named expression in the file into its own context
+ * and index each operand to the expressions that use it. as operands arrive
+ * over the one connection, evaluate just those expressions with an operand
+ * that changed, once all of theirs have been seen.
  */
 
 #include <stdio.h>
@@ -25,18 +30,61 @@
 
 #include "indiapi.h"
 #include "connect_to.h"
+#include "serverxml.h"
 #include "lilxml.h"
+#include "compiler.h"
 
-extern int compileExpr (char *expr, char *errmsg);
-extern int evalExpr (double *vp, char *errmsg);
-extern int allOperandsSet (void);
-extern int getAllOperands (char ***ops);
-extern int getSetOperands (char ***ops);
-extern int getUnsetOperands (char ***ops);
-extern int setOperand (char *name, double valu);
+/* one named expression from the -x file, or just the one expression */
+typedef struct {
+    char *name;			/* name given in the file */
+    char *exp;			/* expression, as given */
+    Expr *x;			/* compiled expression */
+    int nunset;			/* n operands not yet seen */
+    int evaled;			/* set once evaluated */
+    int dirty;			/* set while in dirtyx[] */
+    double v;			/* latest value */
+} NamedExpr;
+
+/* one use of an operand */
+typedef struct {
+    int ex;			/* nexprs[] index */
+    int vx;			/* operand index within nexprs[ex].x */
+} Dep;
+
+/* one operand used by any expression */
+typedef struct Operand {
+    char *name;			/* device.name.element */
+    int set;			/* set once a value has been seen */
+    double v;			/* latest value */
+    Dep *deps;			/* each expression that uses this operand */
+    int ndeps;			/* number of deps[] */
+    struct Operand *next;	/* next in same ophash[] chain */
+} Operand;
+
+/* one device.name prefix of any operand, so whole vectors no expression
+ * uses can be skipped without looking at their elements.
+ */
+typedef struct Vector {
+    char *dn;			/* device.name */
+    int ldn;			/* strlen(dn) */
+    unsigned h;			/* fnv() of dn */
+    struct Vector *next;	/* next in same vechash[] chain */
+} Vector;
 
 static void usage (void);
 static void compile (char *expr);
+static void compileFile (char *fn);
+static int addExpr (char *name, char *exp, char *errmsg);
+static Operand *findOperand (char *name, int add);
+static void addVectors (char *name);
+static Vector *findVector (char *d, char *n);
+static Operand *findElement (Vector *vp, char *e);
+static unsigned fnv (unsigned h, const char *s);
+static void setValue (Operand *op, double v);
+static int runEvals (void);
+static void newValue (NamedExpr *np, double v);
+static void sendExprs (void);
+static int runServerEvals (void);
 static void openINDIServer (void);
 static void getProps(void);
 static void initProps (void);
@@ -45,8 +93,9 @@ static time_t timestamp (char *ts);
 static int devcmp (char *op1, char *op2);
 static int runEval (void);
 static int setOp (XMLEle *root);
+static int nxtOp (void);
 static XMLEle *nxtEle (void);
-static int readServerChar (void);
+static void serverGone (void);
 static void onAlarm (int dummy);
 static void bye(int n);
 
@@ -68,6 +117,22 @@ static int oflag;			/* print operands as they change */
 static int wflag;			/* wait for expression to be true */
 static int bflag;			/* beep when true */
 static int qflag;			/* suppress some error messages */
+static char *xfile;			/* file of named expressions, if -x */
+static int sflag;			/* let the server evaluate */
+
+static NamedExpr *nexprs;		/* each named expression, or just one */
+static int nnexprs;			/* number of nexprs[] */
+static int *dirtyx;			/* nexprs[] in need of evaluation, if -x*/
+static int ndirtyx;			/* number of dirtyx[] in use */
+static int nevaled;			/* n nexprs[] evaluated at least once */
+static int ntrue;			/* n nexprs[] with latest value non-0 */
+#define	NOPHASH		1024		/* n operand hash chains, power of 2 */
+static Operand *ophash[NOPHASH];	/* each operand, by name */
+static Operand **oplist;		/* each operand, in order of first use*/
+static int noplist;			/* number of oplist[] */
+#define	NVECHASH	256		/* n vector hash chains, power of 2 */
+static Vector *vechash[NVECHASH];	/* each device.name used, by name */
+#define	FNV0		2166136261u	/* fnv() starting value */
 
 int
 main (int ac, char *av[])
@@ -133,6 +198,9 @@ main (int ac, char *av[])
 		case 'q':	/* quiet */
 		    qflag++;
 		    break;
+		case 's':	/* let the server evaluate */
+		    sflag++;
+		    break;
 		case 't':
 		    if (ac < 2) {
 			fprintf (stderr, "-t requires timeout\n");
@@ -147,6 +215,14 @@ main (int ac, char *av[])
 		case 'w':	/* wait for expression to be true */
 		    wflag++;
 		    break;
+		case 'x':	/* file of named expressions */
+		    if (ac < 2) {
+			fprintf (stderr, "-x requires file name\n");
+			usage();
+		    }
+		    xfile = *++av;
+		    ac--;
+		    break;
 		default:
 		    fprintf (stderr, "Unknown flag: %c\n", *s);
 		    usage();
@@ -156,8 +232,18 @@ main (int ac, char *av[])
 
 	/* now there are ac args starting with av[0] */
 
-	/* compile expression from av[0] or stdin */
-	if (ac == 0)
+	/* server only reports expressions */
+	if (sflag && oflag) {
+	    fprintf (stderr, "Can not combine -s and -o\n");
+	    usage();
+	}
+
+	/* compile expression(s) from xfile, av[0] or stdin */
+	if (xfile) {
+	    if (ac > 0 || iflag)
+		usage();
+	    compileFile (xfile);
+	} else if (ac == 0)
 	    compile (NULL);
 	else if (ac == 1)
 	    compile (av[0]);
@@ -172,7 +258,6 @@ main (int ac, char *av[])
 		fprintf (stderr, "Direct fd %d is not valid\n", directfd);
 		exit(1);
 	    }
-	    setbuf (svrrfp, NULL);		/* don't absorb next guy's stuff */
 	    setbuf (svrwfp, NULL);		/* immediate writes */
 	    if (verbose)
 		fprintf (stderr, "Using direct fd %d\n", directfd);
@@ -182,15 +267,28 @@ main (int ac, char *av[])
 		fprintf (stderr, "Connected to %s on port %d\n", host, port);
 	}
 
-	/* build a parser context for cracking XML responses */
+	/* build a parser context for cracking XML responses, and read in bulk
+	 * but don't absorb next guy's stuff if direct
+	 */
 	lillp = newLilXML();
+	initServerXML (fileno(svrrfp), directfd >= 0, verbose > 2 ? stderr : NULL);
 
 	/* set up to catch an io timeout function */
 	signal (SIGALRM, onAlarm);
 
+	/* let the server evaluate and report when each changes */
+	if (sflag) {
+	    sendExprs();
+	    return (runServerEvals());
+	}
+
 	/* send getProperties */
 	getProps();
 
+	/* evaluate each named expression as its operands arrive */
+	if (xfile)
+	    return (runEvals());
+
 	/* initialize all properties */
 	initProps();
 
@@ -215,9 +313,11 @@ usage()
 	fprintf (stderr, "   -o   : print operands as they change\n");
 	fprintf (stderr, "   -p p : alternate port, default is %d\n", INDIPORT);
 	fprintf (stderr, "   -q   : suppress some error messages\n");
+	fprintf (stderr, "   -s   : let indiserver evaluate, reporting only changes between 0 and non-0\n");
 	fprintf (stderr, "   -t t : max secs to wait, 0 is forever, default is %d\n",TIMEOUT);
 	fprintf (stderr, "   -v   : verbose (cummulative)\n");
 	fprintf (stderr, "   -w   : wait for expression to evaluate as true\n");
+	fprintf (stderr, "   -x f : evaluate each \"name exp\" line in file f, - for stdin\n");
 	fprintf (stderr, "[exp] is an arith expression built from the following operators and functons:\n");
 	fprintf (stderr, "     ! + - * / && || > >= == != < <=\n");
 	fprintf (stderr, "     pi sin(rad) cos(rad) tan(rad) asin(x) acos(x) atan(x) atan2(y,x) abs(x)\n");
@@ -235,7 +335,10 @@ usage()
 	fprintf (stderr, "     evalINDI '\"Security.Security._STATE\"==1'\n");
 	fprintf (stderr, "   To wait for RA and Dec to be near zero and watch their values as they change:\n");
 	fprintf (stderr, "     evalINDI -t 0 -wo 'abs(\"Mount.EqJ2K.RA\")<.01 && abs(\"Mount.EqJ2K.Dec\")<.01'\n");
+	fprintf (stderr, "   To wait for several interlocks all to be true, printing each as it changes:\n");
+	fprintf (stderr, "     evalINDI -t 0 -we -x interlocks.txt\n");
 	fprintf (stderr, "Exit 0 if expression evaluates to non-0, 1 if 0, else 2\n");
+	fprintf (stderr, "With -x, exit 0 if every expression evaluates to non-0, 1 if not, else 2\n");
 
 	exit (1);
 }
@@ -260,7 +363,7 @@ compile (char *expr)
 
 	if (verbose)
 	    fprintf (stderr, "Compiling: %s\n", exp);
-	if (compileExpr (exp, errmsg) < 0) {
+	if (addExpr ((char *)"exp", exp, errmsg) < 0) {
 	    fprintf (stderr, "Compile err: %s\n", errmsg);
 	    bye(2);
 	}
@@ -269,6 +372,200 @@ compile (char *expr)
 	    free (exp);
 }
 
+/* compile each "name expression" line in the given file, or stdin if "-".
+ * blank lines and those beginning with # are ignored.
+ * exit(2) if trouble.
+ */
+static void
+compileFile (char *fn)
+{
+	FILE *fp = strcmp (fn, "-") ? fopen (fn, "r") : stdin;
+	char line[4096], errmsg[1024];
+	int lineno = 0;
+
+	if (!fp) {
+	    perror (fn);
+	    bye(2);
+	}
+
+	while (fgets (line, sizeof(line), fp)) {
+	    char *name, *exp;
+
+	    lineno++;
+	    if (!strchr (line, '\n') && !feof (fp)) {
+		fprintf (stderr, "%s:%d: line too long\n", fn, lineno);
+		bye(2);
+	    }
+	    line[strcspn (line, "\r\n")] = '\0';
+
+	    /* name is the first word, expression is the rest */
+	    name = line + strspn (line, " \t");
+	    if (!name[0] || name[0] == '#')
+		continue;
+	    exp = name + strcspn (name, " \t");
+	    if (exp[0])
+		*exp++ = '\0';
+	    exp += strspn (exp, " \t");
+	    if (!exp[0]) {
+		fprintf (stderr, "%s:%d: no expression for %s\n", fn, lineno, name);
+		bye(2);
+	    }
+
+	    if (verbose)
+		fprintf (stderr, "Compiling %s: %s\n", name, exp);
+	    if (addExpr (name, exp, errmsg) < 0) {
+		fprintf (stderr, "%s:%d: compile err: %s\n", fn, lineno, errmsg);
+		bye(2);
+	    }
+	}
+
+	if (fp != stdin)
+	    fclose (fp);
+	if (nnexprs == 0) {
+	    fprintf (stderr, "%s: no expressions\n", fn);
+	    bye(2);
+	}
+}
+
+/* compile exp as a new nexprs[] with the given name, and add it to the deps[]
+ * of each of its operands.
+ * return 0 if ok else -1 with reason in errmsg[].
+ */
+static int
+addExpr (char *name, char *exp, char *errmsg)
+{
+	NamedExpr *np;
+	char **ops;
+	int i, nops;
+
+	nexprs = (NamedExpr *) realloc (nexprs, (nnexprs+1)*sizeof(NamedExpr));
+	dirtyx = (int *) realloc (dirtyx, (nnexprs+1)*sizeof(int));
+	np = &nexprs[nnexprs];
+	memset (np, 0, sizeof(*np));
+	np->x = newExpr();
+	if (exprCompile (np->x, exp, errmsg) < 0)
+	    return (-1);
+	np->name = strcpy ((char *) malloc (strlen(name)+1), name);
+	np->exp = strcpy ((char *) malloc (strlen(exp)+1), exp);
+
+	/* index each operand to this expression */
+	nops = exprGetAllOperands (np->x, &ops);
+	for (i = 0; i < nops; i++) {
+	    Operand *op = findOperand (ops[i], 1);
+	    op->deps = (Dep *) realloc (op->deps, (op->ndeps+1)*sizeof(Dep));
+	    op->deps[op->ndeps].ex = nnexprs;
+	    op->deps[op->ndeps].vx = exprOperandIndex (np->x, ops[i]);
+	    op->ndeps++;
+	}
+	free (ops);
+	np->nunset = nops;
+	nnexprs++;
+
+	return (0);
+}
+
+/* return the Operand with the given name.
+ * if not found return NULL, or a new one if add.
+ */
+static Operand *
+findOperand (char *name, int add)
+{
+	Operand **opp = &ophash[fnv (FNV0, name) & (NOPHASH-1)];
+	Operand *op;
+
+	for (op = *opp; op; op = op->next)
+	    if (!strcmp (op->name, name))
+		return (op);
+	if (!add)
+	    return (NULL);
+
+	op = (Operand *) calloc (1, sizeof(Operand));
+	op->name = strcpy ((char *) malloc (strlen(name)+1), name);
+	op->next = *opp;
+	*opp = op;
+	oplist = (Operand **) realloc (oplist, (noplist+1)*sizeof(Operand *));
+	oplist[noplist++] = op;
+	addVectors (name);
+	return (op);
+}
+
+/* add each device.name prefix the given operand could have to vechash[].
+ * that is just one unless the device or property name includes a dot.
+ */
+static void
+addVectors (char *name)
+{
+	char *dot;
+
+	for (dot = strchr (strchr (name, '.') + 1, '.'); dot;
+						    dot = strchr (dot + 1, '.')) {
+	    int ldn = dot - name;
+	    char *dn = (char *) malloc (ldn + 1);
+	    Vector *vp, **vpp;
+	    unsigned h;
+
+	    memcpy (dn, name, ldn);
+	    dn[ldn] = '\0';
+	    h = fnv (FNV0, dn);
+	    vpp = &vechash[h & (NVECHASH-1)];
+	    for (vp = *vpp; vp; vp = vp->next)
+		if (!strcmp (vp->dn, dn))
+		    break;
+	    if (vp) {
+		free (dn);
+		continue;
+	    }
+
+	    vp = (Vector *) malloc (sizeof(Vector));
+	    vp->dn = dn;
+	    vp->ldn = ldn;
+	    vp->h = h;
+	    vp->next = *vpp;
+	    *vpp = vp;
+	}
+}
+
+/* return the Vector for device d property n if any operand uses it, else NULL.
+ */
+static Vector *
+findVector (char *d, char *n)
+{
+	unsigned h = fnv (fnv (fnv (FNV0, d), "."), n);
+	int ld = strlen (d);
+	Vector *vp;
+
+	for (vp = vechash[h & (NVECHASH-1)]; vp; vp = vp->next)
+	    if (vp->h == h && !strncmp (vp->dn, d, ld) && vp->dn[ld] == '.'
+						    && !strcmp (vp->dn+ld+1, n))
+		return (vp);
+	return (NULL);
+}
+
+/* return the Operand for element e of the given Vector, else NULL.
+ * N.B. the operand name is never formatted, its hash just continues from vp's.
+ */
+static Operand *
+findElement (Vector *vp, char *e)
+{
+	unsigned h = fnv (fnv (vp->h, "."), e);
+	Operand *op;
+
+	for (op = ophash[h & (NOPHASH-1)]; op; op = op->next)
+	    if (!strncmp (op->name, vp->dn, vp->ldn) && op->name[vp->ldn] == '.'
+						&& !strcmp (op->name+vp->ldn+1, e))
+		return (op);
+	return (NULL);
+}
+
+/* return the FNV-1a hash h continued over string s */
+static unsigned
+fnv (unsigned h, const char *s)
+{
+	while (*s)
+	    h = (h ^ (unsigned char)*s++) * 16777619u;
+	return (h);
+}
+
 /* open a connection to the given host and port or die.
  * exit if trouble.
  */
@@ -322,8 +619,10 @@ getProps()
 	int nops;
 	int i, j;
 
-	/* get each operand used in the expression */
-	nops = getAllOperands (&ops);
+	/* get each operand used in the expression(s) */
+	ops = (char **) malloc ((noplist+1) * sizeof(char *));
+	for (nops = 0; nops < noplist; nops++)
+	    ops[nops] = oplist[nops]->name;
 
 	/* send getProperties for each unique device referenced */
 	for (i = 0; i < nops; i++) {
@@ -338,6 +637,7 @@ getProps()
 	    fprintf (svrwfp, "<getProperties version='%g' device='%.*s'/>\n", INDIV,
 					(int)(strchr (ops[i],'.')-ops[i]), ops[i]);
 	}
+	free (ops);
 }
 
 /* wait for defXXX or setXXX for each property in the expression.
@@ -348,39 +648,42 @@ static void
 initProps ()
 {
 	alarm (timeout);
-	while (allOperandsSet() < 0) {
-	    if (setOp (nxtEle ()) == 0)
+	while (nexprs[0].nunset > 0) {
+	    if (nxtOp () == 0)
 		alarm(timeout);
 	}
 	alarm (0);
 }
 
 /* pull apart the name and value from the given message, and set operand value.
- * ignore any other messages.
+ * ignore any other messages, and any vector no operand refers to without
+ * looking at its elements.
  * return 0 if found a recognized operand else -1
  */
 static int
 setOp (XMLEle *root)
 {
 	char *t = tagXMLEle (root);
-	char *d = findXMLAttValu (root, "device");
-	char *n = findXMLAttValu (root, "name");
+	Vector *vp;
+	Operand *op;
 	int nset = 0;
-	double v;
-	char prop[1024];
 	XMLEle *ep;
 
+	/* done if no operand in this vector */
+	vp = findVector (findXMLAttValu (root, "device"),
+					    findXMLAttValu (root, "name"));
+	if (!vp)
+	    return (-1);
+
 	/* check values */
 	if (!strcmp (t,"defNumberVector") || !strcmp (t,"setNumberVector")) {
 	    for (ep = nextXMLEle(root,1); ep; ep = nextXMLEle(root,0)) {
 		char *et = tagXMLEle(ep);
 		if (!strcmp (et,"defNumber") || !strcmp (et,"oneNumber")) {
-		    sprintf (prop, "%s.%s.%s", d, n, findXMLAttValu(ep,"name"));
-		    v = atof(pcdataXMLEle(ep));
-		    if (setOperand (prop, v) == 0) {
+		    op = findElement (vp, findXMLAttValu(ep,"name"));
+		    if (op) {
+			setValue (op, atof(pcdataXMLEle(ep)));
 			nset++;
-			if (oflag)
-			    printf ("%s=%g\n", prop, v);
 		    }
 		}
 	    }
@@ -388,12 +691,10 @@ setOp (XMLEle *root)
 	    for (ep = nextXMLEle(root,1); ep; ep = nextXMLEle(root,0)) {
 		char *et = tagXMLEle(ep);
 		if (!strcmp (et,"defSwitch") || !strcmp (et,"oneSwitch")) {
-		    sprintf (prop, "%s.%s.%s", d, n, findXMLAttValu(ep,"name"));
-		    v = (double)!strcmp(pcdataXMLEle(ep),"On");
-		    if (setOperand (prop, v) == 0) {
+		    op = findElement (vp, findXMLAttValu(ep,"name"));
+		    if (op) {
+			setValue (op, (double)!strcmp(pcdataXMLEle(ep),"On"));
 			nset++;
-			if (oflag)
-			    printf ("%s=%g\n", prop, v);
 		    }
 		}
 	    }
@@ -401,12 +702,10 @@ setOp (XMLEle *root)
 	    for (ep = nextXMLEle(root,1); ep; ep = nextXMLEle(root,0)) {
 		char *et = tagXMLEle(ep);
 		if (!strcmp (et,"defLight") || !strcmp (et,"oneLight")) {
-		    sprintf (prop, "%s.%s.%s", d, n, findXMLAttValu(ep,"name"));
-		    v = (double)pstatestr(pcdataXMLEle(ep));
-		    if (setOperand (prop, v) == 0) {
+		    op = findElement (vp, findXMLAttValu(ep,"name"));
+		    if (op) {
+			setValue (op, (double)pstatestr(pcdataXMLEle(ep)));
 			nset++;
-			if (oflag)
-			    printf ("%s=%g\n", prop, v);
 		    }
 		}
 	    }
@@ -414,30 +713,184 @@ setOp (XMLEle *root)
 
 	/* check special elements */
 	t = findXMLAttValu (root, "state");
-	if (t[0]) {
-	    sprintf (prop, "%s.%s._STATE", d, n);
-	    v = (double)pstatestr(t);
-	    if (setOperand (prop, v) == 0) {
-		nset++;
-		if (oflag)
-		    printf ("%s=%g\n", prop, v);
-	    }
+	if (t[0] && (op = findElement (vp, (char *)"_STATE")) != NULL) {
+	    setValue (op, (double)pstatestr(t));
+	    nset++;
 	}
 	t = findXMLAttValu (root, "timestamp");
-	if (t[0]) {
-	    sprintf (prop, "%s.%s._TS", d, n);
-	    v = (double)timestamp(t);
-	    if (setOperand (prop, v) == 0) {
-		nset++;
-		if (oflag)
-		    printf ("%s=%g\n", prop, v);
-	    }
+	if (t[0] && (op = findElement (vp, (char *)"_TS")) != NULL) {
+	    setValue (op, (double)timestamp(t));
+	    nset++;
 	}
 
 	/* return whether any were set */
 	return (nset > 0 ? 0 : -1);
 }
 
+/* set operand op to v in each expression that uses it.
+ * with -x, if it changed, queue those whose operands are now all known for
+ * evaluation.
+ */
+static void
+setValue (Operand *op, double v)
+{
+	int i;
+
+	if (oflag)
+	    printf ("%s=%g\n", op->name, v);
+	if (op->set && op->v == v)
+	    return;
+
+	for (i = 0; i < op->ndeps; i++) {
+	    NamedExpr *np = &nexprs[op->deps[i].ex];
+	    exprSetOperandIndex (np->x, op->deps[i].vx, v);
+	    if (!op->set)
+		np->nunset--;
+	    if (xfile && np->nunset == 0 && !np->dirty) {
+		np->dirty = 1;
+		dirtyx[ndirtyx++] = op->deps[i].ex;
+	    }
+	}
+	op->set = 1;
+	op->v = v;
+}
+
+/* evaluate each named expression once all its operands are known then again
+ * only when one of them changes.
+ * return 0 once all have been evaluated and all are non-0, else 1. with -w
+ * keep going until they are all non-0 at once.
+ * exit(2) if trouble or timeout waiting for operands we expect.
+ */
+static int
+runEvals ()
+{
+	char errmsg[1024];
+	int i;
+
+	/* any without operands are ready now */
+	for (i = 0; i < nnexprs; i++) {
+	    if (nexprs[i].nunset == 0) {
+		nexprs[i].dirty = 1;
+		dirtyx[ndirtyx++] = i;
+	    }
+	}
+
+	alarm(timeout);
+	while (1) {
+	    while (ndirtyx > 0) {
+		NamedExpr *np = &nexprs[dirtyx[--ndirtyx]];
+		double v;
+
+		np->dirty = 0;
+		if (exprEval (np->x, &v, errmsg) < 0) {
+		    fprintf (stderr, "Eval %s: %s\n", np->name, errmsg);
+		    bye(2);
+		}
+		newValue (np, v);
+	    }
+	    if (nevaled == nnexprs && (!wflag || ntrue == nnexprs))
+		break;
+	    while (nxtOp () < 0)
+		continue;
+	    alarm(timeout);
+	}
+	alarm(0);
+
+	if (!eflag && fflag)
+	    for (i = 0; i < nnexprs; i++)
+		printf ("%s=%g\n", nexprs[i].name, nexprs[i].v);
+
+	return (ntrue < nnexprs);
+}
+
+/* record v as the latest value of np, beeping and printing as requested.
+ */
+static void
+newValue (NamedExpr *np, double v)
+{
+	if (bflag && v)
+	    fprintf (stderr, "\a");
+	if (eflag && (!np->evaled || v != np->v)) {
+	    if (xfile)
+		printf ("%s=%g\n", np->name, v);
+	    else
+		printf ("%g\n", v);
+	}
+	if (!np->evaled) {
+	    np->evaled = 1;
+	    nevaled++;
+	} else if (np->v != 0)
+	    ntrue--;
+	if (v != 0)
+	    ntrue++;
+	np->v = v;
+}
+
+/* ask the server to evaluate each expression for us.
+ */
+static void
+sendExprs ()
+{
+	int i;
+
+	for (i = 0; i < nnexprs; i++) {
+	    if (verbose)
+		fprintf (stderr, "sending enableExpr for %s\n", nexprs[i].name);
+	    fprintf (svrwfp, "<enableExpr name='%s'>%s</enableExpr>\n",
+				nexprs[i].name, entityXML (nexprs[i].exp));
+	}
+}
+
+/* the server evaluates each expression and sends setExpr the first time and
+ * then only when it changes between 0 and non-0, we just keep score.
+ * return 0 once all have been reported and all are non-0, else 1. with -w
+ * keep going until they are all non-0 at once.
+ * exit(2) if trouble or timeout.
+ */
+static int
+runServerEvals ()
+{
+	int i;
+
+	alarm(timeout);
+	while (nevaled < nnexprs || (wflag && ntrue < nnexprs)) {
+	    XMLEle *root = nxtEle ();
+	    char *n = findXMLAttValu (root, "name");
+
+	    if (!strcmp (tagXMLEle (root), "setExpr")) {
+		for (i = 0; i < nnexprs; i++)
+		    if (!strcmp (nexprs[i].name, n))
+			break;
+		if (i < nnexprs) {
+		    if (!strcmp (findXMLAttValu (root, "state"), "Alert")) {
+			fprintf (stderr, "Server: %s: %s\n", n,
+					    findXMLAttValu (root, "message"));
+			bye(2);
+		    }
+		    newValue (&nexprs[i], atof (pcdataXMLEle (root)));
+
+		    /* once all are reported the server only sends changes, so
+		     * -w may then wait as long as it takes
+		     */
+		    alarm(nevaled < nnexprs ? timeout : 0);
+		}
+	    }
+	    delXMLEle (root);
+	}
+	alarm(0);
+
+	if (!eflag && fflag) {
+	    for (i = 0; i < nnexprs; i++) {
+		if (xfile)
+		    printf ("%s=%g\n", nexprs[i].name, nexprs[i].v);
+		else
+		    printf ("%g\n", nexprs[i].v);
+	    }
+	}
+
+	return (ntrue < nnexprs);
+}
+
 /* evaluate the expression after seeing any operand change.
  * return whether expression evaluated to 0.
  * exit(2) is trouble or timeout waiting for operands we expect.
@@ -450,7 +903,7 @@ runEval ()
 
 	alarm(timeout);
 	while (1) {
-	    if (evalExpr (&v, errmsg) < 0) {
+	    if (exprEval (nexprs[0].x, &v, errmsg) < 0) {
 		fprintf (stderr, "Eval: %s\n", errmsg);
 		bye(2);
 	    }
@@ -460,7 +913,7 @@ runEval ()
 		printf ("%g\n", v);
 	    if (!wflag || v != 0)
 		break;
-	    while (setOp (nxtEle ()) < 0)
+	    while (nxtOp () < 0)
 		continue;
 	    alarm(timeout);
 	}
@@ -514,6 +967,19 @@ devcmp (char *op1, char *op2)
 	return (n1 != n2 || strncmp (op1,op2,n1));
 }
 
+/* read the next message from the server and set any operands it holds.
+ * return as setOp().
+ */
+static int
+nxtOp ()
+{
+	XMLEle *root = nxtEle ();
+	int r = setOp (root);
+
+	delXMLEle (root);
+	return (r);
+}
+
 /* monitor server and return the next complete XML message.
  * exit(2) if time out.
  * N.B. caller must call delXMLEle()
@@ -525,7 +991,7 @@ nxtEle ()
 
 	/* read from server, exit if trouble or see malformed XML */
 	while(1) {
-	    XMLEle *root = readXMLEle (lillp, readServerChar(), msg);
+	    XMLEle *root = readServerXML (lillp, msg);
 	    if (root) {
 		/* found a complete XML element */
 		if (verbose > 1)
@@ -534,28 +1000,20 @@ nxtEle ()
 	    } else if (msg[0]) {
 		fprintf (stderr, "Bad XML from %s/%d: %s\n", host, port, msg);
 		bye(2);
-	    }
+	    } else
+		serverGone();
 	}
 }
 
-/* read next char from the INDI server connected by svrrfp */
-static int
-readServerChar ()
+/* report why readServerXML() found no more from the server and exit */
+static void
+serverGone ()
 {
-	int c = fgetc (svrrfp);
-
-	if (c == EOF) {
-	    if (ferror(svrrfp))
-		perror ("read");
-	    else
-		fprintf (stderr,"INDI server %s/%d disconnected\n", host, port);
-	    bye (2);
-	}
-
-	if (verbose > 2)
-	    fprintf (stderr, "Read %c\n", c);
-
-	return (c);
+	if (errno)
+	    perror ("read");
+	else
+	    fprintf (stderr,"INDI server %s/%d disconnected\n", host, port);
+	bye (2);
 }
 
 /* called after timeout seconds waiting to hear from server.
@@ -565,11 +1023,24 @@ static void
 onAlarm (int dummy)
 {
 	char **ops;
-	int nops;
+	int nops, i;
 
 	if (!qflag) {
-	    /* report any unseen operands if any, else just say timed out */
-	    if ((nops = getUnsetOperands (&ops)) > 0) {
+	    /* report any unseen operands, or expressions if the server is
+	     * evaluating them, else just say timed out
+	     */
+	    ops = (char **) malloc ((noplist+nnexprs+1) * sizeof(char *));
+	    nops = 0;
+	    if (sflag) {
+		for (i = 0; i < nnexprs; i++)
+		    if (!nexprs[i].evaled)
+			ops[nops++] = nexprs[i].name;
+	    } else {
+		for (i = 0; i < noplist; i++)
+		    if (!oplist[i]->set)
+			ops[nops++] = oplist[i]->name;
+	    }
+	    if (nops > 0) {
 		fprintf (stderr, "No values seen for");
 		while (nops-- > 0)
 		    fprintf (stderr, " %s", ops[nops]);
@@ -24,11 +24,21 @@
  *   will not block when read;
  *
  * timers may be registered that will run no sooner than a specified delay from
- *   the moment they were registered;
+ *   the moment they were registered, or periodically. all timing uses
+ *   CLOCK_MONOTONIC in nanoseconds so it is immune to changes of the time of
+ *   day, such as by ntp;
  *
  * work procedures may be registered that are called when there is nothing
  *   else to do;
  *
+ * jobs may be submitted to run on a bounded pool of worker threads, each
+ *   followed by a completion function called back on the event loop thread;
+ *
+ * on linux the file descriptors are watched with epoll and the soonest timer
+ *   with a timerfd, so the cost of waiting does not grow with the number of
+ *   callbacks. all fds found ready by one wait are dispatched before waiting
+ *   again. elsewhere, or if EVENTLOOP_SELECT is defined, select(2) is used.
+ *
  #define MAIN_TEST for a stand-alone test program.
  */
 
@@ -36,10 +46,24 @@
 #include <stdlib.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
 #include <time.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#if defined(__linux__) && !defined(EVENTLOOP_SELECT)
+#define	USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#if defined(__linux__)
+#define	USE_EVENTFD
+#include <sys/eventfd.h>
+#endif
 
 #include "eventloop.h"
 
@@ -56,27 +80,42 @@ typedef struct {
     int fd;				/* fd descriptor to watch for read */
     void *ud;				/* user's data handle */
     CBF *fp;				/* callback function */
+    int always;				/* fd epoll can not watch, always ready */
 } CB;
 static CB *cback;			/* malloced list of callbacks */
 static int ncback;			/* n entries in cback[] */
 static int ncbinuse;			/* n entries in cback[] marked in_use */
 static int lastcb;			/* cback index of last cb called */
 
+/* how late timers have been called, accumulated with Welford's method */
+typedef struct {
+    long n;				/* n calls */
+    long nmissed;			/* n periods skipped */
+    double mean;			/* mean ns late */
+    double m2;				/* sum of squared ns from mean */
+    double max;				/* max ns late */
+} TFStats;
+
 /* info about one registered timer function.
- * the entries are kept sorted by decreasing time from epoch, ie,
- *   the next entry to fire is at the end of the array.
+ * the entries form a binary heap ordered by trigger time then id, ie,
+ *   timef[0] is the next to fire and each entry fires no sooner than its
+ *   parent. so adding or removing one costs O(log n).
+ * a periodic timer stays in the heap with tgo advanced by exactly its period
+ *   each time, so it never drifts however late it is called.
  */
 typedef struct {
-    double tgo;				/* trigger time, ms from epoch */
+    int64_t tgo;			/* trigger time, CLOCK_MONOTONIC ns */
+    int64_t period;			/* ns between periodic calls, 0 once only */
     void *ud;				/* user's data handle */
     TCF *fp;				/* timer function */
+    TFStats *sp;			/* malloced stats if periodic */
     int tid;				/* unique id for this timer */
 } TF;
-static TF *timef;			/* malloced list of timer functions */
-static int ntimef;			/* n entries in ntimef[] */
+static TF *timef;			/* malloced heap of timer functions */
+static int ntimef;			/* n entries in timef[] */
+static int mtimef;			/* n entries malloced in timef[] */
 static int tid;				/* source of unique timer ids */
-#define	EPOCHDT(tp) 			/* ms from epoch to timeval *tp */  \
-	(((tp)->tv_usec)/1000.0 + ((tp)->tv_sec)*1000.0)
+static TFStats alltfstats;		/* stats of all timer calls */
 
 /* info about one registered work procedure.
  * the malloced array wproc is never shrunk, entries are reused. new id's are
@@ -92,11 +131,69 @@ static int nwproc;			/* n entries in wproc[] */
 static int nwpinuse;			/* n entries in wproc[] marked in-use */
 static int lastwp;			/* wproc index of last workproc called*/
 
+/* info about one job for the worker pool.
+ * jobs wait on a FIFO list until a worker runs them, then on another until
+ *   their done function is called from the event loop. the worker signals
+ *   each done job with one count on an eventfd, or one byte on a pipe, which
+ *   a normal callback reads one at a time so each runs as one user function.
+ */
+typedef struct _Job {
+    JOBF *workfp;			/* function to run on a worker thread */
+    JOBF *donefp;			/* function to call back in event loop */
+    void *ud;				/* user's data handle */
+    struct _Job *next;			/* next in same list */
+} Job;
+static Job *jobq, *jobqtail;		/* jobs waiting for a worker */
+static Job *doneq, *doneqtail;		/* jobs waiting for their donefp */
+static int njobs;			/* n jobs submitted but not yet done */
+static int maxjobs = 64;		/* most njobs allowed */
+static int nworkers;			/* n worker threads running */
+static int nidle;			/* n of those waiting for a job */
+static int maxworkers = 4;		/* most workers to start */
+static int jobrfd = -1, jobwfd = -1;	/* read and write ends of done signal */
+static pthread_mutex_t job_m = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_c = PTHREAD_COND_INITIALIZER;
+
+#if defined(USE_EPOLL)
+/* epoll state.
+ * the fds found ready by one epoll_wait are queued in ready[] and dispatched
+ *   one per oneLoop, so each still runs at most one user function, before
+ *   waiting again. the timerfd is kept armed for the soonest timer.
+ */
+#define	NEPEV		64		/* max events fetched per epoll_wait */
+static int epfd = -1;			/* epoll instance */
+static int tfd = -1;			/* timerfd for the soonest timer */
+static int64_t tfdarmed;		/* tgo tfd is armed for, 0 if not */
+static int *ready;			/* malloced fds ready, -1 once removed */
+static int nready;			/* n entries in ready[] */
+static int iready;			/* index of next ready[] to dispatch */
+static int mready;			/* n entries malloced in ready[] */
+static int nalways;			/* n in-use callbacks with always set */
+#endif
+
 static void runWorkProc (void);
-static void callCallback(fd_set *rfdp);
 static int checkTimer();
 static void oneLoop(void);
 static void deferTO (void *p);
+static int64_t monons (void);
+static int newTimer (int64_t ns, int64_t period, TCF *fp, void *ud);
+static void tfStats (TFStats *sp, double late, long nmissed);
+static int tfBefore (TF *a, TF *b);
+static int jobInit (void);
+static void *jobWorker (void *dummy);
+static void jobDoneCB (int fd, void *dummy);
+static void heapUp (int i);
+static void heapDown (int i);
+static void heapRemove (int i);
+#if defined(USE_EPOLL)
+static void epInit (void);
+static void epWatch (CB *cp);
+static void epUnwatch (CB *cp);
+static void epArm (void);
+static int epCallback (int fd);
+#else
+static void callCallback(fd_set *rfdp);
+#endif
 
 /* loop to dispatch callbacks, work procs and timers as necessary.
  * only returns if any callback happens to set eloop_error.
@@ -183,7 +280,11 @@ addCallback (int fd, CBF *fp, void *ud)
 	cp->fp = fp;
 	cp->ud = ud;
 	cp->fd = fd;
+	cp->always = 0;
 	ncbinuse++;
+#if defined(USE_EPOLL)
+	epWatch (cp);
+#endif
 
 	/* id is index into array */
 	return (cp - cback);
@@ -207,40 +308,70 @@ rmCallback (int cid)
 	/* mark for reuse */
 	cp->in_use = 0;
 	ncbinuse--;
+#if defined(USE_EPOLL)
+	epUnwatch (cp);
+#endif
 }
 
 /* register a new timer function, fp, to be called with ud as arg after ms
- * milliseconds. add to list in order of decreasing time from now, ie,
- * last entry runs next. return id for use with rmTimer().
+ * milliseconds. return id for use with rmTimer().
  */
 int
 addTimer (int ms, TCF *fp, void *ud)
 {
-	struct timeval t;
-	TF *tp;
-
-	/* get time now */
-	gettimeofday (&t, NULL);
+	return (newTimer (ms*(int64_t)1000000, 0, fp, ud));
+}
 
-	/* add one entry */
-	timef = timef ? (TF *) realloc (timef, (ntimef+1)*sizeof(TF))
-		      : (TF *) malloc (sizeof(TF));
-	tp = &timef[ntimef++];
+/* same as addTimer() but with a delay of us microseconds */
+int
+addTimerUs (long us, TCF *fp, void *ud)
+{
+	return (newTimer (us*(int64_t)1000, 0, fp, ud));
+}
 
-	/* init new entry */
-	tp->ud = ud;
-	tp->fp = fp;
-	tp->tgo = EPOCHDT(&t) + ms;
+/* register a timer function, fp, to be called with ud as arg every us
+ * microseconds, starting us from now, until removed with rmTimer(). each call
+ * is scheduled from the ideal time of the one before, not from when it was
+ * actually called, so there is no cumulative drift. if a call is so late that
+ * whole periods have passed it is made just once and those periods skipped.
+ * return id for use with rmTimer() and getTimerStats(), or -1 if us < 1.
+ */
+int
+addPeriodicTimer (long us, TCF *fp, void *ud)
+{
+	if (us < 1)
+	    return (-1);
+	return (newTimer (us*(int64_t)1000, us*(int64_t)1000, fp, ud));
+}
 
-	/* insert maintaining sort */
-	for ( ; tp > timef && tp[0].tgo > tp[-1].tgo; tp--) {
-	    TF tmptf = tp[-1];
-	    tp[-1] = tp[0];
-	    tp[0] = tmptf;
+/* fill *tsp with how late the given periodic timer has been called, or all
+ * timers if tid is 0. return 0 if ok, -1 if no such periodic timer.
+ */
+int
+getTimerStats (int qtid, TimerStats *tsp)
+{
+	TFStats *sp = NULL;
+	int i;
+
+	if (qtid == 0)
+	    sp = &alltfstats;
+	else {
+	    for (i = 0; i < ntimef; i++) {
+		if (timef[i].tid == qtid) {
+		    sp = timef[i].sp;
+		    break;
+		}
+	    }
 	}
-
-	/* store and return new unique id */
-	return (tp->tid = ++tid);
+	if (!sp)
+	    return (-1);
+
+	tsp->ncalls = sp->n;
+	tsp->nmissed = sp->nmissed;
+	tsp->meanlate = sp->mean/1000.0;
+	tsp->maxlate = sp->max/1000.0;
+	tsp->jitter = sp->n > 1 ? sqrt(sp->m2/(sp->n-1))/1000.0 : 0;
+	return (0);
 }
 
 /* remove the timer with the given tid, as returned from addTimer().
@@ -249,21 +380,17 @@ addTimer (int ms, TCF *fp, void *ud)
 void
 rmTimer (int rmtid)
 {
-	TF *tp;
+	int i;
 
-	/* find it */
-	for (tp = timef; tp < &timef[ntimef]; tp++)
-	    if (tp->tid == rmtid)
+	/* find it, a linear scan but through a small dense array */
+	for (i = 0; i < ntimef; i++)
+	    if (timef[i].tid == rmtid)
 		break;
-	if (tp == &timef[ntimef])
+	if (i == ntimef)
 	    return;
 
-	/* bubble it out */
-	for (++tp; tp < &timef[ntimef]; tp++)
-	    tp[-1] = tp[0];
-
-	/* shrink list */
-	timef = (TF *) realloc (timef, (--ntimef)*sizeof(TF));
+	free (timef[i].sp);
+	heapRemove (i);
 }
 
 /* add a new work procedure, fp, to be called with ud when nothing else to do.
@@ -315,6 +442,68 @@ rmWorkProc (int wid)
 	nwpinuse--;
 }
 
+/* set the most worker threads and most jobs outstanding for addJob(), each
+ * unchanged if <= 0. workers already running are never stopped.
+ */
+void
+setJobPool (int nthreads, int njobsmax)
+{
+	pthread_mutex_lock (&job_m);
+	if (nthreads > 0)
+	    maxworkers = nthreads;
+	if (njobsmax > 0)
+	    maxjobs = njobsmax;
+	pthread_mutex_unlock (&job_m);
+}
+
+/* arrange for workfp(ud) to be called on a worker thread then, once it
+ * returns, donefp(ud), if not NULL, to be called from the event loop. jobs are
+ * started in the order submitted but may finish in any order.
+ * return 0 if queued, or -1 if there are already maxjobs outstanding or the
+ * pool can not be started.
+ * N.B. like addCallback(), which jobInit() calls the first time, this must
+ *   only be called from the event loop thread, never from a workfp.
+ */
+int
+addJob (JOBF *workfp, JOBF *donefp, void *ud)
+{
+	Job *jp;
+	pthread_t thr;
+
+	if (jobInit() < 0)
+	    return (-1);
+
+	pthread_mutex_lock (&job_m);
+	if (njobs >= maxjobs) {
+	    pthread_mutex_unlock (&job_m);
+	    return (-1);
+	}
+
+	jp = (Job *) malloc (sizeof(Job));
+	jp->workfp = workfp;
+	jp->donefp = donefp;
+	jp->ud = ud;
+	jp->next = NULL;
+	if (jobqtail)
+	    jobqtail->next = jp;
+	else
+	    jobq = jp;
+	jobqtail = jp;
+	njobs++;
+
+	/* wake an idle worker, or start another if still allowed */
+	if (nidle > 0)
+	    pthread_cond_signal (&job_c);
+	else if (nworkers < maxworkers && pthread_create (&thr, NULL, jobWorker, NULL) == 0) {
+	    pthread_detach (thr);
+	    nworkers++;
+	}
+	pthread_mutex_unlock (&job_m);
+
+	/* N.B. with no workers at all the job just waits for the first one */
+	return (0);
+}
+
 /* run next work procedure */
 static void
 runWorkProc ()
@@ -335,51 +524,369 @@ runWorkProc ()
 	(*wp->fp) (wp->ud);
 }
 
-/* run next callback whose fd is listed as ready to go in rfdp */
+/* return whether timer a fires before timer b: the earlier, or the first
+ * added if they are at the same time.
+ */
+static int
+tfBefore (TF *a, TF *b)
+{
+	return (a->tgo < b->tgo || (a->tgo == b->tgo && a->tid < b->tid));
+}
+
+/* move timef[i] towards the root until its parent fires no later */
 static void
-callCallback(fd_set *rfdp)
+heapUp (int i)
 {
-	CB *cp;
+	TF t = timef[i];
 
-	/* skip if list is empty */
-	if (!ncbinuse)
-	    return;
+	while (i > 0) {
+	    int p = (i-1)/2;
+	    if (!tfBefore (&t, &timef[p]))
+		break;
+	    timef[i] = timef[p];
+	    i = p;
+	}
+	timef[i] = t;
+}
 
-	/* find next */
-	do {
-	    lastcb = (lastcb+1) % ncback;
-	    cp = &cback[lastcb];
-	} while (!cp->in_use || !FD_ISSET (cp->fd, rfdp));
+/* move timef[i] away from the root until neither child fires before it */
+static void
+heapDown (int i)
+{
+	TF t = timef[i];
 
-	/* run */
-	(*cp->fp) (cp->fd, cp->ud);
+	for (;;) {
+	    int c = 2*i+1;
+	    if (c >= ntimef)
+		break;
+	    if (c+1 < ntimef && tfBefore (&timef[c+1], &timef[c]))
+		c++;
+	    if (!tfBefore (&timef[c], &t))
+		break;
+	    timef[i] = timef[c];
+	    i = c;
+	}
+	timef[i] = t;
+}
+
+/* remove timef[i] from the heap */
+static void
+heapRemove (int i)
+{
+	if (i != --ntimef) {
+	    timef[i] = timef[ntimef];
+	    if (i > 0 && tfBefore (&timef[i], &timef[(i-1)/2]))
+		heapUp (i);
+	    else
+		heapDown (i);
+	}
+}
+
+/* return CLOCK_MONOTONIC now in ns */
+static int64_t
+monons()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec*(int64_t)1000000000 + ts.tv_nsec);
+}
+
+/* add a timer to call fp with ud after ns nanoseconds, then every period ns
+ * if period > 0. return its unique id.
+ */
+static int
+newTimer (int64_t ns, int64_t period, TCF *fp, void *ud)
+{
+	TF *tp;
+
+	/* add one entry, growing by doubling */
+	if (ntimef == mtimef) {
+	    mtimef = mtimef ? 2*mtimef : 16;
+	    timef = (TF *) realloc (timef, mtimef*sizeof(TF));
+	}
+	tp = &timef[ntimef++];
+
+	/* init new entry */
+	tp->ud = ud;
+	tp->fp = fp;
+	tp->tgo = monons() + ns;
+	tp->period = period;
+	tp->sp = period > 0 ? (TFStats *) calloc (1, sizeof(TFStats)) : NULL;
+	tp->tid = ++tid;
+
+	/* restore heap */
+	heapUp (ntimef-1);
+
+	/* return new unique id */
+	return (tid);
+}
+
+/* add one call late ns after its deadline, after skipping nmissed periods */
+static void
+tfStats (TFStats *sp, double late, long nmissed)
+{
+	double d = late - sp->mean;
+
+	sp->n++;
+	sp->nmissed += nmissed;
+	sp->mean += d/sp->n;
+	sp->m2 += d*(late - sp->mean);
+	if (late > sp->max)
+	    sp->max = late;
 }
 
 /* run the next timer callback whose time has come, if any. all we have to do
- * is is check the last entry in timef[] because it is sorted in decreasing
- * order of time from now to run, ie, last entry runs soonest.
+ * is check timef[0] because it is the root of the heap, ie, runs soonest.
+ * a periodic timer is rescheduled before it is called so it may remove itself.
  * return whether a callback was triggered.
  */
 static int
 checkTimer()
 {
-	struct timeval now;
-	double tgonow;
-	TF *tp;
+	int64_t now, late;
+	long nmissed;
+	TF t;
 
 	/* skip if list is empty */
 	if (!ntimef)
 	    return(0);
 
-	gettimeofday (&now, NULL);
-	tgonow = EPOCHDT (&now);
-	tp = &timef[ntimef-1];
-	if (tp->tgo <= tgonow) {
-	    ntimef--;			/* pop then call */
-	    (*tp->fp) (tp->ud);
-	    return (1);
-	} else
+	now = monons();
+	if (timef[0].tgo > now)
 	    return (0);
+
+	t = timef[0];
+	late = now - t.tgo;
+	if (t.period > 0) {
+	    nmissed = (long)(late/t.period);
+	    timef[0].tgo += (nmissed+1)*t.period;
+	    heapDown (0);
+	    tfStats (t.sp, (double)late, nmissed);
+	} else
+	    heapRemove (0);		/* pop then call */
+	tfStats (&alltfstats, (double)late, 0);
+
+	(*t.fp) (t.ud);
+	return (1);
+}
+
+#if defined(USE_EPOLL)
+
+/* create the epoll instance and timerfd the first time only */
+static void
+epInit()
+{
+	struct epoll_event ev;
+
+	if (epfd >= 0)
+	    return;
+
+	epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epfd < 0) {
+	    perror ("epoll_create1");
+	    exit(1);
+	}
+	tfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+	if (tfd < 0) {
+	    perror ("timerfd_create");
+	    exit(1);
+	}
+	memset (&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = tfd;
+	if (epoll_ctl (epfd, EPOLL_CTL_ADD, tfd, &ev) < 0) {
+	    perror ("epoll_ctl timerfd");
+	    exit(1);
+	}
+}
+
+/* start watching the fd of the new callback cp.
+ * epoll refuses fds that are always ready, such as regular files, for which
+ *   select always reports ready, so mark those to be treated the same way.
+ */
+static void
+epWatch (CB *cp)
+{
+	struct epoll_event ev;
+
+	epInit();
+
+	memset (&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = cp->fd;
+	if (epoll_ctl (epfd, EPOLL_CTL_ADD, cp->fd, &ev) < 0) {
+	    if (errno == EPERM) {
+		cp->always = 1;
+		nalways++;
+	    }
+	    /* EEXIST is fine, another callback already watches this fd */
+	}
+}
+
+/* stop watching the fd of the callback cp just removed, unless another
+ * callback still uses it.
+ * also drop the fd from ready[] so a callback added for it, perhaps for a new
+ *   file that reuses the same fd, is not called for readiness of the old one.
+ * EBADF means the fd was closed first. the kernel has then already dropped
+ *   it unless another fd still refers to the same file, see eventloop.h.
+ */
+static void
+epUnwatch (CB *cp)
+{
+	int always = cp->always;
+	CB *op;
+	int i;
+
+	if (always) {
+	    cp->always = 0;
+	    nalways--;
+	}
+
+	for (op = cback; op < &cback[ncback]; op++)
+	    if (op->in_use && op->fd == cp->fd)
+		return;
+
+	for (i = iready; i < nready; i++)
+	    if (ready[i] == cp->fd)
+		ready[i] = -1;
+
+	if (!always && epoll_ctl (epfd, EPOLL_CTL_DEL, cp->fd, NULL) < 0
+					    && errno != EBADF && errno != ENOENT)
+	    perror ("epoll_ctl del");
+}
+
+/* keep tfd armed for the soonest timer, if any */
+static void
+epArm()
+{
+	struct itimerspec its;
+	int64_t tgo = ntimef > 0 ? timef[0].tgo : 0;
+
+	if (tgo == tfdarmed)
+	    return;
+
+	memset (&its, 0, sizeof(its));
+	if (tgo > 0) {
+	    its.it_value.tv_sec = (time_t)(tgo/1000000000);
+	    its.it_value.tv_nsec = (long)(tgo%1000000000);
+	}
+	if (timerfd_settime (tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0) {
+	    perror ("timerfd_settime");
+	    exit(1);
+	}
+	tfdarmed = tgo;
+}
+
+/* run the next callback, in round-robin order, watching fd.
+ * return whether one was called.
+ */
+static int
+epCallback (int fd)
+{
+	CB *cp;
+	int i;
+
+	for (i = 1; i <= ncback; i++) {
+	    cp = &cback[(lastcb+i) % ncback];
+	    if (cp->in_use && cp->fd == fd) {
+		lastcb = cp - cback;
+		(*cp->fp) (cp->fd, cp->ud);
+		return (1);
+	    }
+	}
+	return (0);
+}
+
+/* dispatch the next fd still queued from the last wait, if any.
+ * else wait for fds to become ready, then call the first of their callbacks.
+ * if none are ready call the next timer or, failing that, work procedure.
+ */
+static void
+oneLoop()
+{
+	struct epoll_event ev[NEPEV];
+	CB *cp;
+	int i, ns, ms;
+
+	/* dispatch at most one user function.
+	 * N.B. nesting oneLoops is not a problem but each invokation must only
+	 *   run at most one user function in case they interact.
+	 */
+	while (iready < nready)
+	    if (epCallback (ready[iready++]))
+		return;
+
+	epInit();
+
+	/* determine timeout:
+	 * if there are work procs or always-ready callbacks
+	 *   set delay = 0
+	 * else
+	 *   arm tfd for the soonest timer func, if any, and wait forever
+	 */
+	epArm();
+	ms = (nwpinuse > 0 || nalways > 0) ? 0 : -1;
+
+	/* check file descriptors, timeout depending on pending work */
+	ns = epoll_wait (epfd, ev, NEPEV, ms);
+	if (ns < 0) {
+	    if (errno != EINTR) {
+		perror ("epoll_wait");
+		exit(1);
+	    }
+	    ns = 0;
+	}
+
+	/* queue the ready fds, then any that epoll can not watch */
+	if (mready < ns + nalways) {
+	    mready = ns + nalways;
+	    ready = (int *) realloc (ready, mready*sizeof(int));
+	}
+	nready = iready = 0;
+	for (i = 0; i < ns; i++) {
+	    if (ev[i].data.fd == tfd) {
+		uint64_t exp;
+		if (read (tfd, &exp, sizeof(exp)) < 0 && errno != EAGAIN) {
+		    perror ("read timerfd");
+		    exit(1);
+		}
+		tfdarmed = 0;
+	    } else
+		ready[nready++] = ev[i].data.fd;
+	}
+	if (nalways > 0)
+	    for (cp = cback; cp < &cback[ncback]; cp++)
+		if (cp->in_use && cp->always)
+		    ready[nready++] = cp->fd;
+
+	while (iready < nready)
+	    if (epCallback (ready[iready++]))
+		return;
+	if (!checkTimer())
+	    runWorkProc();
+}
+
+#else /* !USE_EPOLL */
+
+/* run next callback whose fd is listed as ready to go in rfdp */
+static void
+callCallback(fd_set *rfdp)
+{
+	CB *cp;
+
+	/* skip if list is empty */
+	if (!ncbinuse)
+	    return;
+
+	/* find next */
+	do {
+	    lastcb = (lastcb+1) % ncback;
+	    cp = &cback[lastcb];
+	} while (!cp->in_use || !FD_ISSET (cp->fd, rfdp));
+
+	/* run */
+	(*cp->fp) (cp->fd, cp->ud);
 }
 
 /* check fd's from each active callback.
@@ -416,16 +923,13 @@ oneLoop()
 	    tvp = &tv;
 	    tvp->tv_sec = tvp->tv_usec = 0;
 	} else if (ntimef > 0) {
-	    struct timeval now;
-	    double late;
-	    gettimeofday (&now, NULL);
-	    late = timef[ntimef-1].tgo - EPOCHDT (&now);	/* ms late */
+	    int64_t late = timef[0].tgo - monons();		/* ns until due */
 	    if (late < 0)
 		late = 0;
-	    late /= 1000.0;					/* secs late */
+	    late = (late + 999)/1000;				/* us, not early */
 	    tvp = &tv;
-	    tvp->tv_sec = (long)floor(late);
-	    tvp->tv_usec = (long)floor((late - tvp->tv_sec)*1000000.0);
+	    tvp->tv_sec = (long)(late/1000000);
+	    tvp->tv_usec = (long)(late%1000000);
 	} else
 	    tvp = NULL;
 
@@ -446,6 +950,117 @@ oneLoop()
 	    runWorkProc();
 }
 
+#endif /* USE_EPOLL */
+
+/* create the done signal and register its callback, first time only.
+ * return 0 if ok else -1.
+ */
+static int
+jobInit()
+{
+#if !defined(USE_EVENTFD)
+	int p[2];
+#endif
+
+	if (jobrfd >= 0)
+	    return (0);
+
+#if defined(USE_EVENTFD)
+	jobrfd = jobwfd = eventfd (0, EFD_SEMAPHORE|EFD_NONBLOCK|EFD_CLOEXEC);
+	if (jobrfd < 0)
+	    return (-1);
+#else
+	if (pipe (p) < 0)
+	    return (-1);
+	fcntl (p[0], F_SETFL, O_NONBLOCK);
+	fcntl (p[0], F_SETFD, FD_CLOEXEC);
+	fcntl (p[1], F_SETFD, FD_CLOEXEC);
+	jobrfd = p[0];
+	jobwfd = p[1];
+#endif
+	(void) addCallback (jobrfd, jobDoneCB, NULL);
+	return (0);
+}
+
+/* body of each worker thread: run jobs forever, handing each back to the
+ * event loop when done.
+ */
+static void *
+jobWorker (void *dummy)
+{
+	Job *jp;
+
+	pthread_mutex_lock (&job_m);
+	for (;;) {
+	    while (!jobq) {
+		nidle++;
+		pthread_cond_wait (&job_c, &job_m);
+		nidle--;
+	    }
+	    jp = jobq;
+	    if (!(jobq = jp->next))
+		jobqtail = NULL;
+	    pthread_mutex_unlock (&job_m);
+
+	    (*jp->workfp) (jp->ud);
+
+	    pthread_mutex_lock (&job_m);
+	    jp->next = NULL;
+	    if (doneqtail)
+		doneqtail->next = jp;
+	    else
+		doneq = jp;
+	    doneqtail = jp;
+
+	    /* one count per done job */
+#if defined(USE_EVENTFD)
+	    {
+		uint64_t one = 1;
+		if (write (jobwfd, &one, sizeof(one)) < 0)
+		    perror ("job eventfd");
+	    }
+#else
+	    if (write (jobwfd, "", 1) < 0)
+		perror ("job pipe");
+#endif
+	}
+
+	return (NULL);
+}
+
+/* called from the event loop when at least one job is done: call the donefp
+ * of the oldest one.
+ */
+static void
+jobDoneCB (int fd, void *dummy)
+{
+	Job *jp;
+
+#if defined(USE_EVENTFD)
+	uint64_t one;
+	if (read (fd, &one, sizeof(one)) != sizeof(one))
+	    return;
+#else
+	char one;
+	if (read (fd, &one, 1) != 1)
+	    return;
+#endif
+
+	pthread_mutex_lock (&job_m);
+	jp = doneq;
+	if (jp && !(doneq = jp->next))
+	    doneqtail = NULL;
+	if (jp)
+	    njobs--;
+	pthread_mutex_unlock (&job_m);
+
+	if (jp) {
+	    if (jp->donefp)
+		(*jp->donefp) (jp->ud);
+	    free (jp);
+	}
+}
+
 /* timer callback used to implement deferLoop().
  * arg is pointer to int which we set to 1
  */
@@ -24,18 +24,43 @@
 typedef void (CBF) (int fd, void *);
 typedef void (WPF) (void *);
 typedef void (TCF) (void *);
+typedef void (JOBF) (void *);
 
 /* main calls this when ready to hand over control */
 extern void eventLoop(void);
 
-/* functions to add and remove callbacks, workprocs and timers */
+/* functions to add and remove callbacks, workprocs and timers.
+ * N.B. call rmCallback() before closing its fd. with epoll a closed fd stays
+ *   watched while any dup of it, such as one inherited by a child, is open,
+ *   and its readiness would then be reported for whatever reuses the fd.
+ */
 extern int addCallback (int fd, CBF *fp, void *ud);
 extern void rmCallback (int cid);
 extern int addWorkProc (WPF *fp, void *ud);
 extern void rmWorkProc (int wid);
 extern int addTimer (int ms, TCF *fp, void *ud);
+extern int addTimerUs (long us, TCF *fp, void *ud);
+extern int addPeriodicTimer (long us, TCF *fp, void *ud);
 extern void rmTimer (int tid);
 
+/* how late timer functions have been called, all times in microseconds */
+typedef struct {
+    long ncalls;			/* n times called */
+    long nmissed;			/* n periods skipped because called late */
+    double meanlate;			/* mean time called after deadline */
+    double maxlate;			/* max time called after deadline */
+    double jitter;			/* standard deviation of lateness */
+} TimerStats;
+
+/* query a periodic timer, or all timers if tid is 0; 0 if ok else -1 */
+extern int getTimerStats (int tid, TimerStats *sp);
+
+/* functions to run jobs on worker threads, then call back in the event loop.
+ * addJob() must be called from the event loop thread, as all the others.
+ */
+extern int addJob (JOBF *workfp, JOBF *donefp, void *ud);
+extern void setJobPool (int nthreads, int maxjobs);
+
 /* utility functions */
 extern int deferLoop (int maxms, int *flagp);
 extern int deferLoop0 (int maxms, int *flagp);
@@ -0,0 +1,49 @@
+#!/bin/bash
+# feed indiserver expression filters that must be refused without harm: deep
+# unary and paren nesting, over-long text and more filters than one client
+# may have. exit 0 if each gets its Alert and indiserver is still fine after.
+# run from the INDI build directory, as make filtcheck does.
+
+PORT=${1:-7599}
+
+./indiserver -p $PORT ./inditime 2>/dev/null &
+srv=$!
+trap 'kill $srv 2>/dev/null' EXIT
+sleep 1
+
+# print n copies of s
+rep () {
+    awk -v s="$1" -v n=$2 'BEGIN { while (n-- > 0) printf "%s", s }'
+}
+
+# print an enableExpr named $1 of $3 copies of $2 then $4
+expr () {
+    printf "<enableExpr name='%s'>" "$1"
+    rep "$2" $3
+    printf "%s</enableExpr>\n" "$4"
+}
+
+out=$( {
+    expr long1 "-" 20000 "1"
+    expr long2 "(" 2000000 "1"
+    expr deep1 "-" 4000 "1"
+    expr deep2 "(" 4000 "1"
+    expr deep3 "!(" 1500 "1"
+    for i in $(seq 300); do
+        expr f$i "" 0 "1"
+    done
+} | {
+    exec 3<>/dev/tcp/localhost/$PORT || exit 1
+    cat >&3 &
+    timeout 3 cat <&3
+} )
+
+nalert=$(echo "$out" | grep -c "state='Alert'")
+nok=$(echo "$out" | grep -c "state='Ok'")
+echo "filtcheck: $nalert Alert, $nok Ok"
+test $nalert -eq 49 -a $nok -eq 256 || exit 1
+
+# still serving
+kill -0 $srv || exit 1
+./evalINDI -p $PORT -s '"Time.Now.UNIX" > 0' || exit 1
+echo "filtcheck: ok"
@@ -3,6 +3,10 @@
  * All types but BLOBs are handled from their defXXX messages. Receipt of a
  *   defBLOB sends enableBLOB then uses setBLOBVector for the value. BLOBs
  *   are stored in a file dev.nam.elem.format. only .z compression is handled.
+ *   BLOB content is decoded, inflated and saved as it arrives, see streamBLOB().
+ * With -D we instead stay connected as a daemon, keeping a cache of all
+ *   properties current from the set messages and answering queries from it
+ *   over a unix socket or stdin/stdout. -u asks such a daemon.
  * exit status: 0 at least some found, 1 some not found, 2 real trouble.
  */
 
@@ -14,13 +18,17 @@
 #include <signal.h>
 #include <time.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
 #include "indiapi.h"
 #include "connect_to.h"
+#include "serverxml.h"
 #include "lilxml.h"
 #include "base64.h"
 #include "zlib.h"
@@ -73,6 +81,25 @@ typedef struct {
 static SearchDef *srchs;		/* properties to look for */
 static int nsrchs;
 
+/* srchs[] compiled for findDPE() so each message is compared only with the
+ * specs that can match it. Wild cards are always whole components, so rather
+ * than a trie we need just one hash table on device and property: specs
+ * with a wild card property are filed with property "*", and specs with a
+ * wild card device, which must still check property, go in anydev[]. Each
+ * list of srchs[] indices is in increasing order so output order is kept.
+ */
+typedef struct _SrchKey {
+    const char *d, *p;			/* device, property or "*" */
+    int *idx;				/* srchs[] indices */
+    int nidx;				/* n idx[] */
+    struct _SrchKey *next;		/* next in same hash bucket */
+} SrchKey;
+#define	NSHASH		256		/* n srchs hash buckets, power of 2 */
+static SrchKey *shash[NSHASH];		/* hash table of SrchKeys */
+static int *anydev;			/* srchs[] indices with wild card device */
+static int nanydev;			/* n anydev[] */
+static int scompiled;			/* whether shash and anydev are current */
+
 
 
 
@@ -100,6 +127,8 @@ typedef struct _KElement {
     char *elemname;
     char *elemlabel;
     struct _KElement *next_elemp;
+    struct _KProperty *propp;           /* owner, for hash lookup */
+    struct _KElement *hnext_elemp;      /* next in same hash bucket */
 } KElement;
 typedef struct _KProperty {
     char *propname;
@@ -108,15 +137,77 @@ typedef struct _KProperty {
     char *perm;
     struct _KElement *elemsp;
     struct _KProperty *next_propp;
+    struct _KDevice *devp;              /* owner, for hash lookup */
+    struct _KProperty *hnext_propp;     /* next in same hash bucket */
 } KProperty;
 typedef struct _KDevice {
     char *devname;
     struct _KProperty *propsp;
     struct _KDevice *next_devp;
+    struct _KDevice *hnext_devp;        /* next in same hash bucket */
 } KDevice;
 
 static KDevice *kdevs;
 
+/* state of the BLOB being saved by streamBLOB() as its content arrives.
+ * memory use is just these buffers regardless of BLOB size.
+ */
+typedef struct {
+    XMLEle *ep;				/* oneBLOB, parent is setBLOBVector */
+    const char *dev, *nam, *enam;	/* names, all in ep tree */
+    char fn[1024];			/* file name, unless oflag */
+    int fd;				/* output file, unused if oflag */
+    int isz;				/* whether to inflate */
+    int ucs;				/* reported uncompressed size */
+    long long nout;			/* bytes written so far */
+    B64Dec b64;				/* base64 decoding state */
+    z_stream zs;			/* inflate state if isz */
+    int zret;				/* last inflate() return */
+    char dec[3*65536/4+8];		/* decoded content, ie, 3/4 serverxml buf*/
+    unsigned char inf[256*1024];	/* inflated content */
+} SBLOB;
+static SBLOB sblob;
+
+/* each K list is found by hashing its name with its owner while collecting,
+ * then all are sorted just once by sortKTree() before printing.
+ */
+#define NKHASH          4096            /* n K hash buckets, power of 2 */
+static KDevice *kdevhash[NKHASH];
+static KProperty *kprophash[NKHASH];
+static KElement *kelemhash[NKHASH];
+
+/* daemon cache of each defXXXVector as last sent, with values, state and
+ * timestamp kept current from the setXXXVectors. Found by device and name
+ * through a hash table, answered in arrival order from the cprops list.
+ */
+typedef struct _CProp {
+    XMLEle *def;			/* defXXXVector, kept current */
+    struct _CProp *hnext;		/* next in same hash bucket */
+    struct _CProp *next;		/* next in arrival order */
+} CProp;
+#define	NCHASH		1024		/* n cache hash buckets, power of 2 */
+static CProp *chash[NCHASH];		/* hash table of CProps */
+static CProp *cprops;			/* all CProps in arrival order */
+static int ncprops;			/* n CProps */
+
+/* daemon query clients.
+ * answers are queued in obuf and written as the client can take them, so a
+ *   client that does not read can not stall the daemon. no more queries are
+ *   read from a client until its answers are all written.
+ */
+typedef struct {
+    int rfd;				/* read queries from here, -1 if unused */
+    int wfd;				/* write answers here */
+    char buf[4096];			/* partial query line */
+    int nbuf;				/* bytes in buf[] */
+    char *obuf;				/* malloced answers not yet written */
+    size_t nobuf;			/* bytes in obuf[] */
+} DClient;
+#define	MAXDCLIENTS	32		/* max concurrent clients */
+#define	MAXDCOUT	(4*1024*1024)	/* drop client with more answers queued */
+static DClient dclients[MAXDCLIENTS];
+static int dlfd = -1;			/* listening unix socket, if any */
+
 static char *me;			/* our name for usage() message */
 static char host_def[] = "localhost";	/* default host name */
 static char *host = host_def;		/* working host name */
@@ -144,26 +235,56 @@ static int fflag;			/* don't print the def values */
 static int kflag;                       /* pretty-print in plain text format */
 static int Kflag;                       /* pretty-print in DoKuWiki format */
 static time_t k_time;                   /* time of most recent new entry */
+static char *dpath;			/* -D daemon socket path, or "-" */
+static char *upath;			/* -u query daemon at this socket */
+static FILE *outfp;			/* where findEle() reports */
 
 static void addKElement (const char *devname, const char *propname, const char *proplabel,
     const char *proptype, const char *perm, const char *elemname, const char *elemlabel);
 static void printKplain(void);
 static void printKDoKu(void);
+static void sortKTree(void);
+static unsigned kHash (const void *owner, const char *name);
+static int kDevCmp (const void *p1, const void *p2);
+static int kPropCmp (const void *p1, const void *p2);
+static int kElemCmp (const void *p1, const void *p2);
 static void usage (void);
-static void crackDPE (char *spec);
+static int crackDPE (char *spec);
 static void addSearchDef (char *dev, char *prop, char *ele);
+static void compileSearchDefs (void);
+static SrchKey *findSrchKey (const char *dev, const char *prop);
+static void freeSrchKeys (void);
+static unsigned dpHash (const char *dev, const char *nam);
 static void openINDIServer(void);
 static void getprops(void);
 static void listenINDI(void);
 static int finished (void);
 static void onAlarm (int dummy);
-static int readServerChar(void);
+static void serverGone(void);
 static void findDPE (XMLEle *root);
 static void findEle (XMLEle *root, const char *dev, const char *nam,
     const char *defone, SearchDef *sp);
 static void enableBLOBs(char *dev, char *nam);
 static void oneBLOB (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
     const char *enam, const char *p, int plen);
+static int blobFileName (XMLEle *parent, XMLEle *root, const char *dev,
+    const char *nam, const char *enam, char fn[]);
+static int streamBLOB (XMLEle *ep, const char *s, int n);
+static int wantBLOB (const char *dev, const char *nam, const char *enam);
+static void writeBLOB (const void *buf, int n);
+static void daemonINDI (void);
+static void startServing (void);
+static void readDClient (DClient *cp);
+static void writeDClient (DClient *cp);
+static void closeDClient (DClient *cp);
+static void answerQuery (char *spec);
+static int cacheMsg (XMLEle *root);
+static CProp **cacheFind (const char *dev, const char *nam);
+static void cacheDel (CProp **hpp);
+static void freeSearchDefs (void);
+static void queryDaemon (void);
+static long long msnow (void);
+static void onTerm (int dummy);
 static void bye(int n);
 
 int
@@ -197,6 +318,14 @@ main (int ac, char *av[])
 		    }
 		    bflag++;
 		    break;
+		case 'D':
+		    if (ac < 2) {
+			fprintf (stderr, "-D requires socket path or -\n");
+			usage();
+		    }
+		    dpath = *++av;
+		    ac--;
+		    break;
 		case 'd':
 		    if (ac < 2) {
 			fprintf (stderr, "-d requires open fileno\n");
@@ -251,6 +380,14 @@ main (int ac, char *av[])
 		case 'q':
 		    qflag++;
 		    break;
+		case 'u':
+		    if (ac < 2) {
+			fprintf (stderr, "-u requires socket path\n");
+			usage();
+		    }
+		    upath = *++av;
+		    ac--;
+		    break;
 		case 't':
 		    if (ac < 2) {
 			fprintf (stderr, "-t requires timeout\n");
@@ -272,14 +409,31 @@ main (int ac, char *av[])
 	    }
 	}
 
+	/* daemon only reports plain values */
+	if (dpath && (upath || justvalue || Bflag || fflag || kflag || Kflag
+							|| monitor || oflag)) {
+	    fprintf (stderr, "-D may not be combined with -1 -B -f -k -K -m -o -u\n");
+	    usage();
+	}
+
 	/* now ac args starting with av[0] */
 	if (ac == 0)
 	    av[ac++] = (char *)"*.*.*";		/* default is get everything */
 
 	/* crack each d.p.e */
-	while (ac--)
-	    crackDPE (*av++);
+	while (ac--) {
+	    if (crackDPE (*av) < 0) {
+		fprintf (stderr, "Unknown format for property spec: %s\n", *av);
+		usage();
+	    }
+	    av++;
+	}
 	onematch = nsrchs == 1 && !srchs[0].wc;
+	outfp = stdout;
+
+	/* just ask the daemon if -u */
+	if (upath)
+	    queryDaemon();
 
 	/* open connection */
 	if (directfd >= 0) {
@@ -289,7 +443,6 @@ main (int ac, char *av[])
 		fprintf (stderr, "Direct fd %d not valid\n", directfd);
 		exit(1);
 	    }
-	    setbuf (svrrfp, NULL);	/* don't absorb next guy's stuff */
 	    if (verbose)
 		fprintf (stderr, "Using direct fd %d\n", directfd);
 	} else {
@@ -298,12 +451,21 @@ main (int ac, char *av[])
 		fprintf (stderr, "Connected to %s:%d\n", host, port);
 	}
 
-	/* build a parser context for cracking XML responses */
+	/* build a parser context for cracking XML responses, and read in bulk
+	 * but don't absorb next guy's stuff if direct
+	 */
 	lillp = newLilXML();
+	initServerXML (fileno(svrrfp), directfd >= 0, verbose > 3 ? stderr : NULL);
+	if (Bflag)
+	    sinkServerXML (streamBLOB);
 
 	/* issue getProperties */
 	getprops();
 
+	/* stay connected and answer queries if -D */
+	if (dpath)
+	    daemonINDI();
+
 	/* unbuffered stdout so we can redirect with immediate results */
 	setbuf (stdout, NULL);
 
@@ -337,6 +499,8 @@ usage()
 	fprintf(stderr, "  -a    : add timestamp in BLOB file name\n");
 	fprintf(stderr, "  -B    : include fetching BLOBs\n");
 	fprintf(stderr, "  -b    : exclude fetching BLOBs (deprecated, now the default)\n");
+	fprintf(stderr, "  -D s  : run as daemon caching properties, answer queries on unix socket s,\n");
+	fprintf(stderr, "          or stdin/stdout if s is -; specs limit which devices are cached\n");
 	fprintf(stderr, "  -d f  : use file descriptor f already open to server\n");
 	fprintf(stderr, "  -f    : don't print the def* values\n");
 	fprintf(stderr, "  -h h  : alternate host, default is %s\n", host_def);
@@ -348,6 +512,7 @@ usage()
 	fprintf(stderr, "  -p p  : alternate port, default is %d\n", INDIPORT);
 	fprintf(stderr, "  -q    : suppress some error messages\n");
 	fprintf(stderr, "  -t t  : max time to wait, default is %d secs; 0 is forever\n",TIMEOUT);
+	fprintf(stderr, "  -u s  : query the -D daemon at unix socket s instead of the server\n");
 	fprintf(stderr, "  -v    : verbose (cumulative)\n");
 	fprintf(stderr, "  -w    : show write-only properties too\n");
 	fprintf(stderr, "Exit status:\n");
@@ -358,25 +523,38 @@ usage()
 	exit (2);
 }
 
-/* crack spec and add to srchs[], else exit */
-static void
+/* crack spec and add to srchs[].
+ * return 0 if ok, else -1 if spec is malformed or a component is too long.
+ * N.B. spec may come from any daemon client so must not overrun d, p or e.
+ */
+static int
 crackDPE (char *spec)
 {
 	char d[1024], p[1024], e[2048];
+	int l;
 
 	if (verbose > 1)
 	    fprintf (stderr, "looking for %s\n", spec);
-	int ns = sscanf (spec, "%[^.].%[^.].%s", d, p, e);
+	int ns = sscanf (spec, "%1023[^.].%1023[^.].%2047s", d, p, e);
+        if (ns < 1)
+	    return (-1);
+
+	/* any part left over was too long */
+	l = strlen (d);
+	if (ns >= 2)
+	    l += 1 + strlen (p);
+	if (ns >= 3)
+	    l += 1 + strlen (e);
+	if (spec[l] && (ns == 3 || spec[l] != '.' || spec[l+1]))
+	    return (-1);
+
         if (ns < 3)
             strcpy (e, "*");
         if (ns < 2)
             strcpy (p, "*");
-        if (ns < 1) {
-	    fprintf (stderr, "Unknown format for property spec: %s\n", spec);
-	    usage();
-	}
 
 	addSearchDef (d, p, e);
+	return (0);
 }
 
 /* grow srchs[] with the new search */
@@ -392,6 +570,92 @@ addSearchDef (char *dev, char *prop, char *ele)
 	srchs[nsrchs].wc = *dev==WILDCARD || *prop==WILDCARD || *ele==WILDCARD;
 	srchs[nsrchs].ok = 0;
 	nsrchs++;
+	scompiled = 0;
+}
+
+/* build shash[] and anydev[] from srchs[]
+ */
+static void
+compileSearchDefs ()
+{
+	int i;
+
+	freeSrchKeys();
+	anydev = (int *) malloc ((nsrchs+1) * sizeof(int));
+
+	for (i = 0; i < nsrchs; i++) {
+	    SearchDef *sp = &srchs[i];
+	    const char *p = sp->p[0] == WILDCARD ? "*" : sp->p;
+	    SrchKey *kp;
+
+	    if (sp->d[0] == WILDCARD) {
+		anydev[nanydev++] = i;
+		continue;
+	    }
+	    kp = findSrchKey (sp->d, p);
+	    if (!kp) {
+		SrchKey **hpp = &shash[dpHash (sp->d, p) & (NSHASH-1)];
+		kp = (SrchKey *) calloc (1, sizeof(SrchKey));
+		kp->d = sp->d;
+		kp->p = p;
+		kp->next = *hpp;
+		*hpp = kp;
+	    }
+	    kp->idx = (int *) realloc (kp->idx, (kp->nidx+1) * sizeof(int));
+	    kp->idx[kp->nidx++] = i;
+	}
+
+	scompiled = 1;
+}
+
+/* return the SrchKey for exactly dev and prop, else NULL
+ */
+static SrchKey *
+findSrchKey (const char *dev, const char *prop)
+{
+	SrchKey *kp;
+
+	for (kp = shash[dpHash (dev, prop) & (NSHASH-1)]; kp; kp = kp->next)
+	    if (!strcmp (kp->p, prop) && !strcmp (kp->d, dev))
+		break;
+	return (kp);
+}
+
+/* forget shash[] and anydev[]
+ */
+static void
+freeSrchKeys ()
+{
+	int i;
+
+	for (i = 0; i < NSHASH; i++) {
+	    while (shash[i]) {
+		SrchKey *kp = shash[i];
+		shash[i] = kp->next;
+		free (kp->idx);
+		free (kp);
+	    }
+	}
+	free (anydev);
+	anydev = NULL;
+	nanydev = 0;
+	scompiled = 0;
+}
+
+/* return FNV-1a hash of dev.nam
+ */
+static unsigned
+dpHash (const char *dev, const char *nam)
+{
+	unsigned h = 2166136261u;
+	const char *s;
+
+	for (s = dev; *s; s++)
+	    h = (h ^ (unsigned char)*s) * 16777619u;
+	h = (h ^ '.') * 16777619u;
+	for (s = nam; *s; s++)
+	    h = (h ^ (unsigned char)*s) * 16777619u;
+	return (h);
 }
 
 /* open a connection to the given host and port.
@@ -520,7 +784,7 @@ listenINDI ()
 
 	/* read from server, exit if find all requested properties */
 	while (1) {
-	    XMLEle *root = readXMLEle (lillp, readServerChar(), msg);
+	    XMLEle *root = readServerXML (lillp, msg);
 	    if (root) {
 		/* found a complete XML element */
 		if (verbose > 2)
@@ -532,7 +796,8 @@ listenINDI ()
 	    } else if (msg[0]) {
 		fprintf (stderr, "Bad XML from %s:%d: %s\n", host, port, msg);
 		bye(2);
-	    }
+	    } else
+		serverGone();
 	}
 }
 
@@ -580,65 +845,79 @@ onAlarm (int dummy)
 	bye (trouble ? 1 : 0);
 }
 
-/* read one char from svrrfp */
-static int
-readServerChar ()
+/* report why readServerXML() found no more from the server and exit */
+static void
+serverGone ()
 {
-	int c = fgetc (svrrfp);
-
-	if (c == EOF) {
-	    if (ferror(svrrfp))
-		perror ("read");
-	    else
-		fprintf (stderr,"INDI server %s:%d disconnected\n", host, port);
-	    bye (2);
-	}
-
-	if (verbose > 3)
-	    fprintf (stderr, "%c", c);
-
-	return (c);
+	if (errno)
+	    perror ("read");
+	else
+	    fprintf (stderr,"INDI server %s:%d disconnected\n", host, port);
+	bye (2);
 }
 
 /* print value if root is any srchs[] we are looking for*/
 static void
 findDPE (XMLEle *root)
 {
-	int i, j;
+	char *tag = tagXMLEle (root);
+	char *dev, *nam, *perm;
+	SrchKey *kp;
+	int *lists[3], nlist[3], at[3];
+	int isdef, i, j, k, l;
+
+	/* one of the types we are looking for? */
+	for (j = 0; j < ndefs; j++)
+	    if (strcmp (tag, defs[j].vec) == 0)
+		break;
+	if (j == ndefs)
+	    return;
+	isdef = !strncmp(defs[j].vec, "def", 3);
+	if (fflag && isdef)
+	    return;
+
+	/* gather the srchs[] that can match dev.nam */
+	if (!scompiled)
+	    compileSearchDefs();
+	dev = findXMLAttValu (root, "device");
+	nam = findXMLAttValu (root, "name");
+	kp = findSrchKey (dev, nam);
+	lists[0] = kp ? kp->idx : NULL;
+	nlist[0] = kp ? kp->nidx : 0;
+	kp = findSrchKey (dev, "*");
+	lists[1] = kp ? kp->idx : NULL;
+	nlist[1] = kp ? kp->nidx : 0;
+	lists[2] = anydev;
+	nlist[2] = nanydev;
+	at[0] = at[1] = at[2] = 0;
+
+	/* visit them in srchs[] order */
+	while (1) {
+	    for (k = -1, l = 0; l < 3; l++)
+		if (at[l] < nlist[l] && (k < 0 || lists[l][at[l]] < lists[k][at[k]]))
+		    k = l;
+	    if (k < 0)
+		break;
+	    i = lists[k][at[k]++];
 
-	for (i = 0; i < nsrchs; i++) {
-	    /* for each property we are looking for */
-	    for (j = 0; j < ndefs; j++) {
-		/* for each possible type */
-		int isdef = !strncmp(defs[j].vec, "def", 3);
-		if ((!fflag || !isdef) && strcmp (tagXMLEle (root), defs[j].vec) == 0) {
-		    /* legal defXXXVector, check device */
-		    char *dev = findXMLAttValu (root, "device");
-		    char *idev = srchs[i].d;
-		    if (idev[0] == WILDCARD || !strcmp (dev,idev)) {
-			/* found device, check name */
-			char *nam = findXMLAttValu (root, "name");
-			char *iprop = srchs[i].p;
-			if (iprop[0] == WILDCARD || !strcmp (nam,iprop)) {
-			    /* found device and name, check perm */
-			    char *perm = findXMLAttValu (root, "perm");
-			    if (!wflag && perm[0] && !strchr (perm, 'r')) {
-				if (verbose)
-				    fprintf (stderr, "%s.%s is write-only\n",
-								    dev, nam);
-			    } else {
-				/* check elements or attr keywords */
-				if (!strcmp (defs[j].vec, "defBLOBVector") && Bflag)
-                                    enableBLOBs (dev,nam);      // ask for it
-                                findEle(root,dev,nam,defs[j].one,&srchs[i]);
-				if (onematch)
-				    return;		/* only one can match */
-				if (!strncmp (defs[j].vec, "def", 3))
-				    alarm (timeout);	/* reset timer if def */
-			    }
-			}
-		    }
-		}
+	    /* anydev still needs to check property */
+	    if (k == 2 && srchs[i].p[0] != WILDCARD && strcmp (nam, srchs[i].p))
+		continue;
+
+	    /* found device and name, check perm */
+	    perm = findXMLAttValu (root, "perm");
+	    if (!wflag && perm[0] && !strchr (perm, 'r')) {
+		if (verbose)
+		    fprintf (stderr, "%s.%s is write-only\n", dev, nam);
+	    } else {
+		/* check elements or attr keywords */
+		if (!strcmp (defs[j].vec, "defBLOBVector") && Bflag)
+		    enableBLOBs (dev,nam);      // ask for it
+		findEle(root,dev,nam,defs[j].one,&srchs[i]);
+		if (onematch)
+		    return;		/* only one can match */
+		if (!dpath && isdef)
+		    alarm (timeout);	/* reset timer if def */
 	    }
 	}
 }
@@ -660,9 +939,9 @@ findEle (XMLEle *root, const char *dev, const char *nam, const char *defone, Sea
 		char *s = findXMLAttValu (root, kwattr[i].indiattr);
 		sp->ok = 1;   			/* progress */
 		if (onematch && justvalue)
-		    printf ("%s\n", s);
+		    fprintf (outfp, "%s\n", s);
 		else
-		    printf ("%s.%s.%s=%s\n", dev, nam, kwattr[i].keyword, s);
+		    fprintf (outfp, "%s.%s.%s=%s\n", dev, nam, kwattr[i].keyword, s);
 		return;
 	    }
 	}
@@ -687,7 +966,7 @@ findEle (XMLEle *root, const char *dev, const char *nam, const char *defone, Sea
 
                     // handle output formats
 		    if (!is_blob && onematch && justvalue)
-			printf ("%s\n", p);
+			fprintf (outfp, "%s\n", p);
 		    else {
                         char *elabel = findXMLAttValu (ep, "label");
                         if (kflag || Kflag) {
@@ -700,13 +979,13 @@ findEle (XMLEle *root, const char *dev, const char *nam, const char *defone, Sea
                             int w = 0;
                             if (is_blob) {
                                 if (is_def)
-                                    w = printf ("%s.%s.%s=(BLOB)", dev, nam, enam);
+                                    w = fprintf (outfp, "%s.%s.%s=(BLOB)", dev, nam, enam);
                             } else
-                                w = printf ("%s.%s.%s=%s", dev, nam, enam, p);
+                                w = fprintf (outfp, "%s.%s.%s=%s", dev, nam, enam, p);
                             if (lflag && (!is_blob || is_def))
-                                printf ("%*s%s", LABELCOL-w-1, "", elabel);
+                                fprintf (outfp, "%*s%s", LABELCOL-w-1, "", elabel);
                             if (w > 0)
-                                putchar ('\n');
+                                fputc ('\n', outfp);
                         }
 		    }
 		    if (onematch)
@@ -738,14 +1017,16 @@ static void
 oneBLOB (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
     const char *enam, const char *pc, int pclen)
 {
-	char *format;
 	FILE *fp;
 	int bloblen;
 	unsigned char *blob;
 	int ucs;
 	int isz;
 	char fn[1024];
-	int i;
+
+	/* nothing more to do if already saved by streamBLOB() */
+	if (findXMLAtt (root, "streamed"))
+	    return;
 
 	/* get uncompressed size */
 	ucs = atoi(findXMLAttValu (root, "size"));
@@ -753,9 +1034,8 @@ oneBLOB (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
 	    fprintf (stderr, "%s.%s.%s reports uncompressed size as %d\n",
 							dev, nam, enam, ucs);
 
-	/* get format and length */
-	format = findXMLAttValu (root, "format");
-	isz = !strcmp (&format[strlen(format)-2], ".z");
+	/* get file name and whether compressed */
+	isz = blobFileName (parent, root, dev, nam, enam, fn);
 
 	/* decode blob from base64 in pc */
 	blob = (unsigned char *) malloc (3*pclen/4);
@@ -780,15 +1060,6 @@ oneBLOB (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
 	    bloblen = nuncomp;
 	}
 
-	/* rig up a file name from property name, include timestamp if desired */
-	if (aflag) {
-	    char *timestamp = findXMLAttValu (parent, "timestamp");
-	    i = sprintf (fn, "%s.%s.%s@%s%s", dev, nam, enam, timestamp, format);
-	} else
-	    i = sprintf (fn, "%s.%s.%s%s", dev, nam, enam, format);
-	if (isz)
-	    fn[i-2] = '\0'; 	/* chop off .z */
-
 	/* dispense */
 	if (oflag) {
 	    /* print */
@@ -810,98 +1081,296 @@ oneBLOB (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
 	free (blob);
 }
 
+/* rig up a file name in fn[] for the given oneBLOB root from its property
+ * name, including timestamp if desired.
+ * return whether the format says it is compressed, ie, ends with .z.
+ */
+static int
+blobFileName (XMLEle *parent, XMLEle *root, const char *dev, const char *nam,
+    const char *enam, char fn[])
+{
+	char *format = findXMLAttValu (root, "format");
+	int l = strlen (format);
+	int isz = l >= 2 && !strcmp (&format[l-2], ".z");
+	int i;
+
+	if (aflag) {
+	    char *timestamp = findXMLAttValu (parent, "timestamp");
+	    i = snprintf (fn, 1024, "%s.%s.%s@%s%s", dev, nam, enam, timestamp,
+	    								format);
+	} else
+	    i = snprintf (fn, 1024, "%s.%s.%s%s", dev, nam, enam, format);
+	if (isz && i < 1024)
+	    fn[i-2] = '\0'; 	/* chop off .z */
+
+	return (isz);
+}
+
+/* serverxml sink to save the content of wanted oneBLOBs as it arrives,
+ * base64 decoding and inflating through fixed buffers, rather than waiting
+ * for the whole element then decoding and inflating all at once.
+ * we mark ep with a "streamed" attribute when done so oneBLOB() knows.
+ * see sinkServerXML() for the calling sequence.
+ */
+static int
+streamBLOB (XMLEle *ep, const char *s, int n)
+{
+	SBLOB *sp = &sblob;
+
+	if (n == 0) {
+	    /* new element: want it? */
+	    XMLEle *parent = parentXMLEle (ep);
+	    if (!parent || strcmp (tagXMLEle (ep), "oneBLOB")
+			|| strcmp (tagXMLEle (parent), "setBLOBVector"))
+		return (0);
+	    sp->dev = findXMLAttValu (parent, "device");
+	    sp->nam = findXMLAttValu (parent, "name");
+	    sp->enam = findXMLAttValu (ep, "name");
+	    if (!wantBLOB (sp->dev, sp->nam, sp->enam))
+		return (0);
+
+	    sp->ep = ep;
+	    sp->ucs = atoi(findXMLAttValu (ep, "size"));
+	    if (verbose > 1)
+		fprintf (stderr, "%s.%s.%s reports uncompressed size as %d\n",
+					    sp->dev, sp->nam, sp->enam, sp->ucs);
+	    sp->isz = blobFileName (parent, ep, sp->dev, sp->nam, sp->enam,
+	    								sp->fn);
+	    if (oflag)
+		sp->fd = -1;
+	    else {
+		sp->fd = open (sp->fn, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+		if (sp->fd < 0)
+		    fprintf (stderr, "%s: %s\n", sp->fn, strerror(errno));
+		else if (sp->ucs > 0)
+		    (void) posix_fallocate (sp->fd, 0, sp->ucs); /* best effort*/
+	    }
+	    sp->nout = 0;
+	    b64DecInit (&sp->b64);
+	    if (sp->isz) {
+		memset (&sp->zs, 0, sizeof(sp->zs));
+		inflateInit (&sp->zs);
+		sp->zret = Z_OK;
+	    }
+	    return (1);
+	}
+
+	if (n > 0) {
+	    /* decode and dispense more content */
+	    int nd = b64DecUpdate (&sp->b64, sp->dec, s, n);
+	    if (nd < 0) {
+		fprintf (stderr, "%s.%s.%s bad base64\n", sp->dev, sp->nam,
+								    sp->enam);
+		bye(2);
+	    }
+	    if (!sp->isz) {
+		writeBLOB (sp->dec, nd);
+		return (0);
+	    }
+	    sp->zs.next_in = (unsigned char *) sp->dec;
+	    sp->zs.avail_in = nd;
+	    while (sp->zs.avail_in > 0 && sp->zret == Z_OK) {
+		sp->zs.next_out = sp->inf;
+		sp->zs.avail_out = sizeof(sp->inf);
+		sp->zret = inflate (&sp->zs, Z_NO_FLUSH);
+		if (sp->zret != Z_OK && sp->zret != Z_STREAM_END) {
+		    fprintf (stderr, "%s.%s.%s uncompress error %d\n", sp->dev,
+						    sp->nam, sp->enam, sp->zret);
+		    bye(2);
+		}
+		writeBLOB (sp->inf, sizeof(sp->inf) - sp->zs.avail_out);
+	    }
+	    return (0);
+	}
+
+	/* end of content: check all came out right and close */
+	if (b64DecFinal (&sp->b64) < 0) {
+	    fprintf (stderr, "%s.%s.%s bad base64\n", sp->dev, sp->nam, sp->enam);
+	    bye(2);
+	}
+	if (sp->isz) {
+	    inflateEnd (&sp->zs);
+	    if (sp->zret != Z_STREAM_END) {
+		fprintf (stderr, "%s.%s.%s uncompress error %d\n", sp->dev,
+						sp->nam, sp->enam, Z_BUF_ERROR);
+		bye(2);
+	    }
+	}
+	if (sp->fd >= 0) {
+	    if (sp->ucs > 0 && sp->nout != sp->ucs)
+		(void) ftruncate (sp->fd, sp->nout);	/* undo fallocate */
+	    close (sp->fd);
+	    if (verbose)
+		fprintf (stderr, "Wrote %s\n", sp->fn);
+	}
+	addXMLAtt (ep, (char *)"streamed", (char *)"1");
+	return (0);
+}
+
+/* return whether any srchs[] will want the BLOB dev.nam.enam
+ */
+static int
+wantBLOB (const char *dev, const char *nam, const char *enam)
+{
+	int i;
+
+	for (i = 0; i < nsrchs; i++) {
+	    SearchDef *sp = &srchs[i];
+	    if ((sp->d[0] == WILDCARD || !strcmp (sp->d, dev))
+			&& (sp->p[0] == WILDCARD || !strcmp (sp->p, nam))
+			&& (sp->e[0] == WILDCARD || !strcmp (sp->e, enam)))
+		return (1);
+	}
+	return (0);
+}
+
+/* write n bytes of decoded BLOB to stdout if oflag, else to sblob.fd if open.
+ */
+static void
+writeBLOB (const void *buf, int n)
+{
+	const char *p = (const char *) buf;
+	int nw;
+
+	sblob.nout += n;
+	if (oflag) {
+	    fwrite (p, n, 1, stdout);	/* keep in order with other output */
+	    return;
+	}
+	while (sblob.fd >= 0 && n > 0) {
+	    nw = write (sblob.fd, p, n);
+	    if (nw < 0) {
+		if (errno == EINTR)
+		    continue;
+		fprintf (stderr, "%s: %s\n", sblob.fn, strerror(errno));
+		close (sblob.fd);
+		sblob.fd = -1;		/* give up, as with fopen failure */
+		break;
+	    }
+	    p += nw;
+	    n -= nw;
+	}
+}
+
 /* add an element to the tree unless already present.
  * set k_time to time(2) if new.
+ * N.B. lists are in no particular order until sortKTree()
  */
 static void addKElement (const char *devname, const char *propname, const char *proplabel,
     const char *proptype, const char *perm, const char *elemname, const char *elemlabel)
 {
-        // point prev_devpp at the KDevice whose devname is at or after the new devname
-        KDevice **prev_devpp;
-        int dev_exists = 0;
-        for (prev_devpp = &kdevs; *prev_devpp; prev_devpp = &(*prev_devpp)->next_devp) {
-            int cmp = strcmp ((*prev_devpp)->devname, devname);
-            if (cmp == 0) {
-                dev_exists = 1;
-                break;
-            }
-            if (cmp > 0)
+        // find or create the KDevice
+        KDevice **hdevpp = &kdevhash[kHash (NULL, devname)];
+        KDevice *dp;
+        for (dp = *hdevpp; dp; dp = dp->hnext_devp)
+            if (strcmp (dp->devname, devname) == 0)
                 break;
+        if (!dp) {
+            dp = (KDevice*) malloc (sizeof(KDevice));
+            dp->devname = strdup (devname);
+            dp->propsp = NULL;
+            dp->next_devp = kdevs;
+            kdevs = dp;
+            dp->hnext_devp = *hdevpp;
+            *hdevpp = dp;
         }
 
-        // point *prev_devpp to a new KDevice if not already present
-        if (!dev_exists) {
-            // create a new KDevice
-            KDevice *new_devp = (KDevice*) malloc (sizeof(KDevice));
-
-            // link after prev_devpp
-            new_devp->devname = strdup (devname);
-            new_devp->propsp = NULL;
-            new_devp->next_devp = *prev_devpp;
-            *prev_devpp = new_devp;
-        }
-
-        // KDevice in whose propsp list we now search for propname
-        KDevice *dp = *prev_devpp;
-
-        // point prev_proppp at the KProperty whose propname is at or after the new propname
-        KProperty **prev_proppp;
-        int prop_exists = false;
-        for (prev_proppp = &dp->propsp; *prev_proppp; prev_proppp = &(*prev_proppp)->next_propp) {
-            int cmp = strcmp ((*prev_proppp)->propname, propname);
-            if (cmp == 0) {
-                prop_exists = 1;
-                break;
-            }
-            if (cmp > 0)
+        // find or create the KProperty in dp
+        KProperty **hproppp = &kprophash[kHash (dp, propname)];
+        KProperty *pp;
+        for (pp = *hproppp; pp; pp = pp->hnext_propp)
+            if (pp->devp == dp && strcmp (pp->propname, propname) == 0)
                 break;
+        if (!pp) {
+            pp = (KProperty*) malloc (sizeof(KProperty));
+            pp->propname = strdup (propname);
+            pp->proplabel = strdup (proplabel);
+            pp->proptype = strdup (proptype);
+            pp->perm = strdup(perm);
+            pp->elemsp = NULL;
+            pp->next_propp = dp->propsp;
+            dp->propsp = pp;
+            pp->devp = dp;
+            pp->hnext_propp = *hproppp;
+            *hproppp = pp;
         }
 
-        // point *prev_proppp to a new KProperty if not already present
-        if (!prop_exists) {
-            // create a new KProperty
-            KProperty *new_propp = (KProperty*) malloc (sizeof(KProperty));
-
-            // link after prev_proppp
-            new_propp->propname = strdup (propname);
-            new_propp->proplabel = strdup (proplabel);
-            new_propp->proptype = strdup (proptype);
-            new_propp->perm = strdup(perm);
-            new_propp->elemsp = NULL;
-            new_propp->next_propp = *prev_proppp;
-            *prev_proppp = new_propp;
-        }
-
-        // KProperty in whose elemsp list we now search for elemname
-        KProperty *pp = *prev_proppp;
-
-        // point prev_elempp at the KElement whose propname is at or after the new propname
-        KElement **prev_elempp;
-        int elem_exists = 0;
-        for (prev_elempp = &pp->elemsp; *prev_elempp; prev_elempp = &(*prev_elempp)->next_elemp) {
-            int cmp = strcmp ((*prev_elempp)->elemname, elemname);
-            if (cmp == 0) {
-                elem_exists = 1;
-                break;
-            }
-            if (cmp > 0)
+        // find or create the KElement in pp
+        KElement **helempp = &kelemhash[kHash (pp, elemname)];
+        KElement *ep;
+        for (ep = *helempp; ep; ep = ep->hnext_elemp)
+            if (ep->propp == pp && strcmp (ep->elemname, elemname) == 0)
                 break;
+        if (!ep) {
+            ep = (KElement*) malloc (sizeof(KElement));
+            ep->elemname = strdup (elemname);
+            ep->elemlabel = strdup (elemlabel);
+            ep->next_elemp = pp->elemsp;
+            pp->elemsp = ep;
+            ep->propp = pp;
+            ep->hnext_elemp = *helempp;
+            *helempp = ep;
+
+            // record time
+            k_time = time(NULL);
         }
+}
 
-        // point *prev_elempp to a new KProperty if not already present
-        if (!elem_exists) {
-            // create a new KProperty
-            KElement *new_elemp = (KElement*) malloc (sizeof(KElement));
+/* return hash bucket for name within the given owner node
+ */
+static unsigned kHash (const void *owner, const char *name)
+{
+        unsigned h = 2166136261u ^ (unsigned)((size_t)owner >> 4);
+        for (; *name; name++)
+            h = (h ^ (unsigned char)*name) * 16777619u;
+        return (h & (NKHASH-1));
+}
 
-            // link after prev_elempp
-            new_elemp->elemname = strdup (elemname);
-            new_elemp->elemlabel = strdup (elemlabel);
-            new_elemp->next_elemp = *prev_elempp;
-            *prev_elempp = new_elemp;
+/* qsort comparators for sortKTree()
+ */
+static int kDevCmp (const void *p1, const void *p2)
+{
+        return (strcmp ((*(KDevice**)p1)->devname, (*(KDevice**)p2)->devname));
+}
+static int kPropCmp (const void *p1, const void *p2)
+{
+        return (strcmp ((*(KProperty**)p1)->propname, (*(KProperty**)p2)->propname));
+}
+static int kElemCmp (const void *p1, const void *p2)
+{
+        return (strcmp ((*(KElement**)p1)->elemname, (*(KElement**)p2)->elemname));
+}
 
-            // record time
-            k_time = time(NULL);
+/* sort each list in the tree at kdevs into alpha order by name
+ */
+static void sortKTree()
+{
+        void **a = NULL;
+        int na = 0, ma = 0, i;
+
+        // put list headed at h linked by member nxt of type T in a[], sort then relink
+        #define SORTKLIST(T,h,nxt,cmp) do {                                     \
+            na = 0;                                                             \
+            for (T *xp = h; xp; xp = xp->nxt) {                                 \
+                if (na == ma)                                                   \
+                    a = (void **) realloc (a, (ma = 2*ma+64) * sizeof(void*));  \
+                a[na++] = xp;                                                   \
+            }                                                                   \
+            qsort (a, na, sizeof(void*), cmp);                                  \
+            for (i = 0; i < na; i++)                                            \
+                ((T*)a[i])->nxt = i < na-1 ? (T*)a[i+1] : NULL;                 \
+            h = na > 0 ? (T*)a[0] : NULL;                                       \
+        } while (0)
+
+        SORTKLIST (KDevice, kdevs, next_devp, kDevCmp);
+        for (KDevice *dp = kdevs; dp; dp = dp->next_devp) {
+            SORTKLIST (KProperty, dp->propsp, next_propp, kPropCmp);
+            for (KProperty *pp = dp->propsp; pp; pp = pp->next_propp)
+                SORTKLIST (KElement, pp->elemsp, next_elemp, kElemCmp);
         }
+
+        #undef SORTKLIST
+        free (a);
 }
 
 /* print the INDI property tree in plain text starting at kdevs
@@ -969,18 +1438,539 @@ static void printKDoKu()
 }
 
 
+/* run as a daemon: keep cache current from the server and answer queries.
+ * we wait for the initial flood of defs to go quiet for timeout secs before
+ *   accepting queries so answers are complete. never returns.
+ */
+static void
+daemonINDI ()
+{
+	struct pollfd pfds[MAXDCLIENTS+2];
+	DClient *cps[MAXDCLIENTS+2];
+	int svrfd = fileno (svrrfp);
+	long long lastdef = msnow();
+	int ready = 0;
+	char msg[1024];
+	char buf[32768];
+	int i, n, nr;
+
+	signal (SIGPIPE, SIG_IGN);
+	signal (SIGTERM, onTerm);
+	signal (SIGINT, onTerm);
+	for (i = 0; i < MAXDCLIENTS; i++)
+	    dclients[i].rfd = -1;
+
+	/* the specs just limited what getprops() asked for */
+	freeSearchDefs();
+
+	while (1) {
+	    int to = -1;
+
+	    /* always listen to server, clients and new clients once ready */
+	    n = 0;
+	    pfds[n].fd = svrfd;
+	    pfds[n++].events = POLLIN;
+	    if (ready) {
+		if (dlfd >= 0) {
+		    cps[n] = NULL;
+		    pfds[n].fd = dlfd;
+		    pfds[n++].events = POLLIN;
+		}
+		for (i = 0; i < MAXDCLIENTS; i++) {
+		    DClient *cp = &dclients[i];
+		    if (cp->rfd >= 0) {
+			cps[n] = cp;
+			pfds[n].fd = cp->nobuf > 0 ? cp->wfd : cp->rfd;
+			pfds[n++].events = cp->nobuf > 0 ? POLLOUT : POLLIN;
+		    }
+		}
+	    } else if (timeout > 0) {
+		to = (int)(lastdef + timeout*1000 - msnow());
+		if (to < 0)
+		    to = 0;
+	    }
+
+	    if (ready || to != 0) {
+		if (poll (pfds, n, to) < 0) {
+		    if (errno == EINTR)
+			continue;
+		    perror ("poll");
+		    bye (2);
+		}
+	    } else
+		pfds[0].revents = 0;
+
+	    /* start serving once defs have settled */
+	    if (!ready && (timeout == 0 || msnow() - lastdef >= timeout*1000)) {
+		startServing();
+		ready = 1;
+		continue;
+	    }
+
+	    /* update cache from server, as much as it has for us */
+	    if (pfds[0].revents) {
+		nr = read (svrfd, buf, sizeof(buf));
+		if (nr <= 0) {
+		    if (nr < 0)
+			perror ("read");
+		    else
+			fprintf (stderr,"INDI server %s:%d disconnected\n",
+								host, port);
+		    bye (2);
+		}
+		if (verbose > 3)
+		    fwrite (buf, nr, 1, stderr);
+		for (i = 0; i < nr; i++) {
+		    XMLEle *root = readXMLEle (lillp, buf[i], msg);
+		    if (root) {
+			if (verbose > 2)
+			    prXMLEle (stderr, root, 0);
+			if (cacheMsg (root))
+			    lastdef = msnow();	/* root is now in cache */
+			else
+			    delXMLEle (root);
+		    } else if (msg[0]) {
+			fprintf (stderr, "Bad XML from %s:%d: %s\n", host, port,
+									msg);
+			bye(2);
+		    }
+		}
+	    }
+
+	    /* new client or queries */
+	    for (i = 1; i < n; i++) {
+		if (!pfds[i].revents)
+		    continue;
+		if (cps[i]) {
+		    if (cps[i]->nobuf > 0)
+			writeDClient (cps[i]);
+		    else
+			readDClient (cps[i]);
+		} else {
+		    int cfd = accept (dlfd, NULL, NULL);
+		    int j;
+
+		    if (cfd < 0)
+			continue;
+		    for (j = 0; j < MAXDCLIENTS; j++)
+			if (dclients[j].rfd < 0)
+			    break;
+		    if (j == MAXDCLIENTS) {
+			if (verbose)
+			    fprintf (stderr, "Too many clients\n");
+			close (cfd);
+			continue;
+		    }
+		    fcntl (cfd, F_SETFL, fcntl (cfd, F_GETFL) | O_NONBLOCK);
+		    dclients[j].rfd = dclients[j].wfd = cfd;
+		    dclients[j].nbuf = 0;
+		    if (verbose > 1)
+			fprintf (stderr, "Client %d connected\n", cfd);
+		}
+	    }
+	}
+}
+
+/* begin accepting queries on dpath, or stdin if "-".
+ */
+static void
+startServing ()
+{
+	if (verbose)
+	    fprintf (stderr, "Serving %d properties on %s\n", ncprops, dpath);
+
+	if (strcmp (dpath, "-") == 0) {
+	    dclients[0].rfd = 0;
+	    dclients[0].wfd = 1;
+	    dclients[0].nbuf = 0;
+	} else {
+	    struct sockaddr_un sun;
+
+	    if (strlen (dpath) >= sizeof(sun.sun_path)) {
+		fprintf (stderr, "%s: socket path too long\n", dpath);
+		bye (2);
+	    }
+	    memset (&sun, 0, sizeof(sun));
+	    sun.sun_family = AF_UNIX;
+	    strcpy (sun.sun_path, dpath);
+	    unlink (dpath);
+	    if ((dlfd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+		    || bind (dlfd, (struct sockaddr *)&sun, sizeof(sun)) < 0
+		    || listen (dlfd, 16) < 0) {
+		fprintf (stderr, "%s: %s\n", dpath, strerror(errno));
+		bye (2);
+	    }
+	}
+}
+
+/* read more from the given client and answer each complete line as a query.
+ * close if EOF, or exit if it was stdin.
+ */
+static void
+readDClient (DClient *cp)
+{
+	int nr = read (cp->rfd, cp->buf+cp->nbuf, sizeof(cp->buf)-cp->nbuf);
+	char *line, *nl;
+
+	if (nr <= 0) {
+	    if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	    if (cp->rfd == 0)
+		bye (0);
+	    if (verbose > 1)
+		fprintf (stderr, "Client %d disconnected\n", cp->rfd);
+	    closeDClient (cp);
+	    return;
+	}
+	cp->nbuf += nr;
+
+	/* collect the answers to each complete line */
+	outfp = open_memstream (&cp->obuf, &cp->nobuf);
+	if (!outfp) {
+	    perror ("open_memstream");
+	    bye (2);
+	}
+	line = cp->buf;
+	while ((nl = (char *) memchr (line, '\n', cp->nbuf - (line-cp->buf)))) {
+	    *nl = '\0';
+	    answerQuery (line);
+	    line = nl + 1;
+	}
+
+	/* keep partial line, or just answer it if too long to ever finish */
+	cp->nbuf -= line - cp->buf;
+	if (cp->nbuf == (int)sizeof(cp->buf)) {
+	    cp->buf[cp->nbuf-1] = '\0';
+	    answerQuery (cp->buf);
+	    cp->nbuf = 0;
+	} else
+	    memmove (cp->buf, line, cp->nbuf);
+
+	/* send as much as the client will take now */
+	fclose (outfp);
+	outfp = stdout;
+	writeDClient (cp);
+	if (cp->rfd >= 0 && cp->nobuf > MAXDCOUT) {
+	    if (verbose)
+		fprintf (stderr, "Client %d not reading answers\n", cp->rfd);
+	    closeDClient (cp);
+	}
+}
+
+/* write as much of the given client's queued answers as it will take.
+ * close if it is gone.
+ */
+static void
+writeDClient (DClient *cp)
+{
+	size_t nw = 0;
+
+	while (nw < cp->nobuf) {
+	    ssize_t w = write (cp->wfd, cp->obuf+nw, cp->nobuf-nw);
+	    if (w < 0) {
+		if (errno == EINTR)
+		    continue;
+		if (errno == EAGAIN)
+		    break;
+		if (cp->rfd == 0)
+		    bye (0);
+		if (verbose > 1)
+		    fprintf (stderr, "Client %d: %s\n", cp->rfd,strerror(errno));
+		closeDClient (cp);
+		return;
+	    }
+	    nw += w;
+	}
+
+	cp->nobuf -= nw;
+	if (cp->nobuf > 0)
+	    memmove (cp->obuf, cp->obuf+nw, cp->nobuf);
+	else {
+	    free (cp->obuf);
+	    cp->obuf = NULL;
+	}
+}
+
+/* close the given client and forget any answers not yet written */
+static void
+closeDClient (DClient *cp)
+{
+	close (cp->rfd);
+	cp->rfd = -1;
+	free (cp->obuf);
+	cp->obuf = NULL;
+	cp->nobuf = 0;
+}
+
+/* answer one d.p.e query spec from the cache to outfp: a name=value line for
+ * each match, a line "!spec" if nothing matched, then an empty line to mark
+ * the end.
+ */
+static void
+answerQuery (char *spec)
+{
+	CProp *pp;
+	int l;
+
+	/* ignore empty lines and tolerate \r\n */
+	l = strlen (spec);
+	if (l > 0 && spec[l-1] == '\r')
+	    spec[--l] = '\0';
+	if (l == 0)
+	    return;
+
+	if (spec[0] != '.' && crackDPE (spec) == 0) {
+	    onematch = !srchs[0].wc;
+	    if (srchs[0].d[0] != WILDCARD && srchs[0].p[0] != WILDCARD) {
+		/* at most one property can match */
+		CProp **hpp = cacheFind (srchs[0].d, srchs[0].p);
+		if (*hpp)
+		    findDPE ((*hpp)->def);
+	    } else {
+		for (pp = cprops; pp && !(onematch && srchs[0].ok);
+								pp = pp->next)
+		    findDPE (pp->def);
+	    }
+	}
+	if (nsrchs == 0 || !srchs[0].ok)
+	    fprintf (outfp, "!%s\n", spec);
+	fputc ('\n', outfp);
+	freeSearchDefs();
+}
+
+/* add a defXXXVector to the cache or apply a setXXXVector or delProperty.
+ * return 1 if root itself is now in the cache, else 0.
+ */
+static int
+cacheMsg (XMLEle *root)
+{
+	char *tag = tagXMLEle (root);
+	char *dev = findXMLAttValu (root, "device");
+	char *nam = findXMLAttValu (root, "name");
+	CProp **hpp, *pp;
+
+	if (!strncmp (tag, "def", 3)) {
+	    /* new or redefined */
+	    hpp = cacheFind (dev, nam);
+	    if (*hpp) {
+		delXMLEle ((*hpp)->def);
+		(*hpp)->def = root;
+	    } else {
+		CProp **lpp;
+		pp = (CProp *) calloc (1, sizeof(CProp));
+		pp->def = root;
+		*hpp = pp;
+		for (lpp = &cprops; *lpp; lpp = &(*lpp)->next)
+		    continue;
+		*lpp = pp;
+		ncprops++;
+	    }
+	    return (1);
+	}
+
+	if (!strncmp (tag, "set", 3)) {
+	    /* copy new attributes and element values into the def */
+	    XMLEle *def, *ep, *dep;
+	    XMLAtt *ap, *dap;
+
+	    hpp = cacheFind (dev, nam);
+	    if (!*hpp)
+		return (0);
+	    def = (*hpp)->def;
+	    for (ap = nextXMLAtt (root, 1); ap; ap = nextXMLAtt (root, 0)) {
+		dap = findXMLAtt (def, nameXMLAtt(ap));
+		if (dap)
+		    editXMLAtt (dap, valuXMLAtt(ap));
+		else
+		    addXMLAtt (def, nameXMLAtt(ap), valuXMLAtt(ap));
+	    }
+	    for (ep = nextXMLEle (root, 1); ep; ep = nextXMLEle (root, 0)) {
+		char *enam = findXMLAttValu (ep, "name");
+		for (dep = nextXMLEle (def, 1); dep; dep = nextXMLEle (def, 0))
+		    if (!strcmp (findXMLAttValu (dep, "name"), enam)) {
+			editXMLEle (dep, pcdataXMLEle(ep));
+			break;
+		    }
+	    }
+	    return (0);
+	}
+
+	if (!strcmp (tag, "delProperty")) {
+	    /* one property, or all for dev if no name */
+	    if (nam[0]) {
+		hpp = cacheFind (dev, nam);
+		if (*hpp)
+		    cacheDel (hpp);
+	    } else {
+		CProp *next;
+		for (pp = cprops; pp; pp = next) {
+		    next = pp->next;
+		    if (!strcmp (findXMLAttValu (pp->def, "device"), dev))
+			cacheDel (cacheFind (dev,
+					    findXMLAttValu (pp->def, "name")));
+		}
+	    }
+	}
+
+	return (0);
+}
+
+/* return address of the hash link to the cached dev.nam, or of the NULL at
+ * the end of its bucket if not present.
+ */
+static CProp **
+cacheFind (const char *dev, const char *nam)
+{
+	CProp **hpp;
+
+	for (hpp = &chash[dpHash(dev,nam) & (NCHASH-1)]; *hpp; hpp = &(*hpp)->hnext) {
+	    XMLEle *def = (*hpp)->def;
+	    if (!strcmp (findXMLAttValu (def, "name"), nam)
+			    && !strcmp (findXMLAttValu (def, "device"), dev))
+		break;
+	}
+	return (hpp);
+}
+
+/* remove the cached property at the given hash link
+ */
+static void
+cacheDel (CProp **hpp)
+{
+	CProp *pp = *hpp, **lpp;
+
+	*hpp = pp->hnext;
+	for (lpp = &cprops; *lpp != pp; lpp = &(*lpp)->next)
+	    continue;
+	*lpp = pp->next;
+	delXMLEle (pp->def);
+	free (pp);
+	ncprops--;
+}
+
+/* forget all srchs[]
+ */
+static void
+freeSearchDefs ()
+{
+	int i;
+
+	for (i = 0; i < nsrchs; i++) {
+	    free (srchs[i].d);
+	    free (srchs[i].p);
+	    free (srchs[i].e);
+	}
+	nsrchs = 0;
+	freeSrchKeys();
+}
+
+/* ask the daemon at upath for each srchs[] and print the answers as if we
+ * had asked the server ourselves, then exit with the usual status.
+ */
+static void
+queryDaemon ()
+{
+	struct sockaddr_un sun;
+	struct timeval tv;
+	char *line = NULL;
+	size_t linesz = 0;
+	int trouble = 0;
+	int fd, i;
+	FILE *fp;
+
+	if (strlen (upath) >= sizeof(sun.sun_path)) {
+	    fprintf (stderr, "%s: socket path too long\n", upath);
+	    exit (2);
+	}
+	memset (&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy (sun.sun_path, upath);
+	if ((fd = socket (AF_UNIX, SOCK_STREAM, 0)) < 0
+		|| connect (fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+	    fprintf (stderr, "%s: %s\n", upath, strerror(errno));
+	    exit (2);
+	}
+
+	/* don't wait forever for an answer */
+	if (timeout > 0) {
+	    tv.tv_sec = timeout;
+	    tv.tv_usec = 0;
+	    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+
+	/* send all queries at once, one per line */
+	fp = fdopen (fd, "r+");
+	for (i = 0; i < nsrchs; i++)
+	    fprintf (fp, "%s.%s.%s\n", srchs[i].d, srchs[i].p, srchs[i].e);
+	fflush (fp);
+
+	/* print each answer, through its empty line */
+	for (i = 0; i < nsrchs; ) {
+	    if (getline (&line, &linesz, fp) < 0) {
+		if (ferror(fp))
+		    fprintf (stderr, "%s: %s\n", upath, errno == EAGAIN
+					    ? "timed out" : strerror(errno));
+		else
+		    fprintf (stderr, "%s: daemon disconnected\n", upath);
+		exit (2);
+	    }
+	    if (line[0] == '\n')
+		i++;
+	    else if (line[0] == '!') {
+		trouble = 1;
+		if (!qflag)
+		    fprintf (stderr, "No %.*s from %s\n", (int)strlen(line+1)-1,
+								line+1, upath);
+	    } else if (onematch && justvalue) {
+		/* skip the exact "d.p.e=" */
+		size_t l = strlen(srchs[0].d) + strlen(srchs[0].p)
+						    + strlen(srchs[0].e) + 3;
+		fputs (strlen(line) > l ? line + l : line, stdout);
+	    } else
+		fputs (line, stdout);
+	}
+
+	exit (trouble);
+}
+
+/* return a monotonic time in ms
+ */
+static long long
+msnow ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec*1000LL + ts.tv_nsec/1000000);
+}
+
+/* SIGTERM or SIGINT while a daemon: remove our socket and exit.
+ */
+static void
+onTerm (int dummy)
+{
+	if (dlfd >= 0)
+	    unlink (dpath);
+	_exit (0);
+}
+
 /* cleanly close svr/wfp then exit(n)
  */
 static void
 bye(int n)
 {
         if (n == 0) {
+            if (kflag || Kflag)
+                sortKTree();
             if (kflag)
                 printKplain();
             if (Kflag)
                 printKDoKu();
         }
 
+	if (dlfd >= 0)
+	    unlink (dpath);
+
 	if ((svrwfp || svrrfp) && directfd < 0) {
 	    int rfd = svrrfp ? fileno(svrrfp) : -1;
 	    int wfd = svrwfp ? fileno(svrwfp) : -1;
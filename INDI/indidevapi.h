@@ -94,6 +94,25 @@ extern void IDFSetLight (FILE *fp, const ILightVectorProperty *l, const char *ms
 extern void IDFSetBLOB (FILE *fp, const IBLOBVectorProperty *b, const char *msg, ...);
 
 
+/*******************************************************************************
+ * Functions Drivers may call to put a vector Property in delta mode. Then each
+ * IDSet*() sends only the elements that changed since they were last sent, or
+ * nothing at all if none did. All elements are sent after each IDDef*(), when
+ * the state, timeout or message changes, and at least every refreshms
+ * milliseconds, or never just for time if refreshms is 0. refreshms < 0 turns
+ * delta mode back off. A Number only counts as changed once it has moved more
+ * than its deadband, which defaults to 0, from the value last sent.
+ */
+
+extern void IDDeltaText (const ITextVectorProperty *t, int refreshms);
+extern void IDDeltaNumber (const INumberVectorProperty *n, int refreshms);
+extern void IDDeltaSwitch (const ISwitchVectorProperty *s, int refreshms);
+extern void IDDeltaLight (const ILightVectorProperty *l, int refreshms);
+
+extern void IDDeadband (const INumberVectorProperty *n, const char *name,
+    double deadband);
+
+
 /*******************************************************************************
  * Function Drivers call to send log messages to Clients. If dev is specified
  * the Client shall associate the message with that device; if dev is NULL the
@@ -146,13 +165,31 @@ extern void IDFSnoopBLOBs (FILE *fp, char *snooped_device_name, BLOBHandling bh)
 extern void IDLog (const char *msg, ...);
 
 
+/*******************************************************************************
+ * Functions Drivers may call to send several messages with one write. Each ID*()
+ * normally flushes its FILE at once. Between IDBatchBegin() and the matching
+ * IDBatchEnd() messages from all threads are held and then flushed together;
+ * calls may be nested. IDAutoFlush() with ms > 0 instead flushes no later than
+ * ms milliseconds after each message; ms of 0 restores flushing at once.
+ */
+
+extern void IDBatchBegin (void);
+extern void IDBatchEnd (void);
+extern void IDAutoFlush (int ms);
+
+extern void IDFBatchBegin (FILE *fp);
+extern void IDFBatchEnd (FILE *fp);
+extern void IDFAutoFlush (FILE *fp, int ms);
+
+
 
 /*******************************************************************************
  * Functions Drivers call to register with the INDI event utilities.
  *
  *   Callbacks are called when a read on a file descriptor will not block.
- *   Timers are called once after a specified interval.
+ *   Timers are called once after a specified interval, or periodically.
  *   Workprocs are called when there is nothing else to do.
+ *   Jobs run on a pool of worker threads, then call back in the event loop.
  *
  * The "Add" functions return a unique id for use with their corresponding "Rm"
  * removal function. An arbitrary pointer may be specified when a function is
@@ -172,11 +209,37 @@ extern int  IEAddCallback (int readfiledes, IE_CBF *fp, void *userpointer);
 extern void IERmCallback (int callbackid);
 
 extern int  IEAddTimer (int millisecs, IE_TCF *fp, void *userpointer);
+extern int  IEAddTimerUs (long microsecs, IE_TCF *fp, void *userpointer);
+extern int  IEAddPeriodicTimer (long microsecs, IE_TCF *fp, void *userpointer);
 extern void IERmTimer (int timerid);
 
+/* how late timers have been called, all times in microseconds */
+
+typedef struct {
+    long ncalls;			/* n times called */
+    long nmissed;			/* n periods skipped because called late */
+    double meanlate;			/* mean time called after deadline */
+    double maxlate;			/* max time called after deadline */
+    double jitter;			/* standard deviation of lateness */
+} IETimerStats;
+
+extern int  IEGetTimerStats (int timerid, IETimerStats *sp);
+
 extern int  IEAddWorkProc (IE_WPF *fp, void *userpointer);
 extern void IERmWorkProc (int workprocid);
 
+/* functions to run slow work off the event loop thread. jobfp runs on a worker
+ * thread, then donefp, if not NULL, is called from the event loop where it may
+ * use the other IE and ID functions as usual. IEAddJob returns 0 if queued,
+ * -1 if the pool is full. Like them, IEAddJob may only be called from the
+ * event loop thread, so a jobfp that wants another job must leave it to donefp.
+ */
+
+typedef void (IE_JOBF) (void *userpointer);
+
+extern int  IEAddJob (IE_JOBF *jobfp, IE_JOBF *donefp, void *userpointer);
+extern void IEJobPool (int nthreads, int maxjobs);
+
 /* wait in-line for a flag to set, presumably by another event function */
 
 extern int IEDeferLoop (int maxms, int *flagp);
@@ -207,6 +270,27 @@ extern int IUCrackSwitch(ISwitchVectorProperty *tvp, const char *dev,
 extern int IUCrackBLOB(IBLOBVectorProperty *bvp, const char *dev, const char *name, int sizes[],
     int blobsizes[], char *blobs[], char *formats[], char *names[], int n);
 
+/* functions to register a handler called directly for new messages to one
+ * vector instead of the ISNewXXX function. the framework finds the vector by
+ * hash and passes the index within it of each of the n named elements in
+ * idx[], or -1 if it has no such element. a NULL handler unregisters.
+ */
+
+typedef void (IS_NUMBERF) (INumberVectorProperty *nvp, double *doubles,
+    char *names[], int idx[], int n);
+typedef void (IS_SWITCHF) (ISwitchVectorProperty *svp, ISState *states,
+    char *names[], int idx[], int n);
+typedef void (IS_TEXTF) (ITextVectorProperty *tvp, char *texts[],
+    char *names[], int idx[], int n);
+typedef void (IS_BLOBF) (IBLOBVectorProperty *bvp, int sizes[],
+    int blobsizes[], char *blobs[], char *formats[], char *names[], int idx[],
+    int n);
+
+extern void IURegNumber (INumberVectorProperty *nvp, IS_NUMBERF *fp);
+extern void IURegSwitch (ISwitchVectorProperty *svp, IS_SWITCHF *fp);
+extern void IURegText (ITextVectorProperty *tvp, IS_TEXTF *fp);
+extern void IURegBLOB (IBLOBVectorProperty *bvp, IS_BLOBF *fp);
+
 /* functions to help process a snooped message from ISSnoopDevice */
 
 extern int IUSnoopNumber (XMLEle *root, INumberVectorProperty *nvp);
@@ -46,16 +46,113 @@
 /* The first time a new FILE is encountered by any of the ID*() functions,
  *   it is associated with its own mutex behind which all subsequent
  *   output is marshalled.
- * N.B. use an array of pointers to mutexes, not an array of mutexes,
+ * The FILEMutexes form a list that is only ever prepended to, with a
+ *   compare-and-swap on its head, and never shrinks. So it may be searched
+ *   without any lock, and threads writing to different FILEs never contend.
+ *   Each thread also remembers the last one it used, which is almost always
+ *   the one it wants next.
+ * N.B. use a list of malloced FILEMutexes, not an array of mutexes,
  *   because it is not portable to assume mutexes can be moved in memory.
  */
-typedef struct {
+typedef struct _FILEMutex {
     FILE *fp;				/* a FILE pointer used to send messages */
     pthread_mutex_t m;			/* a mutex to linearize access to this FILE */
+    struct _FILEMutex *next;		/* next in list, never changes once added */
+
+    /* batching, all protected by m */
+    int batch;				/* IDFBatchBegin() nesting depth */
+    int flushms;			/* auto flush within this many ms, 0 off */
+    int dirty;				/* messages written but not yet flushed */
+    int flusher;			/* set once the flush thread is running */
+    pthread_cond_t flushc;		/* wakes the flush thread when dirty */
 } FILEMutex;
-static FILEMutex **filemutex;		/* malloced array or pointers to FILEMutex */
-static int nfilemutex;			/* n pointers in filemutex[] */
-static pthread_rwlock_t filem_rw;	/* protect filemutex[] access itself */
+static FILEMutex *filemutex;		/* head of list, only changed with CAS */
+static __thread FILEMutex *lastfmp;	/* FILEMutex this thread used last */
+
+/* The first set message for each Text, Number, Switch or Light vector
+ *   renders all the text that never changes into a SetTmpl. Each set then need
+ *   only copy that and fill in the state, timeout, timestamp, message and
+ *   values, all in one buffer sent with one fwrite. A template is rebuilt
+ *   after each def of its vector and whenever the device, property or element
+ *   names are found to differ, so the bytes sent are always exactly as before.
+ * The SetTmpl also holds what was last sent for vectors in delta mode, see
+ *   IDDeltaNumber().
+ * The hash buckets are only ever prepended to, with a compare-and-swap as
+ *   for filemutex, so templates are found without any lock. Each has its
+ *   own mutex m, held only to check or rebuild it and to update its delta
+ *   state, so threads setting different vectors never contend. The text
+ *   itself is a SetText that never changes once built, so each thread takes
+ *   a reference to it and renders into its own setmsg without any lock. A
+ *   rebuild makes a new SetText and the old one is freed by whoever drops
+ *   the last reference.
+ */
+typedef struct {
+    const void *ep;			/* element array when built */
+    int ne;				/* n elements when built */
+    int etagl;				/* strlen of element tag */
+    char *txt;				/* all constant text, malloced */
+    int *off;				/* ne+4 offsets to the pieces in txt */
+    int refs;				/* template's own plus each renderer's */
+} SetText;
+typedef struct _SetTmpl {
+    const void *vp;			/* vector property, the lookup key */
+    pthread_mutex_t m;			/* guards all that follows but next */
+    SetText *st;			/* its current text */
+    int stale;				/* set to rebuild st before next use */
+    struct _SetTmpl *next;		/* next in same bucket, never changes */
+
+    /* delta mode */
+    int delta;				/* set when in delta mode */
+    int refreshms;			/* send all at least this often, 0 never */
+    int full;				/* set to send all next time */
+    double lastfull;			/* monotonic ms when all were last sent */
+    IPState lasts;			/* state last sent */
+    double lastto;			/* timeout last sent */
+    int nlast;				/* n entries in each of the following */
+    double *lastv;			/* Number value or ISState/IPState last sent */
+    char **lastt;			/* Text last sent, malloced */
+    double *deadband;			/* Number change that counts, default 0 */
+    char *pick;				/* whether to send each element this time */
+} SetTmpl;
+#define	NSETTMPL	256		/* n hash buckets, power of 2 */
+static SetTmpl *settmpl[NSETTMPL];	/* hash of templates by vp */
+static __thread char *setmsg;		/* per-thread message buffer */
+static __thread int setmsgm;		/* bytes malloced in setmsg */
+static __thread int setmsgl;		/* bytes used in setmsg */
+static __thread SetText *settxt;	/* text of the message in setmsg */
+static __thread int setdelta;		/* set if sending only setpick[] */
+static __thread char *setpick;		/* copy of pick[] for this message */
+static __thread int setpickm;		/* bytes malloced in setpick */
+
+/* newBLOBVector elements are decoded into these grow-only buffers, one per
+ *   element position, so a steady stream of uploads needs no new allocation.
+ *   IUCrackBLOB() trades a buffer with the IBLOB it fills instead of copying,
+ *   and the IBLOB's previous blob becomes that buffer in its place.
+ */
+static char **blobbuf;			/* malloced decode buffers */
+static int *blobbufm;			/* bytes malloced in each blobbuf[] */
+static int nblobbuf;			/* n entries in blobbuf[] and blobbufm[] */
+
+/* vectors registered with IUReg*() are found by dispatch() in a hash of their
+ *   device and property names, and each keeps a hash of its element names so
+ *   its handler gets the index of each element without any strcmp search.
+ *   An element map is rebuilt whenever its vector's element array changes,
+ *   or when a name it misses turns out to be an element renamed in place.
+ */
+typedef enum {REG_NUMBER, REG_SWITCH, REG_TEXT, REG_BLOB} RegType;
+typedef struct _Reg {
+    RegType type;			/* kind of vector */
+    void *vp;				/* the vector property */
+    void *fp;				/* its handler */
+    unsigned hash;			/* regHash() of its device and name */
+    struct _Reg *next;			/* next in same hash bucket */
+    const void *ep;			/* element array when map was built */
+    int ne;				/* n elements when map was built */
+    int mapmask;			/* n entries in map[] - 1, power of 2 - 1 */
+    int *map;				/* malloced element index, or -1, by hash */
+} Reg;
+#define	NREG		256		/* n hash buckets, power of 2 */
+static Reg *regs[NREG];			/* hash of registered vectors */
 
 
 /* local functions */
@@ -71,10 +168,50 @@ static const char *permStr(IPerm p);
 static void timestamp (char buf[], size_t buf_size);
 static void vsmessage (FILE *fp, const char *fmt, va_list ap);
 static int sexagesimal (const char *str0, double *dp);
+static int sexaGeneral (const char *str0, double *dp);
+static int decimal (const char *str, double *dp);
 static void xmlv1(FILE *fp);
-static void fmutexInit (void);
+static FILEMutex *fmutexFind (FILE *fp);
 static void fmutexLock (FILE *fp);
 static void fmutexUnlock (FILE *fp);
+static void fmutexFlush (FILE *fp);
+static void *flushThread (void *arg);
+static SetTmpl *setBegin (const void *vp, const char *vtag, const char *etag,
+    const char *dev, const char *name, const char *ename, size_t esize, int ne);
+static void setHead (SetTmpl *tp, IPState s, const double *timeout,
+    const char *fmt, va_list ap);
+static int setPicked (int i);
+static void setElement (int i, const char *val, int vall);
+static unsigned regHash (const char *dev, const char *name);
+static void regAdd (RegType type, void *vp, const char *dev, const char *name,
+    void *fp);
+static Reg *regFind (RegType type, const char *dev, const char *name);
+static void regElements (Reg *rp, const void **epp, const char **enamep,
+    size_t *esizep, int *nep);
+static int *regIndex (Reg *rp, char *names[], int n);
+static void regMap (Reg *rp, const void *ep, const char *ename, size_t esize,
+    int ne);
+static void setEnd (FILE *fp);
+static void setAbort (SetTmpl *tp);
+static void setDrop (const void *vp);
+static int deltaBegin (SetTmpl *tp, IPState s, const double *timeout,
+    const char *fmt);
+static int deltaEnd (SetTmpl *tp, int full);
+static void deltaSize (SetTmpl *tp, int ne);
+static void deltaMode (SetTmpl *tp, int refreshms);
+static double monoms (void);
+static SetTmpl *setLookup (const void *vp, int add);
+static void setFind (SetTmpl *tp, const char *vtag, const char *etag,
+    const char *dev, const char *name, const char *ename, size_t esize, int ne);
+static int setMatch (SetTmpl *tp, const void *ep, const char *dev,
+    const char *name, const char *ename, size_t esize, int ne);
+static void setBuild (SetTmpl *tp, const char *vtag, const char *etag,
+    const char *dev, const char *name, const char *ename, size_t esize, int ne);
+static void setRelease (SetText *st);
+static void setAdd (const char *str, int l);
+static void setAddEnt (const char *str);
+static int fmtG20 (char buf[], double v);
+static int fmtG (char buf[], double v);
 
 
 
@@ -91,6 +228,8 @@ _IDFDefText (FILE *fp, const ITextVectorProperty *tvp, const char *fmt, va_list
 	char ts[64];
 	int i;
 
+	setDrop (tvp);
+
 	fmutexLock (fp);
 
 	timestamp (ts, sizeof(ts));
@@ -113,13 +252,16 @@ _IDFDefText (FILE *fp, const ITextVectorProperty *tvp, const char *fmt, va_list
 	    IText *tp = &tvp->tp[i];
 	    fprintf (fp, "  <defText\n");
 	    fprintf (fp, "    name='%s'\n", tp->name);
-	    fprintf (fp, "    label='%s'>\n", entityXML(tp->label));
-	    fprintf (fp, "      %s\n", tp->text ? entityXML(tp->text) : "");
-	    fprintf (fp, "  </defText>\n");
+	    fprintf (fp, "    label='");
+	    fprEntityXML (fp, tp->label);
+	    fprintf (fp, "'>\n      ");
+	    if (tp->text)
+		fprEntityXML (fp, tp->text);
+	    fprintf (fp, "\n  </defText>\n");
 	}
 
 	fprintf (fp, "</defTextVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -151,6 +293,8 @@ _IDFDefNumber (FILE *fp, const INumberVectorProperty *nvp, const char *fmt, va_l
 	char ts[64];
 	int i;
 
+	setDrop (nvp);
+
 	fmutexLock (fp);
 
 	timestamp (ts, sizeof(ts));
@@ -183,7 +327,7 @@ _IDFDefNumber (FILE *fp, const INumberVectorProperty *nvp, const char *fmt, va_l
 	}
 
 	fprintf (fp, "</defNumberVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -213,6 +357,8 @@ _IDFDefSwitch (FILE *fp, const ISwitchVectorProperty *svp, const char *fmt, va_l
 	char ts[64];
 	int i;
 
+	setDrop (svp);
+
 	fmutexLock (fp);
 
 	timestamp (ts, sizeof(ts));
@@ -242,7 +388,7 @@ _IDFDefSwitch (FILE *fp, const ISwitchVectorProperty *svp, const char *fmt, va_l
 	}
 
 	fprintf (fp, "</defSwitchVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -272,6 +418,8 @@ _IDFDefLight (FILE *fp, const ILightVectorProperty *lvp, const char *fmt, va_lis
 	char ts[64];
 	int i;
 
+	setDrop (lvp);
+
 	fmutexLock (fp);
 
 	timestamp (ts, sizeof(ts));
@@ -298,7 +446,7 @@ _IDFDefLight (FILE *fp, const ILightVectorProperty *lvp, const char *fmt, va_lis
 	}
 
 	fprintf (fp, "</defLightVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -355,7 +503,7 @@ _IDFDefBLOB (FILE *fp, const IBLOBVectorProperty *bvp, const char *fmt, va_list
 	}
 
 	fprintf (fp, "</defBLOBVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -383,35 +531,34 @@ IDDefBLOB (const IBLOBVectorProperty *nvp, const char *fmt, ...)
 static void
 _IDFSetText (FILE *fp, const ITextVectorProperty *tvp, const char *fmt, va_list ap)
 {
-	char ts[64];
-	int i;
-
-	fmutexLock (fp);
-
-	timestamp (ts, sizeof(ts));
+	SetTmpl *tp;
+	int i, full;
 
-	xmlv1(fp);
-	fprintf (fp, "<setTextVector\n");
-	fprintf (fp, "  device='%s'\n", tvp->device);
-	fprintf (fp, "  name='%s'\n", tvp->name);
-	fprintf (fp, "  state='%s'\n", pstateStr(tvp->s));
-	fprintf (fp, "  timeout='%g'\n", tvp->timeout);
-	fprintf (fp, "  timestamp='%s'\n", ts);
-	if (fmt)
-	    vsmessage (fp, fmt, ap);
-	fprintf (fp, ">\n");
+	tp = setBegin (tvp, "setTextVector", "oneText", tvp->device, tvp->name,
+			tvp->tp ? tvp->tp->name : NULL, sizeof(IText), tvp->ntp);
 
-	for (i = 0; i < tvp->ntp; i++) {
-	    IText *tp = &tvp->tp[i];
-	    fprintf (fp, "  <oneText name='%s'>\n", tp->name);
-	    fprintf (fp, "      %s\n", tp->text ? entityXML(tp->text) : "");
-	    fprintf (fp, "  </oneText>\n");
+	if (tp->delta) {
+	    full = deltaBegin (tp, tvp->s, &tvp->timeout, fmt);
+	    for (i = 0; i < tvp->ntp; i++) {
+		const char *t = tvp->tp[i].text ? tvp->tp[i].text : "";
+		tp->pick[i] = full || strcmp (t, tp->lastt[i]);
+		if (tp->pick[i]) {
+		    free (tp->lastt[i]);
+		    tp->lastt[i] = strdup (t);
+		}
+	    }
+	    if (!deltaEnd (tp, full)) {
+		setAbort (tp);
+		return;
+	    }
 	}
 
-	fprintf (fp, "</setTextVector>\n");
-	fflush (fp);
+	setHead (tp, tvp->s, &tvp->timeout, fmt, ap);
+	for (i = 0; i < tvp->ntp; i++)
+	    if (setPicked (i))
+		setElement (i, tvp->tp[i].text, -1);
 
-	fmutexUnlock (fp);
+	setEnd (fp);
 }
 
 void
@@ -436,35 +583,34 @@ IDSetText (const ITextVectorProperty *tvp, const char *fmt, ...)
 static void
 _IDFSetNumber (FILE *fp, const INumberVectorProperty *nvp, const char *fmt, va_list ap)
 {
-	char ts[64];
-	int i;
-
-	fmutexLock (fp);
-
-	timestamp (ts, sizeof(ts));
-
-	xmlv1(fp);
-	fprintf (fp, "<setNumberVector\n");
-	fprintf (fp, "  device='%s'\n", nvp->device);
-	fprintf (fp, "  name='%s'\n", nvp->name);
-	fprintf (fp, "  state='%s'\n", pstateStr(nvp->s));
-	fprintf (fp, "  timeout='%g'\n", nvp->timeout);
-	fprintf (fp, "  timestamp='%s'\n", ts);
-	if (fmt)
-	    vsmessage (fp, fmt, ap);
-	fprintf (fp, ">\n");
-
-	for (i = 0; i < nvp->nnp; i++) {
-	    INumber *np = &nvp->np[i];
-	    fprintf (fp, "  <oneNumber name='%s'>\n", np->name);
-	    fprintf (fp, "      %.20g\n", np->value);
-	    fprintf (fp, "  </oneNumber>\n");
+	SetTmpl *tp;
+	char v[64];
+	int i, full;
+
+	tp = setBegin (nvp, "setNumberVector", "oneNumber", nvp->device,
+			nvp->name, nvp->np ? nvp->np->name : NULL, sizeof(INumber),
+			nvp->nnp);
+
+	if (tp->delta) {
+	    full = deltaBegin (tp, nvp->s, &nvp->timeout, fmt);
+	    for (i = 0; i < nvp->nnp; i++) {
+		double d = nvp->np[i].value - tp->lastv[i];
+		tp->pick[i] = full || !((d < 0 ? -d : d) <= tp->deadband[i]);
+		if (tp->pick[i])
+		    tp->lastv[i] = nvp->np[i].value;
+	    }
+	    if (!deltaEnd (tp, full)) {
+		setAbort (tp);
+		return;
+	    }
 	}
 
-	fprintf (fp, "</setNumberVector>\n");
-	fflush (fp);
+	setHead (tp, nvp->s, &nvp->timeout, fmt, ap);
+	for (i = 0; i < nvp->nnp; i++)
+	    if (setPicked (i))
+		setElement (i, v, fmtG20 (v, nvp->np[i].value));
 
-	fmutexUnlock (fp);
+	setEnd (fp);
 }
 
 void
@@ -489,35 +635,34 @@ IDSetNumber (const INumberVectorProperty *nvp, const char *fmt, ...)
 static void
 _IDFSetSwitch (FILE *fp, const ISwitchVectorProperty *svp, const char *fmt, va_list ap)
 {
-	char ts[64];
-	int i;
+	SetTmpl *tp;
+	int i, full;
 
-	fmutexLock (fp);
+	tp = setBegin (svp, "setSwitchVector", "oneSwitch", svp->device,
+			svp->name, svp->sp ? svp->sp->name : NULL, sizeof(ISwitch),
+			svp->nsp);
 
-	timestamp (ts, sizeof(ts));
-
-	xmlv1(fp);
-	fprintf (fp, "<setSwitchVector\n");
-	fprintf (fp, "  device='%s'\n", svp->device);
-	fprintf (fp, "  name='%s'\n", svp->name);
-	fprintf (fp, "  state='%s'\n", pstateStr(svp->s));
-	fprintf (fp, "  timeout='%g'\n", svp->timeout);
-	fprintf (fp, "  timestamp='%s'\n", ts);
-	if (fmt)
-	    vsmessage (fp, fmt, ap);
-	fprintf (fp, ">\n");
+	if (tp->delta) {
+	    full = deltaBegin (tp, svp->s, &svp->timeout, fmt);
+	    for (i = 0; i < svp->nsp; i++) {
+		tp->pick[i] = full || svp->sp[i].s != tp->lastv[i];
+		tp->lastv[i] = svp->sp[i].s;
+	    }
+	    if (!deltaEnd (tp, full)) {
+		setAbort (tp);
+		return;
+	    }
+	}
 
+	setHead (tp, svp->s, &svp->timeout, fmt, ap);
 	for (i = 0; i < svp->nsp; i++) {
-	    ISwitch *sp = &svp->sp[i];
-	    fprintf (fp, "  <oneSwitch name='%s'>\n", sp->name);
-	    fprintf (fp, "      %s\n", sstateStr(sp->s));
-	    fprintf (fp, "  </oneSwitch>\n");
+	    if (setPicked (i)) {
+		const char *v = sstateStr(svp->sp[i].s);
+		setElement (i, v, strlen(v));
+	    }
 	}
 
-	fprintf (fp, "</setSwitchVector>\n");
-	fflush (fp);
-
-	fmutexUnlock (fp);
+	setEnd (fp);
 }
 
 void
@@ -543,34 +688,35 @@ IDSetSwitch (const ISwitchVectorProperty *svp, const char *fmt, ...)
 static void
 _IDFSetLight (FILE *fp, const ILightVectorProperty *lvp, const char *fmt, va_list ap)
 {
-	char ts[64];
-	int i;
-
-	fmutexLock (fp);
+	SetTmpl *tp;
+	int i, full;
 
-	timestamp (ts, sizeof(ts));
+	tp = setBegin (lvp, "setLightVector", "oneLight", lvp->device,
+			lvp->name, lvp->lp ? lvp->lp->name : NULL, sizeof(ILight),
+			lvp->nlp);
 
-	xmlv1(fp);
-	fprintf (fp, "<setLightVector\n");
-	fprintf (fp, "  device='%s'\n", lvp->device);
-	fprintf (fp, "  name='%s'\n", lvp->name);
-	fprintf (fp, "  state='%s'\n", pstateStr(lvp->s));
-	fprintf (fp, "  timestamp='%s'\n", ts);
-	if (fmt)
-	    vsmessage (fp, fmt, ap);
-	fprintf (fp, ">\n");
+	/* lights have no timeout */
+	if (tp->delta) {
+	    full = deltaBegin (tp, lvp->s, NULL, fmt);
+	    for (i = 0; i < lvp->nlp; i++) {
+		tp->pick[i] = full || lvp->lp[i].s != tp->lastv[i];
+		tp->lastv[i] = lvp->lp[i].s;
+	    }
+	    if (!deltaEnd (tp, full)) {
+		setAbort (tp);
+		return;
+	    }
+	}
 
+	setHead (tp, lvp->s, NULL, fmt, ap);
 	for (i = 0; i < lvp->nlp; i++) {
-	    ILight *lp = &lvp->lp[i];
-	    fprintf (fp, "  <oneLight name='%s'>\n", lp->name);
-	    fprintf (fp, "      %s\n", pstateStr(lp->s));
-	    fprintf (fp, "  </oneLight>\n");
+	    if (setPicked (i)) {
+		const char *v = pstateStr(lvp->lp[i].s);
+		setElement (i, v, strlen(v));
+	    }
 	}
 
-	fprintf (fp, "</setLightVector>\n");
-	fflush (fp);
-
-	fmutexUnlock (fp);
+	setEnd (fp);
 }
 
 void
@@ -591,6 +737,64 @@ IDSetLight (const ILightVectorProperty *lvp, const char *fmt, ...)
 	va_end (ap);
 }
 
+/* put a vector property in delta mode, or take it out if refreshms < 0 */
+
+void
+IDDeltaText (const ITextVectorProperty *tvp, int refreshms)
+{
+	SetTmpl *tp = setBegin (tvp, "setTextVector", "oneText", tvp->device,
+		    tvp->name, tvp->tp ? tvp->tp->name : NULL, sizeof(IText),
+		    tvp->ntp);
+	deltaMode (tp, refreshms);
+	setAbort (tp);
+}
+
+void
+IDDeltaNumber (const INumberVectorProperty *nvp, int refreshms)
+{
+	SetTmpl *tp = setBegin (nvp, "setNumberVector", "oneNumber", nvp->device,
+		    nvp->name, nvp->np ? nvp->np->name : NULL, sizeof(INumber),
+		    nvp->nnp);
+	deltaMode (tp, refreshms);
+	setAbort (tp);
+}
+
+void
+IDDeltaSwitch (const ISwitchVectorProperty *svp, int refreshms)
+{
+	SetTmpl *tp = setBegin (svp, "setSwitchVector", "oneSwitch", svp->device,
+		    svp->name, svp->sp ? svp->sp->name : NULL, sizeof(ISwitch),
+		    svp->nsp);
+	deltaMode (tp, refreshms);
+	setAbort (tp);
+}
+
+void
+IDDeltaLight (const ILightVectorProperty *lvp, int refreshms)
+{
+	SetTmpl *tp = setBegin (lvp, "setLightVector", "oneLight", lvp->device,
+		    lvp->name, lvp->lp ? lvp->lp->name : NULL, sizeof(ILight),
+		    lvp->nlp);
+	deltaMode (tp, refreshms);
+	setAbort (tp);
+}
+
+/* set the smallest change in the named Number that is sent in delta mode */
+void
+IDDeadband (const INumberVectorProperty *nvp, const char *name, double deadband)
+{
+	INumber *np = IUFindNumber (nvp, name);
+	SetTmpl *tp;
+
+	if (!np)
+	    return;
+
+	tp = setBegin (nvp, "setNumberVector", "oneNumber", nvp->device,
+		    nvp->name, nvp->np->name, sizeof(INumber), nvp->nnp);
+	tp->deadband[np - nvp->np] = deadband;
+	setAbort (tp);
+}
+
 /* tell client to update an existing BLOB vector property */
 static void
 _IDFSetBLOB (FILE *fp, const IBLOBVectorProperty *bvp, const char *fmt, va_list ap)
@@ -615,30 +819,23 @@ _IDFSetBLOB (FILE *fp, const IBLOBVectorProperty *bvp, const char *fmt, va_list
 
 	for (i = 0; i < bvp->nbp; i++) {
 	    IBLOB *bp = &bvp->bp[i];
-	    unsigned char *encblob;
-	    int l;
+	    B64Enc enc;
 
 	    fprintf (fp, "  <oneBLOB\n");
 	    fprintf (fp, "    name='%s'\n", bp->name);
 	    fprintf (fp, "    size='%d'\n", bp->size);
 	    fprintf (fp, "    format='%s'>\n", bp->format);
 
-	    encblob = (unsigned char *) malloc (4*bp->bloblen/3+4);
-	    l = to64frombits(encblob, (const unsigned char *)bp->blob, bp->bloblen);
-
-	    /* pretty but about 2x slower
-	    for (j = 0; j < l; j += 72)
-		fprintf (fp, "%.72s\n", encblob+j);
-	    */
-	    fwrite (encblob, 1, l, fp);
-
-	    free (encblob);
+	    /* encode straight into fp, no copy of the whole blob */
+	    b64EncInit (&enc);
+	    b64EncWrite (&enc, fp, -1, (const unsigned char *)bp->blob, bp->bloblen);
+	    b64EncWriteFinal (&enc, fp, -1);
 
 	    fprintf (fp, "  </oneBLOB>\n");
 	}
 
 	fprintf (fp, "</setBLOBVector>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -680,7 +877,7 @@ _IDFMessage (FILE *fp, const char *dev, const char *fmt, va_list ap)
 	if (fmt)
 	    vsmessage (fp, fmt, ap);
 	fprintf (fp, "/>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -723,7 +920,7 @@ _IDFDelete (FILE *fp, const char *dev, const char *name, const char *fmt, va_lis
 	if (fmt)
 	    vsmessage (fp, fmt, ap);
 	fprintf (fp, "/>\n");
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -777,7 +974,7 @@ IDFSnoopDevice (FILE *fp, const char *snooped_device_name, const char *snooped_p
 				    INDIV, snooped_device_name, snooped_property_name);
 	else
 	    fprintf (fp, "<getProperties version='%g' device='%s'/>\n", INDIV, snooped_device_name);
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -808,7 +1005,7 @@ IDFSnoopBLOBs (FILE *fp, char *snooped_device_name, BLOBHandling bh)
 	xmlv1(fp);
 	fprintf (fp, "<enableBLOB device='%s'>%s</enableBLOB>\n",
 						snooped_device_name, how);
-	fflush (fp);
+	fmutexFlush (fp);
 
 	fmutexUnlock (fp);
 }
@@ -819,15 +1016,90 @@ IDSnoopBLOBs (char *snooped_device_name, BLOBHandling bh)
 	IDFSnoopBLOBs (stdout, snooped_device_name, bh);
 }
 
+/* hold back flushing fp until the matching IDFBatchEnd() so all messages sent
+ * meanwhile, from any thread, go out together. calls may be nested.
+ */
+void
+IDFBatchBegin (FILE *fp)
+{
+	FILEMutex *mp;
+
+	fmutexLock (fp);
+	mp = fmutexFind (fp);
+	mp->batch++;
+	fmutexUnlock (fp);
+}
+
+void
+IDBatchBegin (void)
+{
+	IDFBatchBegin (stdout);
+}
+
+/* end a batch begun with IDFBatchBegin(), flushing fp if it was the last */
+void
+IDFBatchEnd (FILE *fp)
+{
+	FILEMutex *mp;
+
+	fmutexLock (fp);
+	mp = fmutexFind (fp);
+	if (mp->batch > 0 && --mp->batch == 0 && mp->dirty) {
+	    fflush (fp);
+	    mp->dirty = 0;
+	}
+	fmutexUnlock (fp);
+}
+
+void
+IDBatchEnd (void)
+{
+	IDFBatchEnd (stdout);
+}
+
+/* flush fp no later than ms milliseconds after each message instead of at
+ * once, or at once again if ms is 0.
+ */
+void
+IDFAutoFlush (FILE *fp, int ms)
+{
+	FILEMutex *mp;
+	pthread_t tid;
+
+	fmutexLock (fp);
+	mp = fmutexFind (fp);
+	mp->flushms = ms > 0 ? ms : 0;
+	if (mp->flushms > 0 && !mp->flusher) {
+	    if (pthread_create (&tid, NULL, flushThread, mp) == 0) {
+		pthread_detach (tid);
+		mp->flusher = 1;
+	    } else
+		mp->flushms = 0;
+	}
+	if (mp->flushms == 0 && mp->batch == 0 && mp->dirty) {
+	    fflush (fp);
+	    mp->dirty = 0;
+	}
+	fmutexUnlock (fp);
+}
+
+void
+IDAutoFlush (int ms)
+{
+	IDFAutoFlush (stdout, ms);
+}
+
 /* print message to fp
- * N.B. can not vfprint directly, must go through entityXML()
+ * N.B. can not vfprint directly, must go through fprEntityXML()
  */
 static void
 vsmessage (FILE *fp, const char *fmt, va_list ap)
 {
 	char msg[1024];
 	vsnprintf (msg, sizeof(msg), fmt, ap);
-	fprintf (fp, "  message='%s'\n", entityXML(msg));
+	fprintf (fp, "  message='");
+	fprEntityXML (fp, msg);
+	fprintf (fp, "'\n");
 }
 
 /******************************************************
@@ -852,12 +1124,51 @@ IEAddTimer (int millisecs, IE_TCF *fp, void *p)
 	return (addTimer (millisecs, (TCF*)fp, p));
 }
 
+int
+IEAddTimerUs (long microsecs, IE_TCF *fp, void *p)
+{
+	return (addTimerUs (microsecs, (TCF*)fp, p));
+}
+
+int
+IEAddPeriodicTimer (long microsecs, IE_TCF *fp, void *p)
+{
+	return (addPeriodicTimer (microsecs, (TCF*)fp, p));
+}
+
+int
+IEGetTimerStats (int timerid, IETimerStats *sp)
+{
+	TimerStats ts;
+
+	if (getTimerStats (timerid, &ts) < 0)
+	    return (-1);
+	sp->ncalls = ts.ncalls;
+	sp->nmissed = ts.nmissed;
+	sp->meanlate = ts.meanlate;
+	sp->maxlate = ts.maxlate;
+	sp->jitter = ts.jitter;
+	return (0);
+}
+
 void
 IERmTimer (int timerid)
 {
 	rmTimer (timerid);
 }
 
+int
+IEAddJob (IE_JOBF *jobfp, IE_JOBF *donefp, void *p)
+{
+	return (addJob ((JOBF*)jobfp, (JOBF*)donefp, p));
+}
+
+void
+IEJobPool (int nthreads, int maxjobs)
+{
+	setJobPool (nthreads, maxjobs);
+}
+
 int
 IEAddWorkProc (IE_WPF *fp, void *p)
 {
@@ -1055,6 +1366,8 @@ IUResetSwitches(const ISwitchVectorProperty *svp)
 /* convenience function for use in your implementation of ISNewBLOB().
  * given a candidate BLOB and the args from ISNewBLOB, fill in the
  * elements and return 0 else return -1 if it's the wrong candidate or all elements not present.
+ * when blobs[j] is still one of our decode buffers bvp->bp[i].blob just takes
+ * it over and gives us its old blob to reuse, else the data are copied.
  * N.B. we set each bvp->bp[i].size but we neither enforce nor interpret format.
  */
 int
@@ -1069,8 +1382,15 @@ IUCrackBLOB (IBLOBVectorProperty *bvp, const char *dev, const char *name, int si
 	for (i = 0; i < bvp->nbp; i++) {
 	    for (j = 0; j < n; j++) {
 		if (!strcmp(bvp->bp[i].name, names[j])) {
-		    bvp->bp[i].blob = realloc (bvp->bp[i].blob, blobsizes[j]);
-                    memcpy (bvp->bp[i].blob, blobs[j], blobsizes[j]);
+		    if (j < nblobbuf && blobs[j] == blobbuf[j]) {
+			/* swap, leaving blobs[j] still valid */
+			blobbuf[j] = (char *) bvp->bp[i].blob;
+			blobbufm[j] = blobbuf[j] ? bvp->bp[i].bloblen : 0;
+			bvp->bp[i].blob = blobs[j];
+		    } else {
+			bvp->bp[i].blob = realloc (bvp->bp[i].blob, blobsizes[j]);
+			memcpy (bvp->bp[i].blob, blobs[j], blobsizes[j]);
+		    }
                     bvp->bp[i].bloblen = blobsizes[j];
                     bvp->bp[i].size = sizes[j];
                     bvp->bp[i].bvp = bvp;
@@ -1083,6 +1403,37 @@ IUCrackBLOB (IBLOBVectorProperty *bvp, const char *dev, const char *name, int si
 	return (0);
 }
 
+/* register nvp so newNumberVector messages for it call fp instead of
+ * ISNewNumber(), or go back to ISNewNumber() if fp is NULL.
+ * N.B. register again if its device or name are changed.
+ */
+void
+IURegNumber (INumberVectorProperty *nvp, IS_NUMBERF *fp)
+{
+	regAdd (REG_NUMBER, nvp, nvp->device, nvp->name, (void *)fp);
+}
+
+/* same as IURegNumber() for a switch vector and ISNewSwitch() */
+void
+IURegSwitch (ISwitchVectorProperty *svp, IS_SWITCHF *fp)
+{
+	regAdd (REG_SWITCH, svp, svp->device, svp->name, (void *)fp);
+}
+
+/* same as IURegNumber() for a text vector and ISNewText() */
+void
+IURegText (ITextVectorProperty *tvp, IS_TEXTF *fp)
+{
+	regAdd (REG_TEXT, tvp, tvp->device, tvp->name, (void *)fp);
+}
+
+/* same as IURegNumber() for a BLOB vector and ISNewBLOB() */
+void
+IURegBLOB (IBLOBVectorProperty *bvp, IS_BLOBF *fp)
+{
+	regAdd (REG_BLOB, bvp, bvp->device, bvp->name, (void *)fp);
+}
+
 /* use this to set the text value of an IText.
  * save malloced copy of resulting printf-style format in tp->text, reusing if not first time.
  * N.B. don't mix using this with setting tp->text directly!
@@ -1421,9 +1772,14 @@ dispatch (XMLEle *root, char msg[])
 	    }
 
 	    /* invoke driver if something to do, but not an error if not */
-	    if (n > 0)
-		ISNewNumber (dev, name, doubles, names, n);
-	    else
+	    if (n > 0) {
+		Reg *rp = regFind (REG_NUMBER, dev, name);
+		if (rp)
+		    (*(IS_NUMBERF *)rp->fp) ((INumberVectorProperty *)rp->vp,
+					doubles, names, regIndex (rp, names, n), n);
+		else
+		    ISNewNumber (dev, name, doubles, names, n);
+	    } else
 		IDLog("%s.%s: newNumberVector with no valid members\n",dev,name);
 	    return (0);
 	}
@@ -1472,9 +1828,14 @@ dispatch (XMLEle *root, char msg[])
 	    }
 
 	    /* invoke driver if something to do, but not an error if not */
-	    if (n > 0)
-		ISNewSwitch (dev, name, states, names, n);
-	    else
+	    if (n > 0) {
+		Reg *rp = regFind (REG_SWITCH, dev, name);
+		if (rp)
+		    (*(IS_SWITCHF *)rp->fp) ((ISwitchVectorProperty *)rp->vp,
+					states, names, regIndex (rp, names, n), n);
+		else
+		    ISNewSwitch (dev, name, states, names, n);
+	    } else
 		IDLog("%s.%s: newSwitchVector with no valid members\n", dev, name);
 	    return (0);
 	}
@@ -1513,9 +1874,14 @@ dispatch (XMLEle *root, char msg[])
 	    }
 
 	    /* invoke driver if something to do, but not an error if not */
-	    if (n > 0)
-		ISNewText (dev, name, texts, names, n);
-	    else
+	    if (n > 0) {
+		Reg *rp = regFind (REG_TEXT, dev, name);
+		if (rp)
+		    (*(IS_TEXTF *)rp->fp) ((ITextVectorProperty *)rp->vp,
+					texts, names, regIndex (rp, names, n), n);
+		else
+		    ISNewText (dev, name, texts, names, n);
+	    } else
 		IDLog ("%s.%s: newTextVector with no valid members\n",dev,name);
 	    return (0);
 	}
@@ -1528,7 +1894,6 @@ dispatch (XMLEle *root, char msg[])
 	    static int *sizes;
 	    static int maxn;
 	    char *dev, *name;
-	    int i;
 
 	    /* pull out device and name */
 	    if (crackDN (root, &dev, &name, msg) < 0)
@@ -1550,6 +1915,7 @@ dispatch (XMLEle *root, char msg[])
 		    char *fa = findXMLAttValu (ep, "format");
 		    char *sa = findXMLAttValu (ep, "size");
 		    if (*na && *fa && *sa) {
+			int need = 3*pcdatalenXMLEle(ep)/4 + 1;
 			if (n >= maxn) {
 			    int newsz = (maxn=n+1)*sizeof(char *);
 			    blobs = (char **) realloc (blobs, newsz);
@@ -1559,8 +1925,25 @@ dispatch (XMLEle *root, char msg[])
 			    sizes = (int *) realloc(sizes,newsz);
 			    blobsizes = (int *) realloc(blobsizes,newsz);
 			}
-			blobs[n] = (char *)malloc (3*pcdatalenXMLEle(ep)/4);
+			if (n >= nblobbuf) {
+			    blobbuf = (char **) realloc (blobbuf, (n+1)*sizeof(char *));
+			    blobbufm = (int *) realloc (blobbufm, (n+1)*sizeof(int));
+			    blobbuf[n] = NULL;
+			    blobbufm[n] = 0;
+			    nblobbuf = n+1;
+			}
+			if (blobbufm[n] < need) {
+			    /* grow, no need to keep old contents */
+			    free (blobbuf[n]);
+			    blobbuf[n] = (char *) malloc (need);
+			    blobbufm[n] = need;
+			}
+			blobs[n] = blobbuf[n];
 			blobsizes[n] = from64tobits(blobs[n], pcdataXMLEle(ep));
+			if (blobsizes[n] < 0) {
+			    IDLog ("%s.%s.%s: bad base64\n", dev, name, na);
+			    continue;
+			}
 			names[n] = na;
 			formats[n] = fa;
 			sizes[n] = atoi(sa);
@@ -1569,11 +1952,16 @@ dispatch (XMLEle *root, char msg[])
 		}
 	    }
 
-	    /* invoke driver if something to do, but not an error if not */
+	    /* invoke driver if something to do, but not an error if not.
+	     * the decode buffers are kept for next time.
+	     */
 	    if (n > 0) {
-		ISNewBLOB (dev, name, sizes, blobsizes, blobs, formats,names,n);
-		for (i = 0; i < n; i++)
-		    free (blobs[i]);
+		Reg *rp = regFind (REG_BLOB, dev, name);
+		if (rp)
+		    (*(IS_BLOBF *)rp->fp) ((IBLOBVectorProperty *)rp->vp, sizes,
+		    	blobsizes, blobs, formats, names, regIndex (rp, names, n), n);
+		else
+		    ISNewBLOB (dev, name, sizes, blobsizes, blobs, formats,names,n);
 	    } else
 		IDLog ("%s.%s: newBLOBVector with no valid members\n",dev,name);
 	    return (0);
@@ -1739,27 +2127,137 @@ permStr (IPerm p)
 static void
 timestamp (char ts[], size_t tsl)
 {
+	static __thread time_t lastt = -1;	/* whole seconds in lastts */
+	static __thread char lastts[32];
+	static __thread int lastn;
 	struct timeval tv;
-	struct tm *tp;
+	struct tm tm;
 	time_t t;
-	int n;
+	long ms;
 
 	gettimeofday (&tv, NULL);
 	t = (time_t) tv.tv_sec;
-	tp = gmtime (&t);
-	n = strftime (ts, tsl-5, "%Y-%m-%dT%H:%M:%S", tp);
-	sprintf (ts+n, ".%03ld", (long)tv.tv_usec/1000);
+	if (t != lastt) {
+	    gmtime_r (&t, &tm);
+	    lastn = strftime (lastts, sizeof(lastts), "%Y-%m-%dT%H:%M:%S", &tm);
+	    lastt = t;
+	}
+	if ((size_t)lastn + 5 > tsl) {
+	    ts[0] = '\0';
+	    return;
+	}
+	memcpy (ts, lastts, lastn);
+	ms = (long)tv.tv_usec/1000;
+	ts[lastn] = '.';
+	ts[lastn+1] = '0' + ms/100;
+	ts[lastn+2] = '0' + ms/10%10;
+	ts[lastn+3] = '0' + ms%10;
+	ts[lastn+4] = '\0';
 }
 
 /* convert sexagesimal string str AxBxC to double.
  *   x can be anything non-numeric. Any missing A, B or C will be assumed 0.
  *   optional - and + can be anywhere.
+ * plain decimal or scientific values, by far the common case, are cracked
+ *   directly by decimal(); everything else goes through sexaGeneral().
  * return 0 if ok, -1 if can't find a thing.
  */
 static int
 sexagesimal (
 const char *str0,	/* input string */
 double *dp)		/* cracked value, if return 0 */
+{
+	if (decimal (str0, dp) == 0)
+	    return (0);
+	return (sexaGeneral (str0, dp));
+}
+
+/* crack a plain [-+]digits[.digits][e[-+]digits] value, optionally
+ *   surrounded by whitespace, the way sexaGeneral() would.
+ * the result is exact, ie, correctly rounded, because the mantissa fits in
+ *   53 bits and the power of ten is itself exact, so there is just one
+ *   rounding in the final multiply or divide (Clinger's fast path). other
+ *   normal values go to strtod(), which is what sscanf uses anyway.
+ * return 0 if ok, -1 if str is not of this form, in which case the caller
+ *   should use the general path.
+ */
+static int
+decimal (
+const char *str,	/* input string */
+double *dp)		/* cracked value, if return 0 */
+{
+	static const double p10[] = {
+	    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	    1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	    1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *s = str;
+	unsigned long long m = 0;
+	int nd = 0, ndig = 0, e10 = 0, isneg = 0;
+	double v;
+
+	while (isspace(*s))
+	    s++;
+	if (*s == '-' || *s == '+')
+	    isneg = *s++ == '-';
+
+	/* mantissa, counting only significant digits */
+	for (; isdigit(*s); s++, ndig++)
+	    if ((m || *s != '0') && ++nd <= 19)
+		m = m*10 + (*s - '0');
+	if (*s == '.')
+	    for (s++; isdigit(*s); s++, ndig++, e10--)
+		if ((m || *s != '0') && ++nd <= 19)
+		    m = m*10 + (*s - '0');
+	if (ndig == 0)
+	    return (-1);
+
+	/* optional exponent, which must have digits */
+	if (*s == 'e' || *s == 'E') {
+	    int eneg, e = 0;
+
+	    s++;
+	    eneg = *s == '-';
+	    if (*s == '-' || *s == '+')
+		s++;
+	    if (!isdigit(*s))
+		return (-1);
+	    for (; isdigit(*s); s++)
+		if (e < 1000)
+		    e = e*10 + (*s - '0');
+	    e10 += eneg ? -e : e;
+	}
+
+	/* nothing but whitespace may follow.
+	 * sexaGeneral() only looks at the first 255 chars so leave long
+	 *   strings to it too.
+	 */
+	while (isspace(*s))
+	    s++;
+	if (*s || s - str > 255)
+	    return (-1);
+
+	if (m == 0)
+	    v = 0.0;
+	else if (nd <= 19 && m <= (1ULL << 53) && e10 >= -22 && e10 <= 22)
+	    v = e10 < 0 ? (double)m / p10[-e10] : (double)m * p10[e10];
+	else if (e10 >= -300 && e10 <= 280) {
+	    *dp = strtod (str, NULL);
+	    return (0);
+	} else
+	    return (-1);	/* let sexaGeneral() overflow or flush the same */
+
+	*dp = isneg ? -v : v;
+	return (0);
+}
+
+/* convert sexagesimal string str AxBxC to double using sscanf.
+ *   this is the general form of sexagesimal(), see there.
+ */
+static int
+sexaGeneral (
+const char *str0,	/* input string */
+double *dp)		/* cracked value, if return 0 */
 {
 	double a, b, c;
 	char str[256];
@@ -1808,14 +2306,48 @@ xmlv1(FILE *fp)
 /* family of functions to manage the mutexes */
 
 
-/* initialize the FILEMutex system */
-static void
-fmutexInit(void)
-{
-	if (!filemutex) {
-	    filemutex = (FILEMutex **) malloc (1);		/* realloc seed and initted flag */
-	    pthread_rwlock_init (&filem_rw, NULL);
+/* find the FILEMutex for fp, adding one if it is new.
+ * no lock is needed because the list is only ever prepended to.
+ */
+static FILEMutex *
+fmutexFind (FILE *fp)
+{
+	FILEMutex *head, *mp, *stop, *newmp;
+
+	/* usually the same as last time for this thread */
+	mp = lastfmp;
+	if (mp && mp->fp == fp)
+	    return (mp);
+
+	/* search the whole list */
+	head = __atomic_load_n (&filemutex, __ATOMIC_ACQUIRE);
+	for (mp = head; mp; mp = mp->next)
+	    if (mp->fp == fp)
+		return (lastfmp = mp);
+
+	/* not found, so prepend a new one unless another thread beats us to it */
+	newmp = (FILEMutex *) malloc (sizeof(FILEMutex));
+	memset (newmp, 0, sizeof(FILEMutex));
+	newmp->fp = fp;
+	pthread_mutex_init (&newmp->m, NULL);
+	pthread_cond_init (&newmp->flushc, NULL);
+	newmp->next = head;
+	while (!__atomic_compare_exchange_n (&filemutex, &newmp->next, newmp, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    /* list grew meanwhile, check just those added since we looked */
+	    stop = head;
+	    head = newmp->next;
+	    for (mp = head; mp != stop; mp = mp->next) {
+		if (mp->fp == fp) {
+		    pthread_cond_destroy (&newmp->flushc);
+		    pthread_mutex_destroy (&newmp->m);
+		    free (newmp);
+		    return (lastfmp = mp);
+		}
+	    }
 	}
+
+	return (lastfmp = newmp);
 }
 
 /* lock a given FILE *
@@ -1823,60 +2355,987 @@ fmutexInit(void)
 static void
 fmutexLock (FILE *fp)
 {
-	FILEMutex *mp = NULL;
-	pthread_mutex_t *lp;
-	int i;
+	pthread_mutex_lock (&fmutexFind(fp)->m);
+}
+
+/* unlock a given FILE *
+ */
+static void
+fmutexUnlock (FILE *fp)
+{
+	pthread_mutex_unlock (&fmutexFind(fp)->m);
+}
 
-	/* init first time only */
-	fmutexInit();
+/* flush fp after a message has been written to it, or leave that for later
+ *   if it is inside a batch or set to auto flush.
+ * N.B. fp must be locked.
+ */
+static void
+fmutexFlush (FILE *fp)
+{
+	FILEMutex *mp = fmutexFind (fp);
 
-	/* write-lock access to the list in case we need to add fp */
-	pthread_rwlock_wrlock (&filem_rw);
+	if (mp->batch > 0)
+	    mp->dirty = 1;
+	else if (mp->flushms > 0) {
+	    if (!mp->dirty) {
+		mp->dirty = 1;
+		pthread_cond_signal (&mp->flushc);
+	    }
+	} else
+	    fflush (fp);
+}
 
-	/* find lock for fp, add to list if new */
-	for (i = 0; i < nfilemutex; i++) {
-	    if (filemutex[i]->fp == fp) {
-		mp = filemutex[i];
-		break;
+/* thread that flushes one auto flush FILE within flushms of it becoming dirty.
+ * it never exits, it just waits while auto flush is off.
+ */
+static void *
+flushThread (void *arg)
+{
+	FILEMutex *mp = (FILEMutex *) arg;
+	struct timespec ts;
+
+	pthread_mutex_lock (&mp->m);
+	for (;;) {
+	    while (!mp->dirty || mp->batch > 0 || mp->flushms <= 0)
+		pthread_cond_wait (&mp->flushc, &mp->m);
+
+	    /* let more messages collect without holding up their writers */
+	    ts.tv_sec = mp->flushms/1000;
+	    ts.tv_nsec = (mp->flushms%1000)*1000000L;
+	    pthread_mutex_unlock (&mp->m);
+	    nanosleep (&ts, NULL);
+	    pthread_mutex_lock (&mp->m);
+
+	    if (mp->dirty && mp->batch == 0) {
+		fflush (mp->fp);
+		mp->dirty = 0;
 	    }
 	}
-	if (!mp) {
-	    filemutex = (FILEMutex **) realloc (filemutex, (nfilemutex+1)*sizeof(FILEMutex*));
-	    filemutex[nfilemutex++] = mp = (FILEMutex *) malloc (sizeof(FILEMutex));
-	    mp->fp = fp;
-	    pthread_mutex_init (&mp->m, NULL);
+
+	return (NULL);
+}
+
+/* find, or first build, the template for vector property vp.
+ * vtag and etag are the vector and element tags, dev and name its device and
+ *   property names. the ne element names are esize bytes apart from ename.
+ * N.B. holds tp->m until setHead() or setAbort(), so caller should only
+ *   update tp's delta state meanwhile.
+ */
+static SetTmpl *
+setBegin (const void *vp, const char *vtag, const char *etag, const char *dev,
+const char *name, const char *ename, size_t esize, int ne)
+{
+	SetTmpl *tp = setLookup (vp, 1);
+
+	pthread_mutex_lock (&tp->m);
+	setFind (tp, vtag, etag, dev, name, ename, esize, ne);
+	return (tp);
+}
+
+/* start a set message from tp in this thread's setmsg, through the closing >
+ *   of its opening tag.
+ * first take a reference to tp's text and a copy of its picks, then release
+ *   tp->m so all the rendering is done without it.
+ * timeout NULL means leave it out.
+ */
+static void
+setHead (SetTmpl *tp, IPState s, const double *timeout, const char *fmt,
+va_list ap)
+{
+	char ts[64];
+	char v[64];
+
+	settxt = tp->st;
+	__atomic_add_fetch (&settxt->refs, 1, __ATOMIC_RELAXED);
+	setdelta = tp->delta;
+	if (setdelta) {
+	    if (settxt->ne > setpickm) {
+		setpickm = settxt->ne;
+		setpick = (char *) realloc (setpick, setpickm);
+	    }
+	    memcpy (setpick, tp->pick, settxt->ne);
+	}
+	pthread_mutex_unlock (&tp->m);
+
+	setmsgl = 0;
+	setAdd (settxt->txt, settxt->off[1]);
+	setAdd (pstateStr(s), -1);
+	setAdd ("'\n", 2);
+	if (timeout) {
+	    setAdd ("  timeout='", 11);
+	    setAdd (v, fmtG (v, *timeout));
+	    setAdd ("'\n", 2);
+	}
+	timestamp (ts, sizeof(ts));
+	setAdd ("  timestamp='", 13);
+	setAdd (ts, -1);
+	setAdd ("'\n", 2);
+	if (fmt) {
+	    char msg[1024];
+	    char ent[6*sizeof(msg)];
+	    vsnprintf (msg, sizeof(msg), fmt, ap);
+	    setAdd ("  message='", 11);
+	    setAdd (entityXMLr (msg, ent, sizeof(ent)), -1);
+	    setAdd ("'\n", 2);
 	}
-	lp = &mp->m;
+	setAdd (">\n", 2);
+}
+
+/* return whether element i is to be in the message begun with setHead() */
+static int
+setPicked (int i)
+{
+	return (!setdelta || setpick[i]);
+}
 
-	/* unlock list, lp will always be stable now */
-	pthread_rwlock_unlock (&filem_rw);
+/* add element i with the given value text to the message in setmsg.
+ * if vall < 0 val is escaped as needed for xml, and may be NULL.
+ */
+static void
+setElement (int i, const char *val, int vall)
+{
+	const char *txt = settxt->txt;
+	const int *off = settxt->off;
+	int ne = settxt->ne;
 
-	/* lock mutex associated with fp */
-	pthread_mutex_lock (lp);
+	setAdd (txt + off[i+1], off[i+2] - off[i+1]);
+	if (vall >= 0)
+	    setAdd (val, vall);
+	else if (val)
+	    setAddEnt (val);
+	setAdd (txt + off[ne+1], off[ne+2] - off[ne+1]);
 }
 
-/* unlock a given FILE *
+/* finish the message in setmsg and send it to fp in one write */
+static void
+setEnd (FILE *fp)
+{
+	const int *off = settxt->off;
+	int ne = settxt->ne;
+
+	setAdd (settxt->txt + off[ne+2], off[ne+3] - off[ne+2]);
+	setRelease (settxt);
+	settxt = NULL;
+
+	fmutexLock (fp);
+	xmlv1(fp);
+	fwrite (setmsg, 1, setmsgl, fp);
+	fmutexFlush (fp);
+	fmutexUnlock (fp);
+}
+
+/* give up on the message begun with setBegin() */
+static void
+setAbort (SetTmpl *tp)
+{
+	pthread_mutex_unlock (&tp->m);
+}
+
+/* vp is being defined: rebuild its template when next used and, if in delta
+ * mode, send all its elements next time since they may all have changed.
  */
 static void
-fmutexUnlock (FILE *fp)
+setDrop (const void *vp)
+{
+	SetTmpl *tp = setLookup (vp, 0);
+
+	if (!tp)
+	    return;
+	pthread_mutex_lock (&tp->m);
+	tp->stale = 1;
+	tp->full = 1;
+	pthread_mutex_unlock (&tp->m);
+}
+
+/* start deciding which elements of tp to send in delta mode.
+ * return 1 if all must be sent because this is the first time since the
+ *   vector changed shape, a refresh is due, or the state, timeout or message
+ *   changed. else return 0 and caller decides by comparing each element.
+ * N.B. caller must hold tp->m.
+ */
+static int
+deltaBegin (SetTmpl *tp, IPState s, const double *timeout, const char *fmt)
+{
+	double now = monoms();
+	int full = tp->full || fmt || s != tp->lasts
+			|| (timeout && *timeout != tp->lastto)
+			|| (tp->refreshms > 0 && now - tp->lastfull >= tp->refreshms);
+
+	if (full) {
+	    tp->lastfull = now;
+	    tp->full = 0;
+	}
+	tp->lasts = s;
+	if (timeout)
+	    tp->lastto = *timeout;
+
+	return (full);
+}
+
+/* return whether anything need be sent after deltaBegin() and the picks */
+static int
+deltaEnd (SetTmpl *tp, int full)
 {
-	pthread_mutex_t *lp = NULL;
 	int i;
 
-	/* lock access to the list, just need read access */
-	pthread_rwlock_rdlock (&filem_rw);
+	if (full)
+	    return (1);
+	for (i = 0; i < tp->st->ne; i++)
+	    if (tp->pick[i])
+		return (1);
+	return (0);
+}
+
+/* make room for the last values of ne elements in tp, forgetting all */
+static void
+deltaSize (SetTmpl *tp, int ne)
+{
+	int i;
+
+	for (i = 0; i < tp->nlast; i++)
+	    free (tp->lastt[i]);
+	tp->lastv = (double *) realloc (tp->lastv, (ne+1)*sizeof(double));
+	tp->lastt = (char **) realloc (tp->lastt, (ne+1)*sizeof(char *));
+	tp->deadband = (double *) realloc (tp->deadband, (ne+1)*sizeof(double));
+	tp->pick = (char *) realloc (tp->pick, ne+1);
+	for (i = 0; i < ne; i++) {
+	    tp->lastt[i] = strdup ("");
+	    if (i >= tp->nlast)
+		tp->deadband[i] = 0;
+	}
+	tp->nlast = ne;
+	tp->full = 1;
+}
+
+/* turn delta mode on for tp with the given refresh interval, or off if < 0.
+ * N.B. caller must hold tp->m.
+ */
+static void
+deltaMode (SetTmpl *tp, int refreshms)
+{
+	tp->delta = refreshms >= 0;
+	tp->refreshms = refreshms;
+	tp->full = 1;
+}
+
+/* return a monotonic time in ms */
+static double
+monoms (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec*1e3 + ts.tv_nsec*1e-6);
+}
+
+/* return the template for vp. if there is none return NULL, or if add
+ *   first add a new one with no text yet.
+ * no lock is needed because each bucket is only ever prepended to.
+ */
+static SetTmpl *
+setLookup (const void *vp, int add)
+{
+	SetTmpl **bp = &settmpl[((size_t)vp >> 4) & (NSETTMPL-1)];
+	SetTmpl *head, *tp, *stop, *newtp;
+
+	head = __atomic_load_n (bp, __ATOMIC_ACQUIRE);
+	for (tp = head; tp; tp = tp->next)
+	    if (tp->vp == vp)
+		return (tp);
+	if (!add)
+	    return (NULL);
+
+	/* not found, so prepend a new one unless another thread beats us to it */
+	newtp = (SetTmpl *) calloc (1, sizeof(SetTmpl));
+	newtp->vp = vp;
+	pthread_mutex_init (&newtp->m, NULL);
+	newtp->next = head;
+	while (!__atomic_compare_exchange_n (bp, &newtp->next, newtp, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+	    /* bucket grew meanwhile, check just those added since we looked */
+	    stop = head;
+	    head = newtp->next;
+	    for (tp = head; tp != stop; tp = tp->next) {
+		if (tp->vp == vp) {
+		    pthread_mutex_destroy (&newtp->m);
+		    free (newtp);
+		    return (tp);
+		}
+	    }
+	}
+
+	return (newtp);
+}
+
+/* make sure tp has text for the given names, building it if new, stale or
+ *   no longer correct.
+ * N.B. caller must hold tp->m.
+ */
+static void
+setFind (SetTmpl *tp, const char *vtag, const char *etag, const char *dev,
+const char *name, const char *ename, size_t esize, int ne)
+{
+	if (tp->st && !tp->stale
+		    && setMatch (tp, ename, dev, name, ename, esize, ne))
+	    return;
+
+	setBuild (tp, vtag, etag, dev, name, ename, esize, ne);
+	if (tp->nlast != ne)
+	    deltaSize (tp, ne);
+	else
+	    tp->full = 1;
+}
+
+/* return whether tp still renders exactly the given names */
+static int
+setMatch (SetTmpl *tp, const void *ep, const char *dev, const char *name,
+const char *ename, size_t esize, int ne)
+{
+	SetText *st = tp->st;
+	const char *txt = st->txt;
+	int i, l;
+
+	if (st->ep != ep || st->ne != ne)
+	    return (0);
+
+	/* "<vtag\n  device='dev'\n  name='name'\n  state='" */
+	txt = strchr (txt, '\'') + 1;
+	l = strlen (dev);
+	if (strncmp (txt, dev, l) || txt[l] != '\'')
+	    return (0);
+	txt = strchr (txt + l + 1, '\'') + 1;
+	l = strlen (name);
+	if (strncmp (txt, name, l) || txt[l] != '\'')
+	    return (0);
+
+	/* "  <etag name='ename'>\n      " */
+	for (i = 0; i < ne; i++, ename += esize) {
+	    txt = st->txt + st->off[i+1] + st->etagl + 10;
+	    l = st->off[i+2] - st->off[i+1] - st->etagl - 19;
+	    if (strncmp (txt, ename, l) || ename[l] != '\0')
+		return (0);
+	}
+
+	return (1);
+}
+
+/* (re)build tp's text for the given tags and names.
+ * the pieces in txt are: the opening through "state='", then the start of
+ *   each element through its value indent, then each element end, then the
+ *   closing tag. off[i] is where piece i starts and off[ne+3] the total.
+ */
+static void
+setBuild (SetTmpl *tp, const char *vtag, const char *etag, const char *dev,
+const char *name, const char *ename, size_t esize, int ne)
+{
+	SetText *st = (SetText *) malloc (sizeof(SetText));
+	int n, i;
+
+	n = strlen(vtag) + strlen(dev) + strlen(name) + 40;
+	for (i = 0; i < ne; i++)
+	    n += strlen(etag) + strlen(ename + i*esize) + 20;
+	n += 2*strlen(etag) + 2*strlen(vtag) + 20;
+	st->txt = (char *) malloc (n);
+	st->off = (int *) malloc ((ne+4)*sizeof(int));
+
+	n = 0;
+	st->off[0] = n;
+	n += sprintf (st->txt + n, "<%s\n  device='%s'\n  name='%s'\n  state='",
+							vtag, dev, name);
+	for (i = 0; i < ne; i++) {
+	    st->off[i+1] = n;
+	    n += sprintf (st->txt + n, "  <%s name='%s'>\n      ", etag,
+							ename + i*esize);
+	}
+	st->off[ne+1] = n;
+	n += sprintf (st->txt + n, "\n  </%s>\n", etag);
+	st->off[ne+2] = n;
+	n += sprintf (st->txt + n, "</%s>\n", vtag);
+	st->off[ne+3] = n;
+
+	st->ep = ename;
+	st->ne = ne;
+	st->etagl = strlen (etag);
+	st->refs = 1;
+
+	setRelease (tp->st);
+	tp->st = st;
+	tp->stale = 0;
+}
+
+/* drop a reference to st, freeing it if that was the last */
+static void
+setRelease (SetText *st)
+{
+	if (!st || __atomic_sub_fetch (&st->refs, 1, __ATOMIC_ACQ_REL) > 0)
+	    return;
+	free (st->txt);
+	free (st->off);
+	free (st);
+}
+
+/* append l bytes of str to setmsg, or all of it if l < 0 */
+static void
+setAdd (const char *str, int l)
+{
+	if (l < 0)
+	    l = strlen (str);
+	if (setmsgl + l > setmsgm) {
+	    setmsgm = 2*(setmsgl + l) + 1024;
+	    setmsg = (char *) realloc (setmsg, setmsgm);
+	}
+	memcpy (setmsg + setmsgl, str, l);
+	setmsgl += l;
+}
+
+/* append str to setmsg with all xml-sensitive characters replaced with their
+ * entity sequence equivalents.
+ */
+static void
+setAddEnt (const char *str)
+{
+	int l = lenEntityXML (str);
+	const char *ent;
+
+	if (setmsgl + l + 1 > setmsgm) {
+	    setmsgm = 2*(setmsgl + l) + 1024;
+	    setmsg = (char *) realloc (setmsg, setmsgm);
+	}
+	ent = entityXMLr (str, setmsg + setmsgl, setmsgm - setmsgl);
+	if (ent == str)
+	    memcpy (setmsg + setmsgl, str, l);
+	setmsgl += l;
+}
+
+/* print v to buf exactly as sprintf (buf, "%.20g", v) would but much faster
+ *   for all whole numbers below 2^63 and all others from 1e-3 to 2^52, using
+ *   exact integer arithmetic. anything else falls back to snprintf.
+ * N.B. all done with integers so -ffast-math can not change the result.
+ * return strlen(buf).
+ */
+static int
+fmtG20 (char buf[], double v)
+{
+#if defined(__SIZEOF_INT128__)
+	typedef unsigned __int128 U128;
+	static const U128 p10[23] = {
+	    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	    100000000000000000ULL, 1000000000000000000ULL,
+	    10000000000000000000ULL, (U128)10000000000000000000ULL*10,
+	    (U128)10000000000000000000ULL*100, (U128)10000000000000000000ULL*1000,
+	};
+	unsigned long long u, mant, w;
+	char dig[24], *bp = buf;
+	int be, e, k, s, n, i, tries;
+	U128 q, r, half;
+
+	memcpy (&u, &v, sizeof(u));
+	be = (int)((u >> 52) & 0x7ff);
+	mant = u & ((1ULL << 52) - 1);
+	if (be == 0x7ff || (be == 0 && mant != 0))
+	    return (snprintf (buf, 32, "%.20g", v));	/* nan, inf, tiny */
+	if (u >> 63)
+	    *bp++ = '-';
+	if (be == 0) {
+	    *bp++ = '0';
+	    *bp = '\0';
+	    return (bp - buf);
+	}
+	mant |= 1ULL << 52;
+	e = be - 1075;				/* v = mant * 2^e */
+
+	/* whole numbers */
+	w = 0;
+	if (e >= 0 && e <= 10)
+	    w = mant << e;
+	else if (e < 0 && e > -53 && !(mant & ((1ULL << -e) - 1)))
+	    w = mant >> -e;
+	if (w) {
+	    for (n = 0; w; w /= 10)
+		dig[n++] = '0' + (int)(w % 10);
+	    while (n > 0)
+		*bp++ = dig[--n];
+	    *bp = '\0';
+	    return (bp - buf);
+	}
+	if (e >= 0 || e < -120)
+	    return (snprintf (buf, 32, "%.20g", v));
 
-	/* find fp, ignore if not found */
-	for (i = 0; i < nfilemutex; i++) {
-	    if (filemutex[i]->fp == fp) {
-		lp = &filemutex[i]->m;
+	/* find the 20 digits q and decimal exponent k such that v rounds to
+	 * q*10^(k-19), starting with k from the binary exponent.
+	 */
+	s = -e;
+	k = ((e + 52) * 78913) >> 18;		/* floor(log10(2^(e+52))) */
+	for (tries = 0; ; tries++) {
+	    int p = 19 - k;
+
+	    if (tries > 3 || p < 0)
+		return (snprintf (buf, 32, "%.20g", v));
+	    if (p > 22) {
+		k++;
+		continue;
+	    }
+	    q = (U128)mant * p10[p];
+	    r = q & (((U128)1 << s) - 1);
+	    q >>= s;
+	    half = (U128)1 << (s - 1);
+	    if (r > half || (r == half && (q & 1)))
+		q++;
+	    if (q >= p10[20])
+		k++;
+	    else if (q < p10[19])
+		k--;
+	    else
 		break;
+	}
+
+	/* 20 digits, too wide for 64 bits so in two halves */
+	w = (unsigned long long)(q % p10[10]);
+	for (i = 19; i >= 10; i--, w /= 10)
+	    dig[i] = '0' + (int)(w % 10);
+	w = (unsigned long long)(q / p10[10]);
+	for (; i >= 0; i--, w /= 10)
+	    dig[i] = '0' + (int)(w % 10);
+
+	/* %g drops trailing zeros of the fraction, and the point if none left */
+	for (n = 20; n > 1 && n > k + 1 && dig[n-1] == '0'; n--)
+	    continue;
+	if (k >= 0) {
+	    for (i = 0; i <= k; i++)
+		*bp++ = dig[i];
+	    if (n > k + 1) {
+		*bp++ = '.';
+		for (; i < n; i++)
+		    *bp++ = dig[i];
 	    }
+	} else {
+	    *bp++ = '0';
+	    *bp++ = '.';
+	    for (i = k + 1; i < 0; i++)
+		*bp++ = '0';
+	    for (i = 0; i < n; i++)
+		*bp++ = dig[i];
 	}
+	*bp = '\0';
+	return (bp - buf);
+#else
+	return (snprintf (buf, 32, "%.20g", v));
+#endif
+}
+
+/* print v to buf exactly as sprintf (buf, "%g", v) would, quickly if v is a
+ *   small whole number, as timeouts usually are.
+ * return strlen(buf).
+ */
+static int
+fmtG (char buf[], double v)
+{
+	if (v >= 0 && v < 1e6 && v == (double)(long)v)
+	    return (fmtG20 (buf, v));
+	return (snprintf (buf, 32, "%g", v));
+}
 
-	/* unlock list, lp will always be stable now */
-	pthread_rwlock_unlock (&filem_rw);
+/* FNV-1a hash of device and property name, or of just an element name when
+ * called with dev "".
+ */
+static unsigned
+regHash (const char *dev, const char *name)
+{
+	unsigned h = 2166136261u;
 
-	if (lp)
-	    pthread_mutex_unlock (lp);
+	while (*dev)
+	    h = (h ^ (unsigned char)*dev++) * 16777619u;
+	h = (h ^ 0xff) * 16777619u;	/* separator no name can contain */
+	while (*name)
+	    h = (h ^ (unsigned char)*name++) * 16777619u;
+	return (h);
 }
+
+/* add or replace the registration of vp with handler fp, or remove it if
+ * fp is NULL.
+ */
+static void
+regAdd (RegType type, void *vp, const char *dev, const char *name, void *fp)
+{
+	Reg *rp, **rpp;
+	int b;
+
+	/* drop any old registration of vp */
+	for (b = 0; b < NREG; b++) {
+	    for (rpp = &regs[b]; (rp = *rpp) != NULL; rpp = &rp->next) {
+		if (rp->vp == vp) {
+		    *rpp = rp->next;
+		    free (rp->map);
+		    free (rp);
+		    break;
+		}
+	    }
+	}
+
+	if (!fp)
+	    return;
+
+	rp = (Reg *) calloc (1, sizeof(Reg));
+	rp->type = type;
+	rp->vp = vp;
+	rp->fp = fp;
+	rp->hash = regHash (dev, name);
+	rp->ne = -1;			/* build map when first used */
+	rp->next = regs[rp->hash & (NREG-1)];
+	regs[rp->hash & (NREG-1)] = rp;
+}
+
+/* return the registration of the given type for dev.name, else NULL */
+static Reg *
+regFind (RegType type, const char *dev, const char *name)
+{
+	unsigned h;
+	Reg *rp;
+
+	h = regHash (dev, name);
+	for (rp = regs[h & (NREG-1)]; rp; rp = rp->next) {
+	    const char *rdev, *rname;
+
+	    if (rp->hash != h || rp->type != type)
+		continue;
+	    switch (rp->type) {
+	    case REG_NUMBER: rdev = ((INumberVectorProperty *)rp->vp)->device;
+			     rname = ((INumberVectorProperty *)rp->vp)->name; break;
+	    case REG_SWITCH: rdev = ((ISwitchVectorProperty *)rp->vp)->device;
+			     rname = ((ISwitchVectorProperty *)rp->vp)->name; break;
+	    case REG_TEXT:   rdev = ((ITextVectorProperty *)rp->vp)->device;
+			     rname = ((ITextVectorProperty *)rp->vp)->name; break;
+	    default:	     rdev = ((IBLOBVectorProperty *)rp->vp)->device;
+			     rname = ((IBLOBVectorProperty *)rp->vp)->name; break;
+	    }
+	    if (!strcmp (rdev, dev) && !strcmp (rname, name))
+		return (rp);
+	}
+	return (NULL);
+}
+
+/* get the element array of rp's vector, where the first element name is,
+ * how far apart the element structs are and how many there are.
+ */
+static void
+regElements (Reg *rp, const void **epp, const char **enamep, size_t *esizep,
+int *nep)
+{
+	switch (rp->type) {
+	case REG_NUMBER: {
+	    INumberVectorProperty *nvp = (INumberVectorProperty *)rp->vp;
+	    *epp = nvp->np;
+	    *enamep = nvp->np ? nvp->np[0].name : NULL;
+	    *esizep = sizeof(INumber);
+	    *nep = nvp->nnp;
+	    } break;
+	case REG_SWITCH: {
+	    ISwitchVectorProperty *svp = (ISwitchVectorProperty *)rp->vp;
+	    *epp = svp->sp;
+	    *enamep = svp->sp ? svp->sp[0].name : NULL;
+	    *esizep = sizeof(ISwitch);
+	    *nep = svp->nsp;
+	    } break;
+	case REG_TEXT: {
+	    ITextVectorProperty *tvp = (ITextVectorProperty *)rp->vp;
+	    *epp = tvp->tp;
+	    *enamep = tvp->tp ? tvp->tp[0].name : NULL;
+	    *esizep = sizeof(IText);
+	    *nep = tvp->ntp;
+	    } break;
+	default: {
+	    IBLOBVectorProperty *bvp = (IBLOBVectorProperty *)rp->vp;
+	    *epp = bvp->bp;
+	    *enamep = bvp->bp ? bvp->bp[0].name : NULL;
+	    *esizep = sizeof(IBLOB);
+	    *nep = bvp->nbp;
+	    } break;
+	}
+}
+
+/* return a static array of the index within rp's vector of each of the n
+ * element names, or -1 for any it does not have. the element name hash is
+ * built the first time and again whenever the element array changes.
+ * a hit is always checked against the current name, so only a miss can be
+ *   stale; the elements are then searched in turn and the hash rebuilt if
+ *   the name is there after all, which costs nothing on the usual path.
+ */
+static int *
+regIndex (Reg *rp, char *names[], int n)
+{
+	static int *idx;
+	static int maxidx;
+	const void *ep;
+	const char *ename;
+	size_t esize;
+	int ne, i, j;
+
+	regElements (rp, &ep, &ename, &esize, &ne);
+	if (ep != rp->ep || ne != rp->ne)
+	    regMap (rp, ep, ename, esize, ne);
+
+	if (n > maxidx) {
+	    idx = (int *) realloc (idx, n*sizeof(int));
+	    maxidx = n;
+	}
+
+	/* look up each name */
+	for (i = 0; i < n; i++) {
+	    idx[i] = -1;
+	    for (j = regHash ("", names[i]) & rp->mapmask; rp->map[j] >= 0;
+							j = (j+1) & rp->mapmask) {
+		if (!strcmp (ename + rp->map[j]*esize, names[i])) {
+		    idx[i] = rp->map[j];
+		    break;
+		}
+	    }
+	    if (idx[i] < 0) {
+		for (j = 0; j < ne; j++)
+		    if (!strcmp (ename + j*esize, names[i]))
+			break;
+		if (j < ne) {
+		    regMap (rp, ep, ename, esize, ne);
+		    idx[i] = j;
+		}
+	    }
+	}
+
+	return (idx);
+}
+
+/* (re)build rp's element name hash, with open addressing at most half full,
+ * for its ne elements at ep each esize apart, the first named ename.
+ */
+static void
+regMap (Reg *rp, const void *ep, const char *ename, size_t esize, int ne)
+{
+	int i, j, m;
+
+	for (m = 4; m < 2*ne; m *= 2)
+	    continue;
+	rp->map = (int *) realloc (rp->map, m*sizeof(int));
+	rp->mapmask = m-1;
+	for (j = 0; j < m; j++)
+	    rp->map[j] = -1;
+	for (i = 0; i < ne; i++) {
+	    for (j = regHash ("", ename + i*esize) & rp->mapmask; rp->map[j] >= 0;
+							j = (j+1) & rp->mapmask)
+		continue;
+	    rp->map[j] = i;
+	}
+	rp->ep = ep;
+	rp->ne = ne;
+}
+
+#if defined(SEXA_BENCH) || defined(G20_BENCH)
+/* standalone benchmarks of the number fast paths, see below.
+ */
+
+#include <math.h>
+
+/* the driver entry points, never called here */
+void ISGetProperties (const char *dev, const char *propname) {}
+void ISNewText (const char *dev, const char *name, char *texts[],
+    char *names[], int n) {}
+void ISNewNumber (const char *dev, const char *name, double *doubles,
+    char *names[], int n) {}
+void ISNewSwitch (const char *dev, const char *name, ISState *states,
+    char *names[], int n) {}
+void ISNewBLOB (const char *dev, const char *name, int sizes[],
+    int blobsizes[], char *blobs[], char *formats[], char *names[], int n) {}
+void ISSnoopDevice (XMLEle *root) {}
+
+/* return seconds since some epoch */
+static double
+secs(void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec*1e-6);
+}
+#endif
+
+#ifdef SEXA_BENCH
+/* report how fast sexagesimal() cracks typical number values compared with
+ * the general sscanf path, after checking the two agree exactly.
+ * make sexabench
+ */
+
+/* fill s with a random value formatted the way clients send them */
+static void
+randNumber (char *s)
+{
+	double v = (rand() - RAND_MAX/2) * pow (10.0, rand()%40 - 20) / RAND_MAX;
+
+	switch (rand() % 8) {
+	case 0: sprintf (s, "%g", v); break;
+	case 1: sprintf (s, "%.6f", v); break;
+	case 2: sprintf (s, "%.17g", v); break;
+	case 3: sprintf (s, "%.3e", v); break;
+	case 4: sprintf (s, " %d ", rand() - RAND_MAX/2); break;
+	case 5: sprintf (s, "%+.10G", v); break;
+	case 6: sprintf (s, "%.0f.", v); break;
+	case 7: sprintf (s, "%.30f", v); break;
+	}
+}
+
+/* check sexagesimal() exactly matches sexaGeneral() on many random numbers
+ * and on strings made of random number-like chars, including sexagesimal
+ * forms, junk and values outside the fast path.
+ * return number of mismatches.
+ */
+static int
+crossCheck (void)
+{
+	static const char chars[] = "0123456789.:-+eE x";
+	char s[64];
+	double d1, d2;
+	int nbad = 0;
+	int i, j, n, r1, r2;
+
+	for (i = 0; i < 2000000; i++) {
+	    if (i % 2)
+		randNumber (s);
+	    else {
+		n = rand() % 12;
+		for (j = 0; j < n; j++)
+		    s[j] = chars[rand() % (sizeof(chars)-1)];
+		s[n] = '\0';
+	    }
+
+	    d1 = d2 = 1234.5;
+	    r1 = sexagesimal (s, &d1);
+	    r2 = sexaGeneral (s, &d2);
+	    if (r1 != r2 || (r1 == 0 && memcmp (&d1, &d2, sizeof(d1)))) {
+		if (nbad++ < 10)
+		    printf ("mismatch \"%s\": %d %.17g  %d %.17g\n", s,
+							    r1, d1, r2, d2);
+	    }
+	}
+
+	return (nbad);
+}
+
+int
+main (int ac, char *av[])
+{
+	int n = ac > 1 ? atoi(av[1]) : 1000000;
+	char (*strs)[64] = (char (*)[64]) malloc (n * sizeof(*strs));
+	double t0, t1, t2, d, sum1, sum2;
+	int i, nbad;
+
+	nbad = crossCheck();
+	printf ("cross check: %s\n", nbad ? "FAILED" : "ok");
+
+	for (i = 0; i < n; i++)
+	    randNumber (strs[i]);
+
+	sum1 = 0;
+	t0 = secs();
+	for (i = 0; i < n; i++) {
+	    sexaGeneral (strs[i], &d);
+	    sum1 += d;
+	}
+	t1 = secs() - t0;
+	printf ("sscanf   %8.1f ns/value\n", t1*1e9/n);
+
+	sum2 = 0;
+	t0 = secs();
+	for (i = 0; i < n; i++) {
+	    sexagesimal (strs[i], &d);
+	    sum2 += d;
+	}
+	t2 = secs() - t0;
+	printf ("fast     %8.1f ns/value  %.1fx\n", t2*1e9/n, t1/t2);
+	if (sum1 != sum2)
+	    nbad++;
+
+	printf ("%s\n", nbad ? "FAILED" : "ok");
+	return (nbad ? 1 : 0);
+}
+#endif
+
+#ifdef G20_BENCH
+/* check fmtG20() gives exactly the same text as "%.20g" on many random
+ * doubles, then report how much faster it is.
+ * make g20bench
+ */
+
+/* return a random double of the kinds fmtG20() must handle.
+ * if typical, only those a driver usually sends, which take the fast path.
+ */
+static double
+randDouble (int typical)
+{
+	unsigned long long u;
+	double v;
+
+	switch (typical ? 1 + rand()%4 : rand()%6) {
+	case 0:		/* any bit pattern at all */
+	    u = ((unsigned long long)rand() << 62) ^ ((unsigned long long)rand() << 31)
+								^ rand();
+	    memcpy (&v, &u, sizeof(v));
+	    return (v);
+	case 1:		/* whole numbers */
+	    return ((double)(((unsigned long long)rand() << 31) ^ rand())
+						    / (1 << rand()%31));
+	case 2:		/* few decimals, as from a display */
+	    return ((rand() - RAND_MAX/2) / 1000.0);
+	case 3:		/* sexagesimal-ish angles and times */
+	    return (rand() % 360 + (rand() % 60)/60.0 + (rand() % 6000)/360000.0);
+	case 4:		/* across the whole fast path */
+	    return ((rand() - RAND_MAX/2) * pow (10.0, rand()%20 - 4) / RAND_MAX);
+	default:	/* near its edges */
+	    return (ldexp ((double)rand() / RAND_MAX + 1, rand()%130 - 70));
+	}
+}
+
+int
+main (int ac, char *av[])
+{
+	int n = ac > 1 ? atoi(av[1]) : 20000000;
+	int nt = n < 1000000 ? n : 1000000;
+	double *vals = (double *) malloc (nt * sizeof(double));
+	char b1[64], b2[64];
+	double t0, t1, t2;
+	int i, l, nbad = 0;
+	long sum1, sum2;
+
+	for (i = 0; i < n; i++) {
+	    double v = randDouble(0);
+	    l = fmtG20 (b1, v);
+	    snprintf (b2, sizeof(b2), "%.20g", v);
+	    if (strcmp (b1, b2) || l != (int)strlen(b2)) {
+		if (nbad++ < 10)
+		    printf ("mismatch %a: %s %s\n", v, b1, b2);
+	    }
+	}
+	printf ("cross check of %d: %s\n", n, nbad ? "FAILED" : "ok");
+
+	for (i = 0; i < nt; i++)
+	    vals[i] = randDouble(1);
+
+	sum1 = 0;
+	t0 = secs();
+	for (i = 0; i < nt; i++)
+	    sum1 += snprintf (b2, sizeof(b2), "%.20g", vals[i]);
+	t1 = secs() - t0;
+	printf ("snprintf %8.1f ns/value\n", t1*1e9/nt);
+
+	sum2 = 0;
+	t0 = secs();
+	for (i = 0; i < nt; i++)
+	    sum2 += fmtG20 (b1, vals[i]);
+	t2 = secs() - t0;
+	printf ("fmtG20   %8.1f ns/value  %.1fx\n", t2*1e9/nt, t1/t2);
+	if (sum1 != sum2)
+	    nbad++;
+
+	printf ("%s\n", nbad ? "FAILED" : "ok");
+	return (nbad ? 1 : 0);
+}
+#endif
@@ -39,6 +39,12 @@
  * copied or reformated from the parsed XML. Clients or drivers that get more
  * than maxqsiz bytes behind are forcibly shut down.
  *
+ * As an extension, a Client may send <enableExpr name='n'>exp</enableExpr> to have
+ * us evaluate exp, in the grammar of compiler.c, each time any of its operands change.
+ * We keep the latest value of each operand used by any such filter and send the
+ * Client just <setExpr name='n'>value</setExpr> when exp changes between 0 and non-0,
+ * so it need not receive and parse every update of every property exp uses.
+ *
  * Mutexes:
  *  [] The overall list of clients is guarded by a rwlock as clients come and go.
  *  [] Each client structure contains a mutex to guard its queue of messages.
@@ -48,6 +54,7 @@
  *  [] Each driver structure contains a rwlock write-locked when/if it is restarted.
  *  [] Each message contains a mutex to guard its usage count.
  *  [] The log file is marshalled by a mutex.
+ *  [] All expression filters and their operand values are guarded by one mutex.
  *
  */
 
@@ -76,6 +83,7 @@
 #include "lilxml.h"
 #include "indiapi.h"
 #include "fq.h"
+#include "compiler.h"
 
 #define INDIPORT        7624            /* default TCP/IP port to listen */
 #define	REMOTEDVR	(-1234)		/* invalid PID to flag remote drivers */
@@ -170,6 +178,52 @@ typedef struct {
 static DvrInfo *dvrinfo;		/* malloced array of DvrInfo */
 static int ndvrinfo;			/* n total */
 
+/* one expression filter requested by a client with enableExpr.
+ * all filters, and the operand values they use, are guarded by filt_lock.
+ * nfilters is only changed with filt_lock held but q2Filters() reads it
+ *   without, so driver threads need not lock at all when there are none.
+ */
+typedef struct Filter {
+    ClInfo *cp;				/* client that wants it */
+    char name[MAXINDINAME];		/* client's name for it */
+    Expr *x;				/* compiled expression */
+    struct FOperand **ops;		/* malloced array of each operand it uses */
+    int nops;				/* n entries in ops[] */
+    int nunset;				/* n ops[] without a value yet */
+    int state;				/* 0 or 1 as last sent, -1 before first */
+    int dirty;				/* set while on dirtyfilt list */
+    struct Filter *dnext;		/* next on dirtyfilt list */
+    struct Filter *next;		/* next on filters list */
+} Filter;
+static Filter *filters;			/* list of all filters */
+static int nfilters;			/* n on filters list, atomic */
+static Filter *dirtyfilt;		/* list of filters to evaluate */
+static pthread_mutex_t filt_lock;	/* guard all filter info */
+
+/* one filter operand, its latest value and each filter that uses it */
+typedef struct FOperand {
+    char *name;				/* malloced device.name.element */
+    int set;				/* set once a value has been seen */
+    double v;				/* latest value */
+    Filter **fps;			/* malloced array of each filter using it */
+    int *vxs;				/* operand index in each fps[i]->x */
+    int nfps;				/* n entries in fps[] and vxs[] */
+    struct FOperand *next;		/* next in same fophash[] chain */
+} FOperand;
+#define	MAXFILTEXP	4096		/* longest filter expression accepted */
+#define	MAXCLFILTERS	256		/* most filters one client may have */
+#define	NFOPHASH	256		/* n fophash[] chains, power of 2 */
+static FOperand *fophash[NFOPHASH];	/* each filter operand, by name */
+
+/* each device.name prefix of any FOperand, so we can ignore other vectors */
+typedef struct FVector {
+    char *dn;				/* malloced device.name */
+    int nref;				/* n FOperands with this prefix */
+    struct FVector *next;		/* next in same fvechash[] chain */
+} FVector;
+#define	NFVECHASH	256		/* n fvechash[] chains, power of 2 */
+static FVector *fvechash[NFVECHASH];	/* each FVector, by dn */
+
 /* local variables */
 static char *me;			/* our argv[0] name */
 static int port = INDIPORT;		/* public INDI port */
@@ -223,6 +277,19 @@ static void addMsg (Msg *mp, char buf[], int bufl);
 static void incMsg (Msg *mp);
 static void drainMsgs (FQ *qp);
 static void crackBLOB (char *enableBLOB, BLOBHandling *bp);
+static void enableExpr (ClInfo *cp, char *name, char *exp);
+static void rmFilter (Filter *fp);
+static void rmClFilters (ClInfo *cp);
+static void q2Filters (XMLEle *root, char *dev, char *name);
+static void setFOperand (char *key, double v);
+static void evalFilter (Filter *fp);
+static void q2Filter (Filter *fp, const char *fmt, ...);
+static FOperand *findFOperand (char *name, int add);
+static void refFVectors (char *name, int add);
+static FVector *findFVector (char *dn);
+static unsigned filtHash (const char *s);
+static int crackLState (char *state);
+static double crackTS (char *ts);
 static void traceMsg (XMLEle *root);
 static char *tstamp (char *s);
 static void logDvrMsg (XMLEle *root, char *dev);
@@ -290,6 +357,9 @@ main (int ac, char *av[])
 	/* prepare log file lock before first use of logMessage() */
 	pthread_mutex_init (&log_lock, NULL);
 
+	/* prepare expression filter lock */
+	pthread_mutex_init (&filt_lock, NULL);
+
 	/* log our list of drivers */
 	logDrivers  (ac, av);
 
@@ -914,6 +984,12 @@ clientReaderThread (void *vp)
 			goto done;
 		    }
 
+		    /* as are expression filters */
+		    if (!strcmp (roottag, "enableExpr")) {
+			enableExpr (cp, name, pcdataXMLEle(root));
+			goto done;
+		    }
+
 		    /* snag interested properties */
 		    addClDevice (cp, 0, dev, name);
 
@@ -1103,6 +1179,10 @@ driverStdoutReaderThread (void *vp)
 		    /* send to snooping drivers */
 		    q2SnoopingDrivers (isblob, dev, name, dp->mp);
 
+		    /* update expression filters */
+		    if (!isblob)
+			q2Filters (root, dev, name);
+
 		done:
 
 		    /* we're done with this msg here */
@@ -1264,6 +1344,9 @@ shutdownClient (ClInfo *cp)
 	/* lock clinfo while updating */
 	pthread_rwlock_wrlock (&cl_rwlock);
 
+	/* no more filter reports */
+	rmClFilters (cp);
+
 	/* close socket connection */
 	shutdown (cp->s, SHUT_RDWR);
 	close (cp->s);
@@ -1883,6 +1966,497 @@ crackBLOB (char *enableBLOB, BLOBHandling *bp)
 	    *bp = B_NEVER;
 }
 
+/* add, replace or, if exp is empty, remove the filter cp knows as name.
+ * send cp an Alert setExpr if exp will not compile.
+ * ask the driver for any operand values we do not already have.
+ */
+static void
+enableExpr (ClInfo *cp, char *name, char *exp)
+{
+	char errmsg[1024];
+	char **opnames, **gp;
+	Filter *fp, *nfp;
+	int i, ngp = 0, ncl = 0;
+
+	pthread_mutex_lock (&filt_lock);
+
+	/* remove any previous with this name, counting the client's others */
+	for (fp = filters; fp; fp = nfp) {
+	    nfp = fp->next;
+	    if (fp->cp != cp)
+		continue;
+	    if (!strcmp (fp->name, name))
+		rmFilter (fp);
+	    else
+		ncl++;
+	}
+	exp += strspn (exp, " \t\r\n");
+	if (!exp[0]) {
+	    if (verbose > 0)
+		logMessage ("Client %d: removed filter %s\n", cp->s, name);
+	    pthread_mutex_unlock (&filt_lock);
+	    return;
+	}
+
+	/* compile */
+	fp = (Filter *) calloc (1, sizeof(Filter));
+	if (!fp)
+	    Bye ("No memory for new filter\n");
+	fp->cp = cp;
+	strncpyz (fp->name, name, MAXINDINAME-1);
+	fp->state = -1;
+	fp->x = newExpr();
+	errmsg[0] = '\0';
+	if (strlen (exp) > MAXFILTEXP)
+	    sprintf (errmsg, "Expression longer than %d", MAXFILTEXP);
+	else if (ncl >= MAXCLFILTERS)
+	    sprintf (errmsg, "More than %d filters", MAXCLFILTERS);
+	if (errmsg[0] || exprCompile (fp->x, exp, errmsg) < 0) {
+	    char ebuf[2048];
+	    if (verbose > 0)
+		logMessage ("Client %d: filter %s: %s\n", cp->s, name, errmsg);
+	    q2Filter (fp, "<setExpr name='%s' state='Alert' message='%s'/>\n",
+			fp->name, entityXMLr (errmsg, ebuf, sizeof(ebuf)));
+	    delExpr (fp->x);
+	    free (fp);
+	    pthread_mutex_unlock (&filt_lock);
+	    return;
+	}
+	fp->next = filters;
+	filters = fp;
+	__atomic_add_fetch (&nfilters, 1, __ATOMIC_RELAXED);
+	if (verbose > 0)
+	    logMessage ("Client %d: filter %s: %s\n", cp->s, name, exp);
+
+	/* connect each operand, noting the properties we still need */
+	fp->nops = exprGetAllOperands (fp->x, &opnames);
+	fp->ops = (FOperand **) malloc ((fp->nops+1) * sizeof(FOperand *));
+	gp = (char **) malloc ((fp->nops+1) * sizeof(char *));
+	if (!fp->ops || !gp)
+	    Bye ("No memory for new filter operands\n");
+	for (i = 0; i < fp->nops; i++) {
+	    FOperand *op = findFOperand (opnames[i], 1);
+	    int vx = exprOperandIndex (fp->x, opnames[i]);
+
+	    op->fps = (Filter **) realloc (op->fps, (op->nfps+1)*sizeof(Filter *));
+	    op->vxs = (int *) realloc (op->vxs, (op->nfps+1)*sizeof(int));
+	    if (!op->fps || !op->vxs)
+		Bye ("No memory for new filter operand\n");
+	    op->fps[op->nfps] = fp;
+	    op->vxs[op->nfps] = vx;
+	    op->nfps++;
+	    fp->ops[i] = op;
+
+	    if (op->set)
+		exprSetOperandIndex (fp->x, vx, op->v);
+	    else {
+		/* device.name from the first two components */
+		char *dot = strchr (strchr (op->name, '.') + 1, '.');
+		int ldn = dot - op->name;
+		int j;
+
+		for (j = 0; j < ngp; j++)
+		    if (!strncmp (gp[j], op->name, ldn) && !gp[j][ldn])
+			break;
+		if (j == ngp) {
+		    gp[ngp] = (char *) malloc (ldn + 1);
+		    if (!gp[ngp])
+			Bye ("No memory for new filter property\n");
+		    memcpy (gp[ngp], op->name, ldn);
+		    gp[ngp++][ldn] = '\0';
+		}
+		fp->nunset++;
+	    }
+	}
+	free (opnames);
+
+	/* report now if nothing is missing */
+	if (fp->nunset == 0)
+	    evalFilter (fp);
+
+	pthread_mutex_unlock (&filt_lock);
+
+	/* ask for just the properties we have not seen yet */
+	for (i = 0; i < ngp; i++) {
+	    char *dot = strchr (gp[i], '.');
+	    char msg[MAXINDIDEVICE+MAXINDINAME+100];
+	    Msg *mp;
+	    int msgl;
+
+	    *dot = '\0';
+	    if (strlen (gp[i]) < MAXINDIDEVICE && strlen (dot+1) < MAXINDINAME) {
+		mp = newMsg();
+		msgl = sprintf (msg, "<getProperties version='%g' device='%s' name='%s'/>\n",
+							INDIV, gp[i], dot+1);
+		addMsg (mp, msg, msgl);
+		q2Drivers (gp[i], mp, (char *)"getProperties");
+		decMsg (mp);
+	    }
+	    free (gp[i]);
+	}
+	free (gp);
+}
+
+/* unlink fp from filters and from each of its operands, freeing any operand
+ * no longer used, then free fp.
+ * N.B. caller must hold filt_lock.
+ */
+static void
+rmFilter (Filter *fp)
+{
+	Filter **fpp;
+	int i, j;
+
+	for (fpp = &filters; *fpp; fpp = &(*fpp)->next) {
+	    if (*fpp == fp) {
+		*fpp = fp->next;
+		__atomic_sub_fetch (&nfilters, 1, __ATOMIC_RELAXED);
+		break;
+	    }
+	}
+	for (fpp = &dirtyfilt; *fpp; fpp = &(*fpp)->dnext) {
+	    if (*fpp == fp) {
+		*fpp = fp->dnext;
+		break;
+	    }
+	}
+
+	for (i = 0; i < fp->nops; i++) {
+	    FOperand *op = fp->ops[i];
+
+	    for (j = 0; j < op->nfps; j++) {
+		if (op->fps[j] == fp) {
+		    op->nfps--;
+		    op->fps[j] = op->fps[op->nfps];
+		    op->vxs[j] = op->vxs[op->nfps];
+		    break;
+		}
+	    }
+
+	    if (op->nfps == 0) {
+		FOperand **opp = &fophash[filtHash (op->name) & (NFOPHASH-1)];
+		while (*opp != op)
+		    opp = &(*opp)->next;
+		*opp = op->next;
+		refFVectors (op->name, 0);
+		free (op->name);
+		free (op->fps);
+		free (op->vxs);
+		free (op);
+	    }
+	}
+
+	delExpr (fp->x);
+	free (fp->ops);
+	free (fp);
+}
+
+/* remove all filters for the given client.
+ */
+static void
+rmClFilters (ClInfo *cp)
+{
+	Filter *fp, *nfp;
+
+	pthread_mutex_lock (&filt_lock);
+	for (fp = filters; fp; fp = nfp) {
+	    nfp = fp->next;
+	    if (fp->cp == cp)
+		rmFilter (fp);
+	}
+	pthread_mutex_unlock (&filt_lock);
+}
+
+/* update any filter operands in the given def or set message from a driver
+ * then report each filter that changed between 0 and non-0.
+ * vectors no filter uses are skipped without looking at their elements.
+ */
+static void
+q2Filters (XMLEle *root, char *dev, char *name)
+{
+	char key[MAXINDIDEVICE+2*MAXINDINAME+10];
+	int isdef, isset, keyl;
+	const char *one;
+	char kind;
+	char *roottag, *ts;
+	XMLEle *ep;
+
+	/* nothing to do, and no lock to take, until some client has a filter.
+	 * a filter added just after this check sees this message no differently
+	 * than if the message had come just before it.
+	 */
+	if (!__atomic_load_n (&nfilters, __ATOMIC_RELAXED))
+	    return;
+
+	pthread_mutex_lock (&filt_lock);
+
+	/* quick check whether any filter uses this vector */
+	if (!filters || strlen(dev) >= MAXINDIDEVICE || strlen(name) >= MAXINDINAME)
+	    goto out;
+	keyl = sprintf (key, "%s.%s", dev, name);
+	if (!findFVector (key))
+	    goto out;
+	key[keyl++] = '.';
+
+	/* element values */
+	roottag = tagXMLEle (root);
+	isdef = !strncmp (roottag, "def", 3);
+	isset = !strncmp (roottag, "set", 3);
+	if (!isdef && !isset)
+	    goto out;
+	if (!strcmp (roottag+3, "NumberVector")) {
+	    one = isdef ? "defNumber" : "oneNumber";
+	    kind = 'N';
+	} else if (!strcmp (roottag+3, "SwitchVector")) {
+	    one = isdef ? "defSwitch" : "oneSwitch";
+	    kind = 'S';
+	} else if (!strcmp (roottag+3, "LightVector")) {
+	    one = isdef ? "defLight" : "oneLight";
+	    kind = 'L';
+	} else {
+	    one = NULL;
+	    kind = 0;
+	}
+	for (ep = one ? nextXMLEle (root, 1) : NULL; ep; ep = nextXMLEle (root, 0)) {
+	    char *ename = findXMLAttValu (ep, "name");
+	    char *pc;
+	    double v;
+
+	    if (strcmp (tagXMLEle(ep), one) || strlen (ename) >= MAXINDINAME)
+		continue;
+	    pc = pcdataXMLEle (ep);
+	    if (kind == 'N')
+		v = atof (pc);
+	    else if (kind == 'S')
+		v = !strcmp (pc, "On");
+	    else
+		v = crackLState (pc);
+	    strcpy (key+keyl, ename);
+	    setFOperand (key, v);
+	}
+
+	/* property attributes */
+	if (findXMLAttValu (root, "state")[0]) {
+	    strcpy (key+keyl, "_STATE");
+	    setFOperand (key, crackLState (findXMLAttValu (root, "state")));
+	}
+	ts = findXMLAttValu (root, "timestamp");
+	if (ts[0]) {
+	    strcpy (key+keyl, "_TS");
+	    setFOperand (key, crackTS (ts));
+	}
+
+	/* evaluate just those affected */
+	while (dirtyfilt) {
+	    Filter *fp = dirtyfilt;
+	    dirtyfilt = fp->dnext;
+	    fp->dirty = 0;
+	    evalFilter (fp);
+	}
+
+    out:
+	pthread_mutex_unlock (&filt_lock);
+}
+
+/* set the operand with the given name, if any, to v.
+ * if it changed, add each filter using it with all operands known to dirtyfilt.
+ * N.B. caller must hold filt_lock.
+ */
+static void
+setFOperand (char *key, double v)
+{
+	FOperand *op = findFOperand (key, 0);
+	int i;
+
+	if (!op || (op->set && op->v == v))
+	    return;
+
+	for (i = 0; i < op->nfps; i++) {
+	    Filter *fp = op->fps[i];
+	    exprSetOperandIndex (fp->x, op->vxs[i], v);
+	    if (!op->set)
+		fp->nunset--;
+	    if (fp->nunset == 0 && !fp->dirty) {
+		fp->dirty = 1;
+		fp->dnext = dirtyfilt;
+		dirtyfilt = fp;
+	    }
+	}
+	op->set = 1;
+	op->v = v;
+}
+
+/* evaluate fp and send its value to its client if first time or the value
+ * changed between 0 and non-0.
+ * N.B. caller must hold filt_lock.
+ */
+static void
+evalFilter (Filter *fp)
+{
+	char errmsg[1024];
+	double v;
+	int state;
+
+	if (exprEval (fp->x, &v, errmsg) < 0) {
+	    char ebuf[2048];
+	    q2Filter (fp, "<setExpr name='%s' state='Alert' message='%s'/>\n",
+			fp->name, entityXMLr (errmsg, ebuf, sizeof(ebuf)));
+	    return;
+	}
+
+	state = v != 0;
+	if (state != fp->state) {
+	    char ts[64];
+	    fp->state = state;
+	    q2Filter (fp, "<setExpr name='%s' state='Ok' timestamp='%s'>%.15g</setExpr>\n",
+			fp->name, tstamp (ts), v);
+	}
+}
+
+/* queue a new message for fp's client.
+ */
+static void
+q2Filter (Filter *fp, const char *fmt, ...)
+{
+	char buf[4096];
+	va_list ap;
+	Msg *mp;
+	int l;
+
+	va_start (ap, fmt);
+	l = vsnprintf (buf, sizeof(buf), fmt, ap);
+	va_end (ap);
+	if (l >= (int)sizeof(buf))
+	    l = sizeof(buf) - 1;
+
+	mp = newMsg();
+	addMsg (mp, buf, l);
+	if (verbose > 2)
+	    logMsg ("queue to", NULL, fp->cp, mp);
+	pushMsg (NULL, fp->cp, mp);
+	decMsg (mp);
+}
+
+/* return the FOperand with the given name.
+ * if not found return NULL, or a new one if add.
+ * N.B. caller must hold filt_lock.
+ */
+static FOperand *
+findFOperand (char *name, int add)
+{
+	FOperand **opp = &fophash[filtHash (name) & (NFOPHASH-1)];
+	FOperand *op;
+
+	for (op = *opp; op; op = op->next)
+	    if (!strcmp (op->name, name))
+		return (op);
+	if (!add)
+	    return (NULL);
+
+	op = (FOperand *) calloc (1, sizeof(FOperand));
+	if (!op || !(op->name = strdup (name)))
+	    Bye ("No memory for new filter operand\n");
+	op->next = *opp;
+	*opp = op;
+	refFVectors (name, 1);
+	return (op);
+}
+
+/* add a reference to, or remove one from, each device.name prefix the given
+ * operand name could have. that is just one unless the device or property name
+ * contains a dot.
+ * N.B. caller must hold filt_lock.
+ */
+static void
+refFVectors (char *name, int add)
+{
+	char dn[MAXINDIDEVICE+MAXINDINAME+10];
+	char *dot;
+
+	for (dot = strchr (strchr (name, '.') + 1, '.'); dot;
+						    dot = strchr (dot + 1, '.')) {
+	    int ldn = dot - name;
+	    FVector *vp, **vpp;
+
+	    if (ldn >= (int)sizeof(dn))
+		break;
+	    memcpy (dn, name, ldn);
+	    dn[ldn] = '\0';
+	    vpp = &fvechash[filtHash (dn) & (NFVECHASH-1)];
+	    while ((vp = *vpp) && strcmp (vp->dn, dn))
+		vpp = &vp->next;
+
+	    if (add) {
+		if (!vp) {
+		    vp = (FVector *) calloc (1, sizeof(FVector));
+		    if (!vp || !(vp->dn = strdup (dn)))
+			Bye ("No memory for new filter vector\n");
+		    *vpp = vp;
+		}
+		vp->nref++;
+	    } else if (vp && --vp->nref == 0) {
+		*vpp = vp->next;
+		free (vp->dn);
+		free (vp);
+	    }
+	}
+}
+
+/* return the FVector for the given device.name, else NULL.
+ * N.B. caller must hold filt_lock.
+ */
+static FVector *
+findFVector (char *dn)
+{
+	FVector *vp;
+
+	for (vp = fvechash[filtHash (dn) & (NFVECHASH-1)]; vp; vp = vp->next)
+	    if (!strcmp (vp->dn, dn))
+		return (vp);
+	return (NULL);
+}
+
+/* return a hash of s */
+static unsigned
+filtHash (const char *s)
+{
+	unsigned h = 2166136261u;
+
+	while (*s)
+	    h = (h ^ (unsigned char)*s++) * 16777619u;
+	return (h);
+}
+
+/* return 0|1|2|3 depending on whether state is Idle|Ok|Busy|<other>.
+ */
+static int
+crackLState (char *state)
+{
+	if (!strcmp (state, "Idle"))
+	    return (0);
+	if (!strcmp (state, "Ok"))
+	    return (1);
+	if (!strcmp (state, "Busy"))
+	    return (2);
+	return (3);
+}
+
+/* return UNIX seconds for the given ISO 8601 UT timestamp, else -1.
+ */
+static double
+crackTS (char *ts)
+{
+	struct tm tm;
+
+	memset (&tm, 0, sizeof(tm));
+	if (6 != sscanf (ts, "%d-%d-%dT%d:%d:%d", &tm.tm_year, &tm.tm_mon,
+			&tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec))
+	    return (-1);
+	tm.tm_mon -= 1;			/* want 0..11 */
+	tm.tm_year -= 1900;		/* want years since 1900 */
+	return ((double) timegm (&tm));
+}
+
 /* print key attributes and values of the given xml to stderr.
  */
 static void
@@ -1,6 +1,7 @@
 /* Simbad interface
  * connects to http://simbad.u-strasbg.fr/simbad to retrieve named target information.
  * last successful target is updated and published once per minute.
+ * each lookup runs as an IEAddJob job so the network IO never blocks the driver.
  */
 
 #include <stdio.h>
@@ -42,10 +43,27 @@
 static char simhost_france[] = "simbad.u-strasbg.fr";
 static char simhost_harvard[] = "simbad.harvard.edu";
 
+/* one lookup, filled in by a worker thread then published from the event loop.
+ * only the most recent lookup is published, any it superseded are discarded.
+ */
+typedef struct {
+    char *id;				/* malloced target name as given */
+    int lid;				/* LID to report with results */
+    int seq;				/* lookupseq when requested */
+    int ok;				/* set if found */
+    char whynot[1024];			/* excuse if not ok */
+    double ra, dec;			/* J2000 position, hours and degrees */
+    double pmra, pmdec;			/* proper motion, mas/yr */
+    double radvel, para, mag;		/* radial velocity, parallax, magnitude */
+} Lookup;
+static int lookupseq;			/* seq of most recent lookup */
+
 /* local functions */
 static void initOnce(void);
-static int simbad (const char *id, int lid, char whynot[]);
-static int simbad_try (const char cleanid[], const char host[], int lid, char whynot[]);
+static void lookupJob (void *p);
+static void lookupDone (void *p);
+static int simbad (const char *id, Lookup *lp);
+static int simbad_try (const char cleanid[], const char host[], Lookup *lp);
 static int mkconnection (const char *host, int port, char msg[]);
 static void uptimeCB (void *dummy);
 static void publishCB (void *dummy);
@@ -83,27 +101,78 @@ ISNewText (const char *dev, const char *name, char *texts[], char *names[], int
 
 	    char *id = simbad_lookup.tp[NAME_SL].text;
 	    int lid = atoi(simbad_lookup.tp[LID_SL].text);
-	    char whynot[1024];
+	    Lookup *lp;
 
 	    simbad_lookup.s = IPS_BUSY;
 	    IDSetText (&simbad_lookup, "Looking up '%s' for LID %d", id, lid);
 
-	    if (simbad (id, lid, whynot) < 0) {
-
-		/* result failed: report Alert */
+	    /* look up in the background, lookupDone() reports */
+	    lp = (Lookup *) calloc (1, sizeof(Lookup));
+	    lp->id = strdup (id);
+	    lp->lid = lid;
+	    lp->seq = ++lookupseq;
+	    if (IEAddJob (lookupJob, lookupDone, lp) < 0) {
 		simbad_lookup.s = IPS_ALERT;
-		IDSetText (&simbad_lookup, "Simbad error: %s", whynot);
+		IDSetText (&simbad_lookup, "Simbad error: too many lookups in progress");
+		free (lp->id);
+		free (lp);
+	    }
+	}
+}
 
-	    } else {
+/* worker thread job to look up one target.
+ * N.B. must not touch any properties, just lp.
+ */
+static void
+lookupJob (void *p)
+{
+	Lookup *lp = (Lookup *)p;
 
-		/* lookup successful: publish results and report OK */
-		simbad_results.s = IPS_OK;
-		simbad_results.np[LID_SR].value = lid;
-		IDSetNumber (&simbad_results, "Results for '%s'", id);
-		simbad_lookup.s = IPS_OK;
-		IDSetText (&simbad_lookup, "Results for '%s'", id);
-	    }
+	lp->ok = simbad (lp->id, lp) == 0;
+}
+
+/* back in the event loop after lookupJob(): publish and report, unless a newer
+ * lookup has been requested meanwhile.
+ */
+static void
+lookupDone (void *p)
+{
+	Lookup *lp = (Lookup *)p;
+
+	if (lp->seq != lookupseq) {
+
+	    /* superseded: quietly drop */
+
+	} else if (!lp->ok) {
+
+	    /* result failed: report Alert */
+	    simbad_lookup.s = IPS_ALERT;
+	    IDSetText (&simbad_lookup, "Simbad error: %s", lp->whynot);
+
+	} else {
+
+	    /* fill in simbad_results all but NOW values */
+	    simbad_results.np[RA2K_SR].value = lp->ra;
+	    simbad_results.np[DEC2K_SR].value = lp->dec;
+	    simbad_results.np[PMRA_SR].value = lp->pmra;
+	    simbad_results.np[PMDEC_SR].value = lp->pmdec;
+	    simbad_results.np[RADVEL_SR].value = lp->radvel;
+	    simbad_results.np[PARALLAX_SR].value = lp->para;
+	    simbad_results.np[MAG_SR].value = lp->mag;
+
+	    /* fill in derived values */
+	    computeNow();
+
+	    /* lookup successful: publish results and report OK */
+	    simbad_results.s = IPS_OK;
+	    simbad_results.np[LID_SR].value = lp->lid;
+	    IDSetNumber (&simbad_results, "Results for '%s'", lp->id);
+	    simbad_lookup.s = IPS_OK;
+	    IDSetText (&simbad_lookup, "Results for '%s'", lp->id);
 	}
+
+	free (lp->id);
+	free (lp);
 }
 
 void
@@ -151,11 +220,13 @@ initOnce()
 }
 
 /* lookup the given ID on simbad.
- * if ok, fill in simbad_results and return 0, else return -1 with excuse in whynot[]
+ * if ok, fill in lp results and return 0, else return -1 with excuse in lp->whynot[]
+ * N.B. runs in a worker thread.
  */
 static int
-simbad (const char *id, int lid, char whynot[])
+simbad (const char *id, Lookup *lp)
 {
+	char *whynot = lp->whynot;
 	char cleanid[512], *idp;
 	int idl, i;
 
@@ -186,9 +257,9 @@ simbad (const char *id, int lid, char whynot[])
 	// IDLog ("ID scrub '%s' -> '%s'\n", id, cleanid);
 
 	/* try each host, USA first then France */
-	if (simbad_try (cleanid, simhost_harvard, lid, whynot) < 0) {
+	if (simbad_try (cleanid, simhost_harvard, lp) < 0) {
 	    IDLog ("Error from %s: %s\n", simhost_harvard, whynot);
-	    if (simbad_try (cleanid, simhost_france, lid, whynot) < 0) {
+	    if (simbad_try (cleanid, simhost_france, lp) < 0) {
 		IDLog ( "Error from %s: %s\n", simhost_france, whynot);
 		return (-1);
 	    }
@@ -198,15 +269,14 @@ simbad (const char *id, int lid, char whynot[])
 	return (0);
 }
 
-static void
-on_alarm(int sig)
-{
-	// IDLog ("Internet connection timed out\n");
-}
-
+/* try to look up cleanid on the given simbad host.
+ * if ok, fill in lp results and return 0, else return -1 with excuse in lp->whynot[]
+ * N.B. runs in a worker thread so time out with socket options, not alarm(2).
+ */
 static int
-simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
+simbad_try (const char cleanid[], const char host[], Lookup *lp)
 {
+	char *whynot = lp->whynot;
 	char query[256];
 	char buf[1024];
 	int s, l, n, w;
@@ -214,21 +284,11 @@ simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
 	bool rdok, pmok, rvok, paok, magok;
 	FILE *fp;
 
-	/* set up timeout timer -- clear when not needed */
-	struct sigaction sa;
-	memset (&sa, 0, sizeof(sa));
-	sa.sa_handler = on_alarm;
-	sigemptyset (&sa.sa_mask);
-	sigaction(SIGALRM, &sa, NULL);
-	alarm (SOCKTO);
-
 	/* open a socket to host */
 	IDLog ("Connecting to %s\n", host);
 	s = mkconnection (host, 80, whynot);
-	if (s < 0) {
-	    alarm (0);
+	if (s < 0)
 	    return (-1);
-	}
 
 	/* create the query url
 	 * see http://simbad.u-strasbg.fr/simbad/sim-help?Page=sim-url
@@ -252,7 +312,6 @@ simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
 		    sprintf (whynot, "Write during '%s': EOF", cleanid);
 		shutdown (s, SHUT_RDWR);
 		close (s);
-		alarm (0);
 		return (-1);
 	    }
 	}
@@ -260,7 +319,6 @@ simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
 	/* read result, looking for good stuff */
 	fp = fdopen (s, "r");
 	rdok = pmok = rvok = paok = magok = false;
-	alarm (SOCKTO);
 	while (fgets (buf, sizeof(buf), fp)) {
 
 	    // IDLog ( "%s", buf);
@@ -289,19 +347,14 @@ simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
 
 	    if (!magok && sscanf (buf, "Flux R : %lf", &mag) == 1)
 		magok = true;
-
-	    /* new alarm time for next fgets */
-
-	    alarm (SOCKTO);
 	}
 
 	if (ferror (fp)) {
-	    if (errno == EINTR)
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
 		sprintf (whynot, "While reading '%s': Connection timed out", cleanid);
 	    else
 		sprintf (whynot, "While reading '%s': %s", cleanid, strerror(errno));
 	    fclose (fp);
-	    alarm(0);
 	    return (-1);
 	}
 
@@ -312,25 +365,19 @@ simbad_try (const char cleanid[], const char host[], int lid, char whynot[])
 	/* find enough? */
 	if (!rdok) {
 	    sprintf (whynot, "'%s' not found on %s", cleanid, host);
-	    alarm(0);
 	    return (-1);
 	}
 
-	/* fill in simbad_results all but NOW values */
-	simbad_results.np[RA2K_SR].value = deghr(ra);
-	simbad_results.np[DEC2K_SR].value = dec;
-	simbad_results.np[PMRA_SR].value = pmok ? pmra : 0.0;
-	simbad_results.np[PMDEC_SR].value = pmok ? pmdec : 0.0;
-	simbad_results.np[RADVEL_SR].value = rvok ? radvel : 0.0;
-	simbad_results.np[PARALLAX_SR].value = paok? para : 0.0;
-	simbad_results.np[MAG_SR].value = magok? mag : 999;
-
-
-	/* fill in derived values */
-	computeNow();
+	/* fill in lp results */
+	lp->ra = deghr(ra);
+	lp->dec = dec;
+	lp->pmra = pmok ? pmra : 0.0;
+	lp->pmdec = pmok ? pmdec : 0.0;
+	lp->radvel = rvok ? radvel : 0.0;
+	lp->para = paok? para : 0.0;
+	lp->mag = magok? mag : 999;
 
 	/* done! */
-	alarm(0);
 	return (0);
 }
 
@@ -346,12 +393,16 @@ char msg[])		/* return diagnostic message here, if returning -1 */
 {
 
 	struct sockaddr_in serv_addr;
-	struct hostent  *hp;
-	int sockfd;
-
-	/* lookup host address */
-	hp = gethostbyname (host);
-	if (!hp) {
+	struct addrinfo hints, *aip;
+	struct timeval tv;
+	int sockfd, gai;
+
+	/* lookup host address, getaddrinfo() is thread safe unlike gethostbyname() */
+	memset (&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	gai = getaddrinfo (host, NULL, &hints, &aip);
+	if (gai != 0 || !aip) {
 	    (void) sprintf (msg, "Can not find IP of %s", host); 
 	    return (-1);
 	}
@@ -359,16 +410,26 @@ char msg[])		/* return diagnostic message here, if returning -1 */
 	/* create a socket to the host's server */
 	(void) memset ((char *)&serv_addr, 0, sizeof(serv_addr));
 	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_addr.s_addr =
-		    ((struct in_addr *)(hp->h_addr_list[0]))->s_addr;
+	serv_addr.sin_addr.s_addr = ((struct sockaddr_in *)aip->ai_addr)->sin_addr.s_addr;
 	serv_addr.sin_port = htons((short)port);
+	freeaddrinfo (aip);
 	if ((sockfd = socket (AF_INET, SOCK_STREAM, 0)) < 0) {
 	    (void) sprintf (msg, "socket(%s/%d): %s", host, port, strerror(errno));
 	    return (-1);
 	}
+
+	/* time out connect and each read or write after SOCKTO */
+	tv.tv_sec = SOCKTO;
+	tv.tv_usec = 0;
+	setsockopt (sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt (sockfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
 	if (connect (sockfd, (struct sockaddr *)&serv_addr,
 						sizeof(serv_addr)) < 0) {
-	    (void) sprintf (msg, "connect(%s): %s", host, strerror(errno));
+	    if (errno == EINPROGRESS)
+		(void) sprintf (msg, "connect(%s): Connection timed out", host);
+	    else
+		(void) sprintf (msg, "connect(%s): %s", host, strerror(errno));
 	    (void) close(sockfd);
 	    return (-1);
 	}
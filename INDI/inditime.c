@@ -289,11 +289,14 @@ updateTime (void *p)
 	if (t0 == 0)
 	    t0 = time(NULL);
 	timeVersion.np[UPTIME_TVER].value = time(NULL) - t0;
-	IDSetNumber (&timeVersion, NULL);
 
+	/* send all with one write */
+	IDBatchBegin();
+	IDSetNumber (&timeVersion, NULL);
 	IDSetNumber (&timeNow, NULL);
 	if (rs)
 	    IDSetNumber (&timeEvents, NULL);
+	IDBatchEnd();
 
 	IEAddTimer (POLLMS, updateTime, NULL);
 }
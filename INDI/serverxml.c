@@ -0,0 +1,693 @@
+/* read complete XML elements from an INDI server connection, pulling large
+ *   buffers from the socket and feeding them to the parser.
+ * In exact mode, used when the connection is shared with later processes as
+ *   with -d, the bytes are only peeked at and nothing past the end of the
+ *   last complete element is consumed, so the next process starts exactly
+ *   where we left off. This costs one more recv(2) per element but is still
+ *   far cheaper than the one read(2) per byte of an unbuffered FILE.
+ * An optional sink may take the content of chosen elements straight from
+ *   the buffer instead of it being collected in the tree.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "serverxml.h"
+
+static int fill (void);
+static int consume (void);
+
+static int svrfd = -1;			/* server connection */
+static int exact;			/* consume only whole elements */
+static FILE *tracefp;			/* copy all we read here, if set */
+static char buf[65536];			/* bytes read, or peeked if exact */
+static int bufsz = sizeof(buf);		/* max to read at once */
+static int nbuf;			/* bytes in buf[] */
+static int pos;				/* next byte in buf[] for parser */
+static ServerXMLSink *sink;		/* optional content sink */
+static XMLEle *sinkep;			/* element content going to sink */
+
+/* prepare to read from the given server fd.
+ * if exact, never consume more than needed for each complete element.
+ * if tfp, copy each byte consumed there.
+ */
+void
+initServerXML (int fd, int ex, FILE *tfp)
+{
+	svrfd = fd;
+	exact = ex;
+	tracefp = tfp;
+	nbuf = pos = 0;
+	bufsz = sizeof(buf);
+	sinkep = NULL;
+}
+
+/* install a function to be offered the content of each element as it starts.
+ * it is first called with n == 0 and should return 1 if it wants the
+ *   content of ep, else 0. If it does, it is then called with each run of
+ *   raw content bytes s[n] as they arrive, then once with n < 0 at the end.
+ *   The content never reaches the parser so ep will appear to be empty.
+ * N.B. content is passed raw, ie, entities are not decoded, so this is only
+ *   appropriate for content that can not contain any, such as base64.
+ */
+void
+sinkServerXML (ServerXMLSink *newsink)
+{
+	sink = newsink;
+}
+
+/* return the next complete XML element from the server.
+ * return NULL with reason in ynot[] if bad XML, or NULL with ynot[0] == '\0'
+ *   on EOF or read error, with errno 0 or the reason, respectively.
+ * N.B. caller must call delXMLEle()
+ */
+XMLEle *
+readServerXML (LilXML *lp, char ynot[])
+{
+	while (1) {
+	    if (pos == nbuf && fill() <= 0) {
+		ynot[0] = '\0';
+		return (NULL);
+	    }
+	    while (pos < nbuf) {
+		XMLEle *root;
+
+		/* pass content up to '<' to sink, then resume parsing */
+		if (sinkep) {
+		    char *lt = (char *) memchr (buf+pos, '<', nbuf-pos);
+		    int n = (lt ? lt - buf : nbuf) - pos;
+		    if (n > 0)
+			(*sink) (sinkep, buf+pos, n);
+		    pos += n;
+		    if (!lt)
+			break;
+		    (*sink) (sinkep, NULL, -1);
+		    sinkep = NULL;
+		}
+
+		root = readXMLEle (lp, buf[pos++], ynot);
+		if (!root && !ynot[0] && sink && buf[pos-1] == '>') {
+		    /* see whether sink wants the content just starting */
+		    XMLEle *ep = contentXMLEle (lp);
+		    if (ep && (*sink) (ep, NULL, 0))
+			sinkep = ep;
+		}
+		if (root) {
+		    if (exact && consume() < 0) {
+			delXMLEle (root);
+			ynot[0] = '\0';
+			return (NULL);
+		    }
+		    return (root);
+		}
+		if (ynot[0])
+		    return (NULL);
+	    }
+	}
+}
+
+/* return whether bytes already read from the server are waiting to be parsed,
+ * ie, whether readServerXML() may have more even if svrfd is not readable.
+ */
+int
+pendingServerXML ()
+{
+	return (pos < nbuf);
+}
+
+/* refill buf[] with more from svrfd.
+ * return number of new bytes, 0 on EOF or -1 on error with errno set.
+ */
+static int
+fill ()
+{
+	int n;
+
+	if (exact) {
+	    /* bytes already parsed are ours, then peek at what follows */
+	    if (consume() < 0)
+		return (-1);
+	    do
+		n = recv (svrfd, buf, bufsz, MSG_PEEK);
+	    while (n < 0 && errno == EINTR);
+	    if (n < 0 && errno == ENOTSOCK) {
+		/* can't peek, one byte at a time is the only exact way */
+		exact = 0;
+		bufsz = 1;
+		return (fill());
+	    }
+	} else {
+	    do
+		n = read (svrfd, buf, bufsz);
+	    while (n < 0 && errno == EINTR);
+	    if (n > 0 && tracefp)
+		fwrite (buf, 1, n, tracefp);
+	}
+
+	if (n == 0)
+	    errno = 0;
+	nbuf = n > 0 ? n : 0;
+	pos = 0;
+	return (n);
+}
+
+/* in exact mode, really read the buf[0..pos) bytes already peeked at and
+ * parsed, keeping any remaining peeked bytes at the front of buf[].
+ * return 0 if ok, else -1 with errno set.
+ */
+static int
+consume ()
+{
+	int n, got;
+
+	for (got = 0; got < pos; got += n) {
+	    n = recv (svrfd, buf+got, pos-got, 0);	/* same bytes again */
+	    if (n < 0 && errno == EINTR)
+		n = 0;
+	    else if (n <= 0) {
+		if (n == 0)
+		    errno = 0;
+		return (-1);
+	    }
+	}
+	if (pos > 0 && tracefp)
+	    fwrite (buf, 1, pos, tracefp);
+
+	memmove (buf, buf+pos, nbuf-pos);
+	nbuf -= pos;
+	pos = 0;
+	return (0);
+}
+
+#if defined(SERVERXML_CHECK)
+/* differential check of readServerXML() against readXMLEle() one char at a
+ * time, the same reference as liblilxml's xmltest. each input is fed through
+ * a file, a pipe and a socket written in random sized pieces, in bulk and
+ * exact modes, and must give exactly the same messages and errors. in exact
+ * mode each message must also have consumed just the bytes through its end.
+ * the clean inputs are also read with a sink taking each oneBLOB, whose
+ * content must be the same as the reference's apart from whitespace, which
+ * the parser trims. then the same is done for many random mutations.
+ *
+ * make svrxmlcheck
+ */
+
+#include <stdlib.h>
+#include <ctype.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "base64.h"
+
+/* a growing byte buffer */
+typedef struct {
+    char *s;				/* malloced bytes */
+    int l;				/* bytes used */
+    int m;				/* bytes malloced */
+} Buf;
+
+/* one input stream */
+typedef struct {
+    char *name;				/* file name or description */
+    Buf b;				/* contents */
+} Input;
+
+/* ways to feed a stream to readServerXML() */
+typedef enum {
+    VIA_FILE, VIA_PIPE, VIA_SOCKET
+} Via;
+typedef struct {
+    const char *name;
+    Via via;				/* what svrfd is */
+    int exact;				/* exact mode */
+    int sink;				/* sink each oneBLOB */
+} ReadPath;
+static ReadPath rpaths[] = {
+    {"bulk file",	VIA_FILE,   0, 0},
+    {"bulk pipe",	VIA_PIPE,   0, 0},
+    {"bulk socket",	VIA_SOCKET, 0, 0},
+    {"exact pipe",	VIA_PIPE,   1, 0},
+    {"exact socket",	VIA_SOCKET, 1, 0},
+    {"sink bulk",	VIA_SOCKET, 0, 1},
+    {"sink exact",	VIA_SOCKET, 1, 1},
+};
+#define	NRPATHS	((int)(sizeof(rpaths)/sizeof(rpaths[0])))
+
+/* one piece of sunk content */
+typedef struct {
+    XMLEle *ep;				/* element it belongs to */
+    Buf b;				/* its raw content */
+} Sunk;
+
+/* what a writer thread sends */
+typedef struct {
+    int fd;				/* write end */
+    const char *s;			/* bytes to write */
+    int l;				/* n bytes */
+    unsigned seed;			/* for piece sizes */
+} Writer;
+
+static void usage (void);
+static void readInput (char *fn, Input *ip);
+static void makeBigBLOB (Input *ip, int nraw);
+static int checkInput (const char *name, const char *s, int l, int clean);
+static void parseRef (const char *s, int l, Buf *tp, ReadPath *rp);
+static void parseSvr (const char *s, int l, Buf *tp, ReadPath *rp);
+static void transcript (Buf *tp, XMLEle *root, const char *ynot, long at,
+    int blobs);
+static void *writer (void *wp);
+static int blobSink (XMLEle *ep, const char *s, int n);
+static void mutate (Buf *bp, Input *ins, int nin);
+static void bufAdd (Buf *bp, const char *s, int l);
+
+static Sunk *sunk;			/* content taken by blobSink() */
+static int nsunk;			/* n in sunk[] */
+static int vflag;			/* verbose */
+
+int
+main (int ac, char *av[])
+{
+	Input *ins;
+	int nin = 0;
+	int nfuzz = 2000;
+	int bigblob = 1024*1024;
+	unsigned seed = 1;
+	int nbad = 0;
+	int i;
+
+	/* crack args */
+	while ((--ac > 0) && ((*++av)[0] == '-')) {
+	    char *s;
+	    for (s = av[0]+1; *s != '\0'; s++) {
+		switch (*s) {
+		case 'f':
+		    if (ac < 2)
+			usage();
+		    nfuzz = atoi(*++av);
+		    ac--;
+		    break;
+		case 's':
+		    if (ac < 2)
+			usage();
+		    seed = atoi(*++av);
+		    ac--;
+		    break;
+		case 'v':
+		    vflag++;
+		    break;
+		default:
+		    usage();
+		}
+	    }
+	}
+	if (ac <= 0)
+	    usage();
+
+	signal (SIGPIPE, SIG_IGN);
+	srand (seed);
+
+	/* read each file, plus one large BLOB made here */
+	ins = (Input *) calloc (ac+1, sizeof(Input));
+	for (i = 0; i < ac; i++)
+	    readInput (av[i], &ins[nin++]);
+	if (bigblob > 0)
+	    makeBigBLOB (&ins[nin++], bigblob);
+
+	/* each as is */
+	for (i = 0; i < nin; i++)
+	    nbad += checkInput (ins[i].name, ins[i].b.s, ins[i].b.l, 1);
+	printf ("differential: %d inputs %s\n", nin, nbad ? "FAILED" : "ok");
+
+	/* many mutations of the files */
+	if (!nbad && nfuzz > 0) {
+	    Buf b;
+
+	    memset (&b, 0, sizeof(b));
+	    for (i = 0; !nbad && i < nfuzz; i++) {
+		char name[64];
+
+		mutate (&b, ins, ac);
+		sprintf (name, "mutation %d", i);
+		nbad += checkInput (name, b.s, b.l, 0);
+	    }
+	    free (b.s);
+	    printf ("fuzz: %d mutations, seed %u %s\n", nfuzz, seed,
+	    					nbad ? "FAILED" : "ok");
+	}
+
+	for (i = 0; i < nin; i++)
+	    free (ins[i].b.s);
+	free (ins);
+
+	return (nbad ? 1 : 0);
+}
+
+static void
+usage ()
+{
+	fprintf (stderr, "Usage: svrxmltest [options] file ...\n");
+	fprintf (stderr, "Purpose: check readServerXML() on files of INDI messages\n");
+	fprintf (stderr, "Options:\n");
+	fprintf (stderr, "  -f n  : number of random mutations to check, default 2000\n");
+	fprintf (stderr, "  -s n  : random seed, default 1\n");
+	fprintf (stderr, "  -v    : verbose\n");
+	fprintf (stderr, "Exit 0 if all ok else 1, first failing input is saved in svrxmltest.fail\n");
+
+	exit (2);
+}
+
+/* read the named file into ip, or exit */
+static void
+readInput (char *fn, Input *ip)
+{
+	FILE *fp = fopen (fn, "r");
+	char rbuf[8192];
+	int n;
+
+	if (!fp) {
+	    fprintf (stderr, "%s: %s\n", fn, strerror(errno));
+	    exit(2);
+	}
+	while ((n = fread (rbuf, 1, sizeof(rbuf), fp)) > 0)
+	    bufAdd (&ip->b, rbuf, n);
+	fclose (fp);
+	ip->name = fn;
+}
+
+/* fill ip with a setBLOBVector carrying nraw random bytes, in lines of 72 as
+ * sent by setINDI, so it spans many buf[]s.
+ */
+static void
+makeBigBLOB (Input *ip, int nraw)
+{
+	unsigned char *raw = (unsigned char *) malloc (nraw);
+	unsigned char *b64 = (unsigned char *) malloc (4*nraw/3+4);
+	static char name[64];
+	char hdr[256];
+	int i, n64;
+
+	for (i = 0; i < nraw; i++)
+	    raw[i] = rand();
+	n64 = to64frombits (b64, raw, nraw);
+
+	bufAdd (&ip->b, hdr, sprintf (hdr,
+		"<setBLOBVector device='CCD' name='CCD1' state='Ok'>\n"
+		"  <oneBLOB name='CCD1' size='%d' format='.fits'>\n", nraw));
+	for (i = 0; i < n64; i += 72) {
+	    bufAdd (&ip->b, (char *)b64+i, n64-i < 72 ? n64-i : 72);
+	    bufAdd (&ip->b, "\n", 1);
+	}
+	bufAdd (&ip->b, "  </oneBLOB>\n</setBLOBVector>\n", 30);
+
+	sprintf (name, "%dKB BLOB", nraw>>10);
+	ip->name = name;
+
+	free (raw);
+	free (b64);
+}
+
+/* read the l bytes at s every way readServerXML() can and check each agrees
+ * with the reference. the sink paths are only used if clean, since the sink
+ * is not meant for content that is not base64.
+ * return 0 if ok else 1.
+ */
+static int
+checkInput (const char *name, const char *s, int l, int clean)
+{
+	int bad = 0;
+	int i;
+
+	for (i = 0; !bad && i < NRPATHS; i++) {
+	    ReadPath *rp = &rpaths[i];
+	    Buf ref, alt;
+
+	    if (rp->sink && !clean)
+		continue;
+
+	    memset (&ref, 0, sizeof(ref));
+	    memset (&alt, 0, sizeof(alt));
+	    parseRef (s, l, &ref, rp);
+	    parseSvr (s, l, &alt, rp);
+	    if (alt.l != ref.l || (ref.l > 0 && memcmp (alt.s, ref.s, ref.l))) {
+		FILE *fp = fopen ("svrxmltest.fail", "w");
+
+		fprintf (stderr, "%s: %s does not match readXMLEle, see svrxmltest.fail\n",
+								name, rp->name);
+		if (fp) {
+		    fwrite (s, 1, l, fp);
+		    fclose (fp);
+		}
+		bad = 1;
+	    }
+	    free (ref.s);
+	    free (alt.s);
+	}
+
+	if (vflag && !bad)
+	    printf ("%s: %d bytes ok\n", name, l);
+
+	return (bad);
+}
+
+/* the reference: readXMLEle() one char at a time, with the offset just past
+ * each message if rp is exact.
+ */
+static void
+parseRef (const char *s, int l, Buf *tp, ReadPath *rp)
+{
+	LilXML *lp = newLilXML();
+	char ynot[1024];
+	int i;
+
+	for (i = 0; i < l; i++) {
+	    XMLEle *root = readXMLEle (lp, s[i], ynot);
+	    if (root || ynot[0])
+		transcript (tp, root, ynot, rp->exact ? i+1 : -1, rp->sink);
+	    delXMLEle (root);
+	}
+
+	delLilXML (lp);
+}
+
+/* readServerXML() from the l bytes at s fed as rp says */
+static void
+parseSvr (const char *s, int l, Buf *tp, ReadPath *rp)
+{
+	LilXML *lp = newLilXML();
+	char ynot[1024];
+	XMLEle *root;
+	pthread_t thr;
+	Writer w;
+	FILE *fp = NULL, *tfp;
+	char *trace;
+	size_t ntrace;
+	int fds[2];
+
+	/* feed from a file, or a thread writing into a pipe or socket */
+	if (rp->via == VIA_FILE) {
+	    fp = tmpfile();
+	    fwrite (s, 1, l, fp);
+	    fflush (fp);
+	    fds[0] = dup (fileno (fp));
+	    lseek (fds[0], 0, SEEK_SET);
+	} else {
+	    if (rp->via == VIA_PIPE ? pipe (fds)
+				: socketpair (AF_UNIX, SOCK_STREAM, 0, fds)) {
+		perror ("pipe");
+		exit (2);
+	    }
+	    w.fd = fds[1];
+	    w.s = s;
+	    w.l = l;
+	    w.seed = rand();
+	    pthread_create (&thr, NULL, writer, &w);
+	}
+
+	/* trace records how much has been consumed */
+	tfp = open_memstream (&trace, &ntrace);
+	initServerXML (fds[0], rp->exact, tfp);
+	sinkServerXML (rp->sink ? blobSink : NULL);
+
+	while (ynot[0] = '\0', (root = readServerXML (lp, ynot)) || ynot[0]) {
+	    fflush (tfp);
+	    transcript (tp, root, ynot, root && rp->exact ? (long)ntrace : -1,
+								rp->sink);
+	    delXMLEle (root);
+	}
+
+	/* drain so the writer can finish */
+	if (rp->via != VIA_FILE) {
+	    char junk[4096];
+	    while (read (fds[0], junk, sizeof(junk)) > 0)
+		continue;
+	    pthread_join (thr, NULL);
+	}
+
+	sinkServerXML (NULL);
+	close (fds[0]);
+	if (fp)
+	    fclose (fp);
+	fclose (tfp);
+	free (trace);
+	delLilXML (lp);
+}
+
+/* add to tp the printed root, or ynot if root is NULL, then the offset at
+ * if >= 0, ending with a \f. first give root's sunk elements their content
+ * then, if blobs, drop all whitespace from that of every oneBLOB.
+ */
+static void
+transcript (Buf *tp, XMLEle *root, const char *ynot, long at, int blobs)
+{
+	int i;
+
+	for (i = 0; i < nsunk; i++) {
+	    bufAdd (&sunk[i].b, "", 1);
+	    if (root)
+		editXMLEle (sunk[i].ep, sunk[i].b.s);
+	    free (sunk[i].b.s);
+	}
+	nsunk = 0;
+
+	if (root) {
+	    XMLEle *ep;
+	    char *s;
+	    size_t l;
+	    FILE *fp;
+
+	    for (ep = nextXMLEle (root, 1); blobs && ep; ep = nextXMLEle (root, 0)) {
+		char *b, *from, *to;
+
+		if (strcmp (tagXMLEle (ep), "oneBLOB"))
+		    continue;
+		b = to = strdup (pcdataXMLEle (ep));
+		for (from = b; *from; from++)
+		    if (!isspace (*from))
+			*to++ = *from;
+		*to = '\0';
+		editXMLEle (ep, b);
+		free (b);
+	    }
+
+	    fp = open_memstream (&s, &l);
+	    prXMLEle (fp, root, 0);
+	    if (at >= 0)
+		fprintf (fp, "@%ld", at);
+	    fclose (fp);
+	    bufAdd (tp, s, l);
+	    free (s);
+	} else {
+	    bufAdd (tp, "error: ", 7);
+	    bufAdd (tp, ynot, strlen(ynot));
+	}
+	bufAdd (tp, "\f", 1);
+}
+
+/* thread to write all of a Writer in random sized pieces, then close */
+static void *
+writer (void *vp)
+{
+	Writer *wp = (Writer *) vp;
+	int n, i;
+
+	for (i = 0; i < wp->l; i += n) {
+	    n = 1 + rand_r (&wp->seed) % 5000;
+	    if (n > wp->l - i)
+		n = wp->l - i;
+	    n = write (wp->fd, wp->s + i, n);
+	    if (n < 0)
+		break;
+	}
+	close (wp->fd);
+	return (NULL);
+}
+
+/* the sink, collecting the content of each oneBLOB in sunk[] */
+static int
+blobSink (XMLEle *ep, const char *s, int n)
+{
+	if (n == 0) {
+	    if (strcmp (tagXMLEle (ep), "oneBLOB"))
+		return (0);
+	    sunk = (Sunk *) realloc (sunk, (nsunk+1)*sizeof(Sunk));
+	    memset (&sunk[nsunk], 0, sizeof(Sunk));
+	    sunk[nsunk++].ep = ep;
+	    return (1);
+	}
+	if (n > 0)
+	    bufAdd (&sunk[nsunk-1].b, s, n);
+	return (0);
+}
+
+/* set bp to a copy of a random input with a few random edits applied.
+ * the edits favor chars that mean something to the parser.
+ */
+static void
+mutate (Buf *bp, Input *ins, int nin)
+{
+	static const char special[] = "<>/&;'\"=!?- \n\tabc#";
+	Input *ip = &ins[rand() % nin];
+	int nedits = 1 + rand() % 8;
+	int maxl = 4096;
+	char dup[16];
+
+	bp->l = 0;
+	bufAdd (bp, ip->b.s, ip->b.l < maxl ? ip->b.l : maxl);
+
+	while (nedits-- > 0 && bp->l > 0) {
+	    int at = rand() % bp->l;
+	    int n = 1 + rand() % 16;
+	    Input *op;
+
+	    if (n > bp->l - at)
+		n = bp->l - at;
+
+	    switch (rand() % 6) {
+	    case 0:	/* replace a char with a special one */
+		bp->s[at] = special[rand() % (sizeof(special)-1)];
+		break;
+	    case 1:	/* replace a char with anything */
+		bp->s[at] = rand();
+		break;
+	    case 2:	/* delete a few chars */
+		memmove (bp->s+at, bp->s+at+n, bp->l-at-n);
+		bp->l -= n;
+		break;
+	    case 3:	/* duplicate a few chars */
+		memcpy (dup, bp->s+at, n);
+		bufAdd (bp, dup, n);
+		memmove (bp->s+at+n, bp->s+at, bp->l-at-2*n);
+		memcpy (bp->s+at, dup, n);
+		break;
+	    case 4:	/* splice in a piece of another input */
+		op = &ins[rand() % nin];
+		at = rand() % op->b.l;
+		n = 1 + rand() % 256;
+		if (n > op->b.l - at)
+		    n = op->b.l - at;
+		bufAdd (bp, op->b.s+at, n);
+		break;
+	    case 5:	/* truncate */
+		bp->l = at;
+		break;
+	    }
+	}
+}
+
+/* append the l bytes at s to bp */
+static void
+bufAdd (Buf *bp, const char *s, int l)
+{
+	if (bp->l + l > bp->m) {
+	    bp->m = 2*(bp->l + l);
+	    bp->s = (char *) realloc (bp->s, bp->m);
+	}
+	memcpy (bp->s + bp->l, s, l);
+	bp->l += l;
+}
+
+#endif /* SERVERXML_CHECK */
@@ -0,0 +1,12 @@
+/* read complete XML elements from an INDI server connection in bulk.
+ */
+
+#include "lilxml.h"
+
+extern void initServerXML (int fd, int exact, FILE *tracefp);
+extern XMLEle *readServerXML (LilXML *lp, char ynot[]);
+extern int pendingServerXML (void);
+
+/* see sinkServerXML() */
+typedef int (ServerXMLSink)(XMLEle *ep, const char *s, int n);
+extern void sinkServerXML (ServerXMLSink *sink);
@@ -1,4 +1,7 @@
 /* connect to an INDI server and set one or more device.property.element.
+ * with -f the specs are read in batches from a file or stdin and all are
+ * sent over the one connection, remembering each definition seen so later
+ * batches need not wait for the server to define them again.
  */
 
 #include <stdio.h>
@@ -12,12 +15,17 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 
+#include <zlib.h>
+
 #include "indiapi.h"
 #include "connect_to.h"
+#include "serverxml.h"
 #include "lilxml.h"
 #include "base64.h"
 
@@ -53,6 +61,13 @@ static LilXML *lillp;			/* XML parser context */
 static int qflag;			/* don't show some error messages */
 static int wflag;			/* whether to wait for Ok or Alert */
 static int mflag;			/* show any messages associated with spec properties */
+static int zflag;			/* compress BLOBs */
+static int batchfd = -1;		/* read batches of specs from here, if >= 0 */
+
+/* BLOB raw bytes handled per pass by sendBLOB(), and base64 line length */
+#define	BLOBCHUNK	(48*1024)
+#define	B64LINE		72
+#define	BLOBDROP	(8*1024*1024)	/* mapped bytes to drop once sent */
 
 typedef struct {
     char *e, *v;			/* element name and value */
@@ -73,6 +88,20 @@ typedef struct {
 static SetSpec *sets;			/* set of properties to set */
 static int nsets;
 
+/* cache of def* seen, for batches.
+ * askdevs are devices for which we have sent getProperties.
+ */
+typedef struct DefCache {
+    char *d, *p;			/* device and property, in def */
+    XMLEle *def;			/* complete def*, we own */
+    struct DefCache *next;		/* hash chain */
+} DefCache;
+#define	NDEFHASH	1024		/* n def cache hash chains, power of 2 */
+static DefCache *defhash[NDEFHASH];
+static char **askdevs;
+static int naskdevs;
+#define	BATCHLINE	2048		/* longest line in a batch file */
+
 
 static void usage (void);
 static void sendGetProps(void);
@@ -81,8 +110,9 @@ static void openINDIServer(void);
 static void listenINDI (void);
 static int finished (void);
 static void onAlarm (int dummy);
-static int readServerChar (void);
+static void serverGone (void);
 static void sendSet (XMLEle *root);
+static void matchDef (XMLEle *root, int t, SetSpec *sp);
 static void checkState (XMLEle *root);
 static void scanEV (SetSpec *specp, char ev[]);
 static void scanEEVV (SetSpec *specp, char *ep, char ev[]);
@@ -90,8 +120,23 @@ static void scanEVEV (SetSpec *specp, char ev[]);
 static void sendNew (FILE *fp, INDIDef *dp, SetSpec *sp);
 static void sendOne (FILE *fp, INDIDef *dp, SetSpec *sp);
 static void sendBLOB (FILE *fp, SetEV *ep);
+static void sendB64 (FILE *fp, B64Enc *enc, const unsigned char *in, int inlen,
+    int *colp);
+static void sendB64Lines (FILE *fp, const unsigned char *b64, int nb64,
+    int *colp);
+static void dropBLOB (unsigned char *blob, long long sent, long long *dropp);
 static void sendSpecs(void);
 static void bye(int n);
+static void runBatches (void);
+static int readBatch (void);
+static void runBatch (void);
+static int readBatchLine (char line[]);
+static void idleINDI (void);
+static int cacheDef (XMLEle *root);
+static DefCache **findDef (const char *d, const char *p);
+static unsigned defHash (const char *d, const char *p);
+static int needProps (const char *d);
+static void freeSets (void);
 
 int
 main (int ac, char *av[])
@@ -117,6 +162,20 @@ main (int ac, char *av[])
 		    ac--;
 		    break;
 
+		case 'f':
+		    if (ac < 2) {
+			fprintf (stderr, "-f requires file name\n");
+			usage();
+		    }
+		    if (strcmp (*++av, "-") == 0)
+			batchfd = 0;
+		    else if ((batchfd = open (*av, O_RDONLY)) < 0) {
+			fprintf (stderr, "%s: %s\n", *av, strerror(errno));
+			exit (2);
+		    }
+		    ac--;
+		    break;
+
 		case 'h':
 		    if (directfd >= 0) {
 			fprintf (stderr, "Can not combine -d and -h\n");
@@ -169,6 +228,10 @@ main (int ac, char *av[])
 		    wflag++;
 		    break;
 
+		case 'z':	/* compress BLOBs */
+		    zflag++;
+		    break;
+
 		case 'x':	/* FALLTHRU */
 		case 'n':	/* FALLTHRU */
 		case 's':	/* FALLTHRU */
@@ -185,7 +248,7 @@ main (int ac, char *av[])
 	}
 
 	/* now ac args starting at av[0] */
-	if (ac < 1)
+	if (batchfd >= 0 ? ac > 0 : ac < 1)
 	    usage();
 
 	/* sanity check */
@@ -196,11 +259,11 @@ main (int ac, char *av[])
 
 	/* crack each property, add to sets[]  */
 	allspeced = 1;
-	do {
+	while (ac > 0) {
 	    if (!crackSpec (&ac, &av))
 		allspeced = 0;
-	} while (ac > 0);
-	if (allspeced && wflag) {
+	}
+	if (batchfd < 0 && allspeced && wflag) {
 	    fprintf (stderr, "Can not use -w with type spec flags\n");
 	    bye(1);
 	}
@@ -216,7 +279,6 @@ main (int ac, char *av[])
 		fprintf (stderr, "Direct fd %d is not valid\n", directfd);
 		exit(1);
 	    }
-	    setbuf (svrrfp, NULL);		/* don't absorb next guy's stuff */
 	    setbuf (svrwfp, NULL);		/* immediate writes */
 	    if (verbose)
 		fprintf (stderr, "Using direct fd %d\n", directfd);
@@ -226,8 +288,15 @@ main (int ac, char *av[])
 		fprintf (stderr, "Connected to %s on port %d\n", host, port);
 	}
 
-	/* build a parser context for cracking XML responses */
+	/* build a parser context for cracking XML responses, and read in bulk
+	 * but don't absorb next guy's stuff if direct
+	 */
 	lillp = newLilXML();
+	initServerXML (fileno(svrrfp), directfd >= 0, NULL);
+
+	/* batches do all their own work */
+	if (batchfd >= 0)
+	    runBatches();
 
 	/* just send if all type-speced, else check with server */
 	if (allspeced) {
@@ -238,6 +307,7 @@ main (int ac, char *av[])
 
 	    /* listen for properties, set when see any we recognize */
 	    listenINDI();
+	    bye (0);
 	}
 
 	return (0);
@@ -249,9 +319,11 @@ usage()
 	fprintf(stderr, "Purpose: set one or more writable INDI properties\n");
 	fprintf(stderr, "%s\n", "$Revision: 1.12 $");
 	fprintf(stderr, "Usage: %s [options] {[type] spec} ...\n", me);
+	fprintf(stderr, "       %s [options] -f file\n", me);
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Options:\n");
 	fprintf(stderr, "  -d f  : use file descriptor f already open to server\n");
+	fprintf(stderr, "  -f f  : read batches of specs from file f, - for stdin, see man page\n");
 	fprintf(stderr, "  -h h  : alternate host, default is %s\n", host_def);
 	fprintf(stderr, "  -m    : show property messages (implies -w)\n");
 	fprintf(stderr, "  -p p  : alternate port, default is %d\n", INDIPORT);
@@ -259,6 +331,7 @@ usage()
 	fprintf(stderr, "  -t t  : max time to wait, default is %d secs\n",TIMEOUT);
 	fprintf(stderr, "  -v    : verbose (more are cumulative)\n");
 	fprintf(stderr, "  -w    : wait for state to be Ok or Alert - can not be used with type flags\n");
+	fprintf(stderr, "  -z    : compress BLOBs, format gets .z suffix\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Spec may be either:\n");
 	fprintf(stderr, "    device.property.e1[;e2...]=v1[;v2...]\n");
@@ -295,6 +368,8 @@ sendGetProps()
 		if (strcmp (sets[j].d, sp->d) == 0)
 		    break;
 	    if (i == j) {
+		if (batchfd >= 0 && !needProps (sp->d))
+		    continue;
 		if (verbose)
 		    fprintf (stderr, "Querying for %s properties\n", sp->d);
 		if (fprintf(svrwfp, "<getProperties version='%g' device='%s'/>\n", INDIV, sp->d) < 0) {
@@ -403,7 +478,7 @@ openINDIServer ()
 	setbuf (svrwfp, NULL);		/* immediate writes */
 }
 
-/* listen for property reports, send new sets if match */
+/* listen for property reports, send new sets if match, until finished() */
 static void
 listenINDI ()
 {
@@ -415,23 +490,29 @@ listenINDI ()
 
 	/* read from server, exit if find all properties */
 	while (1) {
-	    XMLEle *root = readXMLEle (lillp, readServerChar(), msg);
+	    XMLEle *root = readServerXML (lillp, msg);
 	    if (root) {
 		/* found a complete XML element */
 		if (verbose > 2)
 		    prXMLEle (stderr, root, 0);
                 else if (verbose > 1 )
                     fprintf (stderr, "RX from %s.%s\n", findXMLAttValu (root, "device"), findXMLAttValu (root, "name"));
+		int done;
 		sendSet (root);
 		if (wflag)
 		    checkState (root);
-		if (finished() == 0)
-		    bye (0);		/* found all we want or saw Alert */
-		delXMLEle (root);	/* not yet, delete and continue */
+		done = finished() == 0;	/* found all we want or saw Alert */
+		if (!cacheDef (root))
+		    delXMLEle (root);
+		if (done) {
+		    alarm (0);
+		    return;
+		}
 	    } else if (msg[0]) {
 		fprintf (stderr, "Bad XML from %s/%d: %s\n", host, port, msg);
 		bye(2);
-	    }
+	    } else
+		serverGone();
 	}
 }
 
@@ -482,20 +563,15 @@ onAlarm (int dummy)
 	exit (1);
 }
 
-static int
-readServerChar ()
+/* report why readServerXML() found no more from the server and exit */
+static void
+serverGone ()
 {
-	int c = fgetc (svrrfp);
-
-	if (c == EOF) {
-	    if (ferror(svrrfp))
-		perror ("read");
-	    else
-		fprintf (stderr,"INDI server %s:%d disconnected\n", host, port);
-	    bye (2);
-	}
-
-	return (c);
+	if (errno)
+	    perror ("read");
+	else
+	    fprintf (stderr,"INDI server %s:%d disconnected\n", host, port);
+	bye (2);
 }
 
 /* This is called on the arrival of each new INDI message in response
@@ -509,8 +585,7 @@ static void
 sendSet (XMLEle *root)
 {
 	char *rtype, *rdev, *rprop;
-	XMLEle *ep;
-	int t, s, i;
+	int t, s;
 
 	/* type must be def* */
 	rtype = tagXMLEle (root);
@@ -528,55 +603,64 @@ sendSet (XMLEle *root)
 	    fprintf (stderr, "Read definition for %s.%s\n", rdev, rprop);
 	for (s = 0; s < nsets; s++) {
 	    SetSpec *sp = &sets[s];
+	    if (!strcmp (rdev, sp->d) && !strcmp (rprop, sp->p))
+		matchDef (root, t, sp);
+	}
+}
 
-	    if (!strcmp (rdev, sp->d) && !strcmp (rprop, sp->p)) {
-		int nok = 0;
+/* given the def* root of type defs[t] for the same device and property as sp,
+ * send sp if all its elements match those of the definition.
+ */
+static void
+matchDef (XMLEle *root, int t, SetSpec *sp)
+{
+	XMLEle *ep;
+	int nok = 0;
+	int i;
 
-		/* found device and name, confirm writable */
-		if (!strchr (findXMLAttValu (root, "perm"), 'w')) {
-		    fprintf (stderr, "%s.%s is read-only\n", rdev, rprop);
-		    bye (1);
-		}
+	/* confirm writable */
+	if (!strchr (findXMLAttValu (root, "perm"), 'w')) {
+	    fprintf (stderr, "%s.%s is read-only\n", sp->d, sp->p);
+	    bye (1);
+	}
 
-		/* reset list of missing elements */
-		sp->missing[0] = '\0';
-
-		/* check matching elements */
-		for (ep = nextXMLEle(root,1); ep; ep = nextXMLEle(root,0)) {
-		    char *tag = tagXMLEle(ep);
-
-		    if (!strcmp(tag, defs[t].defOne)) {
-			char *el = findXMLAttValu (ep,"name");
-			int found = 0;
-			for (i = 0; i < sp->nev; i++) {
-			    if (!strcmp(el, sp->ev[i].e)) {
-				sp->ev[i].ok = 1;
-				nok++;
-				if (verbose)
-				    fprintf (stderr, "Confirmed %s.%s.%s\n", sp->d, sp->p,
-							sp->ev[i].e);
-				found++;
-				break;
-			    }
-			}
-			if (!found) {
-			    if (verbose)
-				fprintf (stderr, "Reported %s.%s.%s but not in spec\n",
-				    sp->d, sp->p, el);
-			    strcat (sp->missing, el);
-			    strcat (sp->missing, ",");
-			}
+	/* reset list of missing elements */
+	sp->missing[0] = '\0';
+
+	/* check matching elements */
+	for (ep = nextXMLEle(root,1); ep; ep = nextXMLEle(root,0)) {
+	    char *tag = tagXMLEle(ep);
+
+	    if (!strcmp(tag, defs[t].defOne)) {
+		char *el = findXMLAttValu (ep,"name");
+		int found = 0;
+		for (i = 0; i < sp->nev; i++) {
+		    if (!strcmp(el, sp->ev[i].e)) {
+			sp->ev[i].ok = 1;
+			nok++;
+			if (verbose)
+			    fprintf (stderr, "Confirmed %s.%s.%s\n", sp->d, sp->p,
+						sp->ev[i].e);
+			found++;
+			break;
 		    }
 		}
-		if (sp->missing[0])
-		    return;	/* elements are in root not in this spec */
-		if (nok != sp->nev)
-		    return;	/* elements are in this spec not in root */
-
-		/* all element names found, send new values */
-		sendNew (svrwfp, &defs[t], sp);
+		if (!found) {
+		    if (verbose)
+			fprintf (stderr, "Reported %s.%s.%s but not in spec\n",
+			    sp->d, sp->p, el);
+		    strcat (sp->missing, el);
+		    strcat (sp->missing, ",");
+		}
 	    }
 	}
+	if (sp->missing[0])
+	    return;	/* elements are in root not in this spec */
+	if (nok != sp->nev)
+	    return;	/* elements are in this spec not in root */
+
+	/* all element names found, send new values */
+	sendNew (svrwfp, &defs[t], sp);
 }
 
 /* send the given set specification of the given INDI type to channel on fp if not
@@ -630,14 +714,24 @@ sendOne (FILE *fp, INDIDef *dp, SetSpec *sp)
 	}
 }
 
-/* send one BLOB defined by SetEV */
+/* send one BLOB defined by SetEV.
+ * the file is mapped, not read, then compressed if zflag and base64 encoded
+ * through fixed size buffers straight to fp so memory use does not depend on
+ * the size of the file.
+ */
 static void
 sendBLOB (FILE *fp, SetEV *ep)
 {
+	static unsigned char zbuf[BLOBCHUNK];
+	unsigned char b64[8];
+	int nb64;
 	struct stat s;
-	int fd, bloblen, l64, i;
+	unsigned char *blob;
+	long long bloblen;
 	char *dot;
-	unsigned char *blob, *encblob;
+	long long dropped;
+	int isz, fd, col;
+	B64Enc enc;
 	
 	/* get file size */
 	if (stat (ep->v, &s) < 0) {
@@ -654,43 +748,142 @@ sendBLOB (FILE *fp, SetEV *ep)
 	    bye (1);
 	}
 
-	/* open file and convert to base64 */
+	/* compress unless not wanted or already compressed */
+	isz = zflag && (strlen(dot) < 2 || strcmp (&dot[strlen(dot)-2], ".z"));
+
+	/* open and map file */
 	fd = open (ep->v, O_RDONLY);
 	if (fd < 0) {
 	    fprintf (stderr, "Could not open %s: %s\n", ep->v,
 	    			strerror(errno));
 	    bye(1);
 	}
-	blob = (unsigned char *) malloc (bloblen);
-	i = read (fd, blob, bloblen);
-	if (i != bloblen) {
-	    if (i == 0)
-		fprintf (stderr, "Premature EOF reading %s\n", ep->v);
-	    else if (i < 0)
-		fprintf (stderr, "Error while reading %s: %s\n", ep->v,
-			    strerror(errno));
-	    else
-		fprintf (stderr, "BLOB file %s is short: %d < %d\n", ep->v,
-				i, bloblen);
-	    bye(1);
+	blob = NULL;
+	if (bloblen > 0) {
+	    blob = (unsigned char *) mmap (NULL, bloblen, PROT_READ, MAP_PRIVATE,
+	    								fd, 0);
+	    if (blob == (unsigned char *) MAP_FAILED) {
+		fprintf (stderr, "Could not map %s: %s\n", ep->v,
+				    strerror(errno));
+		bye(1);
+	    }
+	    (void) madvise (blob, bloblen, MADV_SEQUENTIAL);
 	}
 	close (fd);
 
-	/* send message */
+	/* send message, size is always uncompressed */
 	fprintf (fp, "  <oneBLOB\n");
 	fprintf (fp, "    name='%s'\n", ep->e);
-	fprintf (fp, "    size='%d'\n", bloblen);
-	fprintf (fp, "    format='%s'>\n", dot);
+	fprintf (fp, "    size='%lld'\n", bloblen);
+	fprintf (fp, "    format='%s%s'>\n", dot, isz ? ".z" : "");
+
+	b64EncInit (&enc);
+	col = 0;
+	dropped = 0;
+	if (isz) {
+	    /* deflate each chunk, encoding whatever comes out */
+	    z_stream zs;
+	    long long sent = 0;
+	    int zret;
+
+	    memset (&zs, 0, sizeof(zs));
+	    if (deflateInit (&zs, Z_BEST_SPEED) != Z_OK) {
+		fprintf (stderr, "Could not init compression for %s\n", ep->v);
+		bye(2);
+	    }
+	    do {
+		int flush;
+		if (zs.avail_in == 0 && sent < bloblen) {
+		    int n = bloblen-sent > BLOBCHUNK ? BLOBCHUNK : bloblen-sent;
+		    zs.next_in = blob + sent;
+		    zs.avail_in = n;
+		    sent += n;
+		    dropBLOB (blob, sent - n, &dropped);
+		}
+		flush = sent == bloblen ? Z_FINISH : Z_NO_FLUSH;
+		zs.next_out = zbuf;
+		zs.avail_out = sizeof(zbuf);
+		zret = deflate (&zs, flush);
+		if (zret == Z_STREAM_ERROR) {
+		    fprintf (stderr, "Compression error %d for %s\n", zret,
+		    							ep->v);
+		    bye(2);
+		}
+		sendB64 (fp, &enc, zbuf, sizeof(zbuf) - zs.avail_out, &col);
+	    } while (zret != Z_STREAM_END);
+	    deflateEnd (&zs);
+	} else {
+	    long long sent;
 
-	encblob = (unsigned char *) malloc (4*bloblen/3+4);
-	l64 = to64frombits(encblob, blob, bloblen);
-	for (i = 0; i < l64; i += 72)
-	    fprintf (fp, "%.72s\n", encblob+i);
+	    for (sent = 0; sent < bloblen; sent += BLOBCHUNK) {
+		int n = bloblen-sent > BLOBCHUNK ? BLOBCHUNK : bloblen-sent;
+		sendB64 (fp, &enc, blob + sent, n, &col);
+		dropBLOB (blob, sent + n, &dropped);
+	    }
+	}
+	nb64 = b64EncFinal (&enc, b64);
+	sendB64Lines (fp, b64, nb64, &col);
+	if (col > 0)
+	    fputc ('\n', fp);
 
 	fprintf (fp, "  </oneBLOB>\n");
 
-	free (encblob);
-	free (blob);
+	if (blob)
+	    munmap (blob, bloblen);
+}
+
+/* tell the kernel it may drop the pages of blob up through sent, in steps of
+ * BLOBDROP, so the mapping of a large file does not linger in our RSS.
+ */
+static void
+dropBLOB (unsigned char *blob, long long sent, long long *dropp)
+{
+	long long n = (sent - *dropp) / BLOBDROP * BLOBDROP;
+
+	if (n > 0) {
+	    (void) madvise (blob + *dropp, n, MADV_DONTNEED);
+	    *dropp += n;
+	}
+}
+
+/* base64 encode inlen bytes at in and write to fp, see sendB64Lines().
+ */
+static void
+sendB64 (FILE *fp, B64Enc *enc, const unsigned char *in, int inlen, int *colp)
+{
+	static unsigned char b64[4*BLOBCHUNK/3 + 8];
+
+	sendB64Lines (fp, b64, b64EncUpdate (enc, b64, in, inlen), colp);
+}
+
+/* write nb64 base64 chars at b64 to fp in lines of B64LINE chars, *colp being
+ * the length of the last partial line already written.
+ * the lines are gathered into one buffer so unbuffered fp costs one write.
+ */
+static void
+sendB64Lines (FILE *fp, const unsigned char *b64, int nb64, int *colp)
+{
+	static unsigned char lines[4*BLOBCHUNK/3 + 8 + (4*BLOBCHUNK/3)/B64LINE + 2];
+	unsigned char *lp = lines;
+	int col = *colp;
+	int i = 0;
+
+	while (i < nb64) {
+	    int n = B64LINE - col;
+	    if (n > nb64 - i)
+		n = nb64 - i;
+	    memcpy (lp, b64+i, n);
+	    lp += n;
+	    i += n;
+	    col += n;
+	    if (col == B64LINE) {
+		*lp++ = '\n';
+		col = 0;
+	    }
+	}
+
+	fwrite (lines, lp - lines, 1, fp);
+	*colp = col;
 }
 
 /* called with each incoming message to check whether it contains a set* that
@@ -860,6 +1053,329 @@ sendSpecs()
 	}
 }
 
+/* read and run each batch of specs from batchfd until EOF, then exit.
+ * say OK on stdout as each batch completes so a caller feeding us through a
+ * pipe knows when to continue; any failure exits just as without -f.
+ */
+static void
+runBatches ()
+{
+	while (readBatch() > 0) {
+	    runBatch();
+	    printf ("OK\n");
+	    fflush (stdout);
+	}
+
+	bye (0);
+}
+
+/* replace sets[] with the next batch of specs from batchfd, one per line with
+ * optional type flag, ending at a blank line or EOF. # starts a comment line.
+ * return number of specs, 0 at EOF.
+ */
+static int
+readBatch ()
+{
+	char line[BATCHLINE];
+
+	freeSets();
+
+	while (readBatchLine (line) >= 0) {
+	    char *av[2], **avp = av;
+	    char *lp = line;
+	    int ac = 1;
+
+	    while (*lp == ' ' || *lp == '\t')
+		lp++;
+	    if (*lp == '#')
+		continue;
+	    if (*lp == '\0') {
+		if (nsets > 0)
+		    break;
+		continue;
+	    }
+
+	    /* split off type flag, if any */
+	    av[0] = lp;
+	    if (lp[0] == '-') {
+		while (*lp && *lp != ' ' && *lp != '\t')
+		    lp++;
+		while (*lp == ' ' || *lp == '\t')
+		    *lp++ = '\0';
+		av[ac++] = lp;
+	    }
+	    if (verbose > 1)
+		fprintf (stderr, "Batch spec %s%s%s\n", av[0], ac > 1 ? " " : "",
+							    ac > 1 ? av[1] : "");
+	    crackSpec (&ac, &avp);
+	}
+
+	return (nsets);
+}
+
+/* send each spec in sets[], using cached definitions when possible, then
+ * listen until all are set and, with -w, all are done.
+ */
+static void
+runBatch ()
+{
+	int i, j;
+
+	for (i = 0; i < nsets; i++) {
+	    SetSpec *sp = &sets[i];
+	    if (sp->dp) {
+		/* type given, trust it */
+		sendNew (svrwfp, sp->dp, sp);
+		for (j = 0; j < sp->nev; j++)
+		    sp->ev[j].ok = 1;
+	    } else {
+		DefCache *cp = *findDef (sp->d, sp->p);
+		if (cp) {
+		    const char *tag = tagXMLEle (cp->def);
+		    for (j = 0; j < NDEFS; j++)
+			if (!strcmp (tag, defs[j].defType))
+			    matchDef (cp->def, j, sp);
+		}
+	    }
+	}
+
+	if (finished() == 0)
+	    return;
+
+	sendGetProps();
+	listenINDI();
+}
+
+/* fill line[BATCHLINE] with the next line from batchfd, without the newline.
+ * while waiting keep reading the server so it never has to queue for us.
+ * return length, or -1 at EOF.
+ */
+static int
+readBatchLine (char line[])
+{
+	static char ibuf[2*BATCHLINE];	/* bytes read from batchfd */
+	static int ni;			/* n bytes in ibuf[] */
+	static int eof;			/* set when batchfd is exhausted */
+	char *nl;
+	int n;
+
+	while (!(nl = (char *) memchr (ibuf, '\n', ni)) && !eof) {
+	    if (ni >= BATCHLINE) {
+		fprintf (stderr, "Batch line too long: %.*s...\n", 40, ibuf);
+		bye (2);
+	    }
+	    idleINDI();
+	    n = read (batchfd, ibuf+ni, sizeof(ibuf)-ni);
+	    if (n < 0) {
+		if (errno == EINTR)
+		    continue;
+		perror ("batch read");
+		bye (2);
+	    }
+	    if (n == 0)
+		eof = 1;
+	    ni += n;
+	}
+
+	if (!nl) {
+	    if (ni == 0)
+		return (-1);
+	    nl = ibuf + ni;		/* last line with no newline */
+	}
+
+	/* one read can bring in more than BATCHLINE before the newline */
+	n = nl - ibuf;
+	if (n >= BATCHLINE) {
+	    fprintf (stderr, "Batch line too long: %.*s...\n", 40, ibuf);
+	    bye (2);
+	}
+	memcpy (line, ibuf, n);
+	line[n] = '\0';
+	if (n > 0 && line[n-1] == '\r')
+	    line[--n] = '\0';
+	if (nl < ibuf + ni)
+	    nl++;
+	ni -= nl - ibuf;
+	memmove (ibuf, nl, ni);
+
+	return (n);
+}
+
+/* wait until batchfd is readable, meanwhile caching any definitions from the
+ * server and discarding all else.
+ * the server is read non-blocking so a partial element can not hold us up.
+ */
+static void
+idleINDI ()
+{
+	int svrfd = fileno (svrrfp);
+	int flags = fcntl (svrfd, F_GETFL);
+	struct pollfd pfd[2];
+	char msg[1024];
+
+	pfd[0].fd = batchfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = svrfd;
+	pfd[1].events = POLLIN;
+
+	fcntl (svrfd, F_SETFL, flags | O_NONBLOCK);
+
+	while (1) {
+	    XMLEle *root;
+
+	    if (!pendingServerXML()) {
+		if (poll (pfd, 2, -1) < 0) {
+		    if (errno == EINTR)
+			continue;
+		    perror ("poll");
+		    bye (2);
+		}
+		if (pfd[0].revents)
+		    break;
+		if (!pfd[1].revents)
+		    continue;
+	    }
+
+	    errno = 0;
+	    root = readServerXML (lillp, msg);
+	    if (root) {
+		if (verbose > 2)
+		    prXMLEle (stderr, root, 0);
+		if (!cacheDef (root))
+		    delXMLEle (root);
+	    } else if (msg[0]) {
+		fprintf (stderr, "Bad XML from %s/%d: %s\n", host, port, msg);
+		bye(2);
+	    } else if (errno != EAGAIN && errno != EWOULDBLOCK)
+		serverGone();
+	}
+
+	fcntl (svrfd, F_SETFL, flags);
+}
+
+/* if batching, keep root if it is a def* and return 1, forget any cached
+ * defs removed by a delProperty, else return 0.
+ */
+static int
+cacheDef (XMLEle *root)
+{
+	const char *tag = tagXMLEle (root);
+	const char *d, *p;
+	DefCache **cpp, *cp;
+	int t;
+
+	if (batchfd < 0)
+	    return (0);
+
+	d = findXMLAttValu (root, "device");
+	p = findXMLAttValu (root, "name");
+
+	if (!strcmp (tag, "delProperty")) {
+	    int i;
+	    for (i = 0; i < NDEFHASH; i++) {
+		cpp = p[0] ? findDef (d, p) : &defhash[i];
+		while ((cp = *cpp) != NULL) {
+		    if (!strcmp (cp->d, d) && (!p[0] || !strcmp (cp->p, p))) {
+			*cpp = cp->next;
+			delXMLEle (cp->def);
+			free (cp);
+		    } else
+			cpp = &cp->next;
+		}
+		if (p[0])
+		    break;	/* just the one */
+	    }
+	    return (0);
+	}
+
+	for (t = 0; t < NDEFS; t++)
+	    if (!strcmp (tag, defs[t].defType))
+		break;
+	if (t == NDEFS)
+	    return (0);
+
+	cpp = findDef (d, p);
+	if ((cp = *cpp) != NULL)
+	    delXMLEle (cp->def);
+	else {
+	    cp = (DefCache *) calloc (1, sizeof(DefCache));
+	    *cpp = cp;
+	}
+	cp->d = (char *) d;
+	cp->p = (char *) p;
+	cp->def = root;
+	return (1);
+}
+
+/* return pointer to the link to the cached def for d.p, which is NULL if none.
+ */
+static DefCache **
+findDef (const char *d, const char *p)
+{
+	DefCache **cpp = &defhash[defHash (d, p)];
+
+	while (*cpp && (strcmp ((*cpp)->d, d) || strcmp ((*cpp)->p, p)))
+	    cpp = &(*cpp)->next;
+	return (cpp);
+}
+
+/* FNV-1a hash of d.p into defhash[] */
+static unsigned
+defHash (const char *d, const char *p)
+{
+	unsigned h = 2166136261u;
+
+	while (*d)
+	    h = (h ^ (unsigned char)*d++) * 16777619u;
+	h = (h ^ '.') * 16777619u;
+	while (*p)
+	    h = (h ^ (unsigned char)*p++) * 16777619u;
+	return (h & (NDEFHASH-1));
+}
+
+/* return whether we need to send getProperties for device d in this batch:
+ * always the first time, so the server sends us its set*s for -w, then only
+ * while some spec for it is still waiting for its definition.
+ */
+static int
+needProps (const char *d)
+{
+	int i;
+
+	for (i = 0; i < naskdevs; i++)
+	    if (!strcmp (askdevs[i], d))
+		break;
+	if (i == naskdevs) {
+	    askdevs = (char **) realloc (askdevs, (naskdevs+1)*sizeof(char *));
+	    askdevs[naskdevs++] = strcpy ((char *)malloc(strlen(d)+1), d);
+	    return (1);
+	}
+
+	for (i = 0; i < nsets; i++)
+	    if (!sets[i].sent && !strcmp (sets[i].d, d))
+		return (1);
+	return (0);
+}
+
+/* free all sets[] */
+static void
+freeSets ()
+{
+	int i, j;
+
+	for (i = 0; i < nsets; i++) {
+	    SetSpec *sp = &sets[i];
+	    for (j = 0; j < sp->nev; j++) {
+		free (sp->ev[j].e);
+		free (sp->ev[j].v);
+	    }
+	    free (sp->ev);
+	    free (sp->d);
+	    free (sp->p);
+	}
+	nsets = 0;
+}
+
 /* cleanly close svr/wfp then exit(n)
  */
 static void
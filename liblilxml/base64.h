@@ -1,6 +1,37 @@
+#include <stdio.h>
+
 /* encode */
 extern int to64frombits(unsigned char *out, const unsigned char *in,
     int inlen);
 
 /* decode */
 extern int from64tobits(char *out, const char *in);
+
+/* incremental encoding state, see b64EncInit() */
+typedef struct {
+    unsigned char part[3];	/* raw bytes awaiting a complete quantum */
+    int npart;			/* n bytes in part[] */
+} B64Enc;
+
+/* incremental decoding state, see b64DecInit() */
+typedef struct {
+    unsigned char part[4];	/* digits awaiting a complete quantum */
+    int npart;			/* n digits in part[] */
+    int done;			/* set once padding has been seen */
+} B64Dec;
+
+/* incremental encode */
+extern void b64EncInit (B64Enc *ep);
+extern int b64EncUpdate (B64Enc *ep, unsigned char *out,
+    const unsigned char *in, int inlen);
+extern int b64EncFinal (B64Enc *ep, unsigned char *out);
+extern int b64EncWrite (B64Enc *ep, FILE *fp, int fd, const unsigned char *in,
+    int inlen);
+extern int b64EncWriteFinal (B64Enc *ep, FILE *fp, int fd);
+
+/* incremental decode */
+extern void b64DecInit (B64Dec *dp);
+extern int b64DecUpdate (B64Dec *dp, char *out, const char *in, int inlen);
+extern int b64DecFinal (B64Dec *dp);
+extern int b64DecWrite (B64Dec *dp, FILE *fp, int fd, const char *in,
+    int inlen);
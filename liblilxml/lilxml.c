@@ -30,6 +30,9 @@ Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "lilxml.h"
 
@@ -41,9 +44,23 @@ typedef struct {
 } String;
 #define	MINMEM	64			/* starting string length */
 
+/* output buffer for the serializer.
+ * if size is 0 buf belongs to the caller and is assumed large enough,
+ * otherwise buf is malloced and grows as needed. if fp is set, buf is
+ * drained to fp whenever it holds more than OUTFLUSH bytes.
+ */
+typedef struct {
+  char *buf;				/* output buffer */
+  int len;				/* bytes used in buf */
+  int size;				/* bytes malloced in buf, 0 if caller's */
+  FILE *fp;				/* drain buf here as it fills, if set */
+} XMLOut;
+#define	OUTFLUSH	8192		/* drain to fp when this full */
+
 static int oneXMLchar (LilXML *lp, int c, char ynot[]);
 static void initParser(LilXML *lp);
 static void pushXMLEle(LilXML *lp);
+static XMLEle *rootXMLEle (XMLEle *ep);
 static void popXMLEle(LilXML *lp);
 static void resetEndTag(LilXML *lp);
 static XMLAtt *growAtt(XMLEle *e);
@@ -55,6 +72,13 @@ static void appendString (String *sp, char *str);
 static void freeString (String *sp);
 static void newString (String *sp);
 static void *moremem (void *old, int n);
+static void copyString (String *dst, const String *src);
+static XMLEle *cloneEle (XMLEle *ep, XMLEle *pe);
+static void outXMLEle (XMLOut *op, XMLEle *ep, int level);
+static void outDrain (XMLOut *op);
+static int entityLen (const char *s, int sl, int hasent);
+static const char *entityStr (int c);
+static const char *findEntity (const char *s);
 
 typedef enum  {
   LOOK4START = 0,			/* looking for first element start */
@@ -104,12 +128,14 @@ struct _xml_ele {
 struct _xml_att {
     String name;			/* name */
     String valu;			/* value */
+    int valu_hasent;			/* 1 if valu contains an entity char */
     XMLEle *ce;				/* containing element */
 };
 
 /* characters that need escaping as "entities" in attr values and pcdata
  */
-static char entities[] = "&<>'\"";
+#define	ISENTITY(c)	((c) == '&' || (c) == '<' || (c) == '>' || \
+			 (c) == '\'' || (c) == '"')
 
 /* default memory managers, override with lilxmlMalloc() */
 static void *(*mymalloc)(size_t size) = malloc;
@@ -143,8 +169,9 @@ newLilXML ()
 void
 delLilXML (LilXML *lp)
 {
-  delXMLEle (lp->ce);
+  delXMLEle (rootXMLEle (lp->ce));
   freeString (&lp->endtag);
+  freeString (&lp->entity);
   (*myfree) (lp);
 }
 
@@ -159,6 +186,20 @@ getXMLEle (LilXML *lp)
   return (lp->ce);
 }
 
+/* return the element whose content the parser is now reading, if it has
+ * not yet seen any of it, else NULL. A caller feeding readXMLEle() may then
+ * consume raw content itself up to, but not including, the next '<' and the
+ * element will simply appear to have been empty.
+ */
+XMLEle *
+contentXMLEle (LilXML *lp)
+{
+  if (!lp || lp->cs != LOOK4CON || lp->lastc == '<' || lp->skipping
+                || lp->ce->nel > 0 || lp->ce->pcdata.sl > 0)
+    return (NULL);
+  return (lp->ce);
+}
+
 /* return a deep copy of the given LilXML
  */
 LilXML *
@@ -304,19 +345,50 @@ parseXML (char buf[], char ynot[])
   return (root);
 }
 
-/* return a deep copy of the given XMLEle *
+/* return a deep copy of the given XMLEle.
+ * the copy is built directly from ep, it is not printed and reparsed.
+ * N.B. the copy is a new root, it is not added to any parent.
  */
 XMLEle *
 cloneXMLEle (XMLEle *ep)
 {
-  char *buf;
-  char ynot[1024];
-  XMLEle *newep;
+  return (ep ? cloneEle (ep, NULL) : NULL);
+}
+
+/* return a deep copy of ep with the given parent */
+static XMLEle *
+cloneEle (XMLEle *ep, XMLEle *pe)
+{
+  XMLEle *newep = growEle (NULL);
+  int i;
 
-  buf = (char *) (*mymalloc) (sprlXMLEle (ep, 0) + 1);
-  sprXMLEle (buf, ep, 0);
-  newep = parseXML (buf, ynot);
-  (*myfree) (buf);
+  newep->pe = pe;
+
+  copyString (&newep->tag, &ep->tag);
+  copyString (&newep->pcdata, &ep->pcdata);
+  newep->pcdata_hasent = ep->pcdata_hasent;
+
+  if (ep->nat > 0) {
+    newep->at = (XMLAtt **) moremem (NULL, ep->nat*sizeof(XMLAtt *));
+    for (i = 0; i < ep->nat; i++) {
+      XMLAtt *ap = ep->at[i];
+      XMLAtt *newap = (XMLAtt *) moremem (NULL, sizeof(XMLAtt));
+      memset (newap, 0, sizeof(*newap));
+      copyString (&newap->name, &ap->name);
+      copyString (&newap->valu, &ap->valu);
+      newap->valu_hasent = ap->valu_hasent;
+      newap->ce = newep;
+      newep->at[i] = newap;
+    }
+    newep->nat = ep->nat;
+  }
+
+  if (ep->nel > 0) {
+    newep->el = (XMLEle **) moremem (NULL, ep->nel*sizeof(XMLEle *));
+    for (i = 0; i < ep->nel; i++)
+      newep->el[i] = cloneEle (ep->el[i], newep);
+    newep->nel = ep->nel;
+  }
 
   return (newep);
 }
@@ -508,7 +580,7 @@ editXMLEle (XMLEle *ep, char *pcdata)
 {
   freeString (&ep->pcdata);
   appendString (&ep->pcdata, pcdata);
-  ep->pcdata_hasent = (strpbrk (pcdata, entities) != NULL);
+  ep->pcdata_hasent = (*findEntity (pcdata) != '\0');
 }
 
 /* add an attribute to the given XML element */
@@ -518,6 +590,7 @@ addXMLAtt (XMLEle *ep, char *name, char *valu)
   XMLAtt *ap = growAtt (ep);
   appendString (&ap->name, name);
   appendString (&ap->valu, valu);
+  ap->valu_hasent = (*findEntity (valu) != '\0');
   return (ap);
 }
 
@@ -542,6 +615,7 @@ editXMLAtt (XMLAtt *ap, char *str)
 {
   freeString (&ap->valu);
   appendString (&ap->valu, str);
+  ap->valu_hasent = (*findEntity (str) != '\0');
 }
 
 /* sample print ep to fp
@@ -551,32 +625,14 @@ editXMLAtt (XMLAtt *ap, char *str)
 void
 prXMLEle (FILE *fp, XMLEle *ep, int level)
 {
-  int indent = level*PRINDENT;
-  int i;
-
-  fprintf (fp, "%*s<%s", indent, "", ep->tag.s);
-  for (i = 0; i < ep->nat; i++)
-    fprintf (fp, " %s=\"%s\"", ep->at[i]->name.s,
-             entityXML(ep->at[i]->valu.s));
-  if (ep->nel > 0) {
-    fprintf (fp, ">\n");
-    for (i = 0; i < ep->nel; i++)
-      prXMLEle (fp, ep->el[i], level+1);
-  }
-  if (ep->pcdata.sl > 0) {
-    if (ep->nel == 0)
-      fprintf (fp, ">\n");
-    if (ep->pcdata_hasent)
-      fprintf (fp, "%s", entityXML(ep->pcdata.s));
-    else
-      fprintf (fp, "%s", ep->pcdata.s);
-    if (ep->pcdata.s[ep->pcdata.sl-1] != '\n')
-      fprintf (fp, "\n");
-  }
-  if (ep->nel > 0 || ep->pcdata.sl > 0)
-    fprintf (fp, "%*s</%s>\n", indent, "", ep->tag.s);
-  else
-    fprintf (fp, "/>\n");
+  XMLOut out;
+
+  memset (&out, 0, sizeof(out));
+  out.fp = fp;
+  outXMLEle (&out, ep, level);
+  outDrain (&out);
+  if (out.buf)
+    (*myfree) (out.buf);
 }
 
 /* sample print ep to string s.
@@ -587,37 +643,34 @@ prXMLEle (FILE *fp, XMLEle *ep, int level)
 int
 sprXMLEle (char *s, XMLEle *ep, int level)
 {
-  int indent = level*PRINDENT;
-  int sl = 0;
-  int i;
+  XMLOut out;
 
-  sl += sprintf (s+sl, "%*s<%s", indent, "", ep->tag.s);
-  for (i = 0; i < ep->nat; i++)
-    sl += sprintf (s+sl, " %s=\"%s\"", ep->at[i]->name.s,
-                   entityXML(ep->at[i]->valu.s));
-  if (ep->nel > 0) {
-    sl += sprintf (s+sl, ">\n");
-    for (i = 0; i < ep->nel; i++)
-      sl += sprXMLEle (s+sl, ep->el[i], level+1);
-  }
-  if (ep->pcdata.sl > 0) {
-    if (ep->nel == 0)
-      sl += sprintf (s+sl, ">\n");
-    if (ep->pcdata_hasent)
-      sl += sprintf (s+sl, "%s", entityXML(ep->pcdata.s));
-    else {
-      strcpy (s+sl, ep->pcdata.s);
-      sl += ep->pcdata.sl;
-    }
-    if (ep->pcdata.s[ep->pcdata.sl-1] != '\n')
-      sl += sprintf (s+sl, "\n");
-  }
-  if (ep->nel > 0 || ep->pcdata.sl > 0)
-    sl += sprintf (s+sl, "%*s</%s>\n", indent, "", ep->tag.s);
-  else
-    sl += sprintf (s+sl, "/>\n");
+  memset (&out, 0, sizeof(out));
+  out.buf = s;
+  outXMLEle (&out, ep, level);
+  s[out.len] = '\0';
+
+  return (out.len);
+}
+
+/* sample print ep to a newly malloced string.
+ * if lenp set it is set to the length of the string (sans trailing \0).
+ * N.B. set level = 0 on first call
+ * N.B. caller must free the returned string.
+ */
+char *
+asprXMLEle (XMLEle *ep, int level, int *lenp)
+{
+  XMLOut out;
+
+  memset (&out, 0, sizeof(out));
+  out.buf = (char *) moremem (NULL, out.size = OUTFLUSH);
+  outXMLEle (&out, ep, level);
+  out.buf[out.len] = '\0';
 
-  return (sl);
+  if (lenp)
+    *lenp = out.len;
+  return (out.buf);
 }
 
 /* return number of bytes in a string guaranteed able to hold result of
@@ -632,8 +685,10 @@ sprlXMLEle (XMLEle *ep, int level)
   int i;
 
   l += indent + 1 + ep->tag.sl;
-  for (i = 0; i < ep->nat; i++)
-    l += ep->at[i]->name.sl + 4 + strlen(entityXML(ep->at[i]->valu.s));
+  for (i = 0; i < ep->nat; i++) {
+    XMLAtt *ap = ep->at[i];
+    l += ap->name.sl + 4 + entityLen (ap->valu.s, ap->valu.sl, ap->valu_hasent);
+  }
 
   if (ep->nel > 0) {
     l += 2;
@@ -643,10 +698,7 @@ sprlXMLEle (XMLEle *ep, int level)
   if (ep->pcdata.sl > 0) {
     if (ep->nel == 0)
       l += 2;
-    if (ep->pcdata_hasent)
-      l += strlen (entityXML(ep->pcdata.s));
-    else
-      l += ep->pcdata.sl;
+    l += entityLen (ep->pcdata.s, ep->pcdata.sl, ep->pcdata_hasent);
     if (ep->pcdata.s[ep->pcdata.sl-1] != '\n')
       l += 1;
   }
@@ -660,66 +712,137 @@ sprlXMLEle (XMLEle *ep, int level)
 
 /* return a string with all xml-sensitive characters within the passed string s
  * replaced with their entity sequence equivalents.
- * N.B. caller must use the returned string before calling us again.
+ * N.B. caller must use the returned string before calling us again from the
+ *   same thread. prefer entityXMLr() or fprEntityXML().
  */
 char *
 entityXML (char *s)
 {
-  static char *malbuf;
-  int nmalbuf = 0;
-  char *sret;
-  char *ep;
+  static __thread char *malbuf;		/* grow-only, one per thread */
+  static __thread int nmalbuf;
+  int l;
+
+  /* no need to copy if nothing to replace */
+  if (!*findEntity (s))
+    return (s);
+
+  l = lenEntityXML (s) + 1;
+  if (l > nmalbuf)
+    malbuf = (char *) moremem (malbuf, (nmalbuf = l));
+  return ((char *) entityXMLr (s, malbuf, nmalbuf));
+}
+
+/* return the length of s once all xml-sensitive characters are replaced with
+ * their entity sequence equivalents, sans trailing \0.
+ */
+int
+lenEntityXML (const char *s)
+{
+  const char *ep;
+  int l = 0;
 
-  /* scan for each entity, if any */
-  for (sret = s; (ep = strpbrk (s, entities)) != NULL; s = ep+1) {
+  for (; *(ep = findEntity (s)); s = ep+1)
+    l += (ep - s) + strlen (entityStr (*ep));
 
-    /* found another entity, copy preceding to malloced buffer */
-    int nnew = ep - s;			/* all but entity itself */
-    sret = malbuf = (char *) moremem (malbuf, nmalbuf + nnew + 10);
-    memcpy (malbuf+nmalbuf, s, nnew);
-    nmalbuf += nnew;
-
-    /* replace with entity encoding */
-    switch (*ep) {
-      case '&':
-        nmalbuf += sprintf (malbuf+nmalbuf, "&amp;");
-        break;
-      case '<':
-        nmalbuf += sprintf (malbuf+nmalbuf, "&lt;");
-        break;
-      case '>':
-        nmalbuf += sprintf (malbuf+nmalbuf, "&gt;");
-        break;
-      case '\'':
-        nmalbuf += sprintf (malbuf+nmalbuf, "&apos;");
-        break;
-      case '"':
-        nmalbuf += sprintf (malbuf+nmalbuf, "&quot;");
-        break;
+  return (l + strlen (s));
+}
 
-    }
+/* reentrant version of entityXML().
+ * if s contains no xml-sensitive characters return s itself, else copy s to
+ * buf replacing them with their entity sequence equivalents and return buf.
+ * return NULL if bufl is less than lenEntityXML(s)+1.
+ */
+const char *
+entityXMLr (const char *s, char *buf, int bufl)
+{
+  const char *ep;
+  int l = 0;
 
-  }
+  if (!*(ep = findEntity (s)))
+    return (s);
 
-  /* return s if no entities, else malloc cleaned-up copy */
-  if (sret == s) {
-    /* using s, so free any malloced memory from last time */
-    if (malbuf) {
-      free (malbuf);
-      malbuf = NULL;
-    }
-  } else {
-    /* put remaining part of s into malbuf */
-    int nleft = strlen (s) + 1;		/* include \0 */
-    sret = malbuf = (char *) moremem (malbuf, nmalbuf + nleft);
-    memcpy (malbuf+nmalbuf, s, nleft);
+  for (; *ep; s = ep+1, ep = findEntity (s)) {
+    const char *e = entityStr (*ep);
+    int nnew = ep - s;			/* all but entity itself */
+    int nent = strlen (e);
+    if (l + nnew + nent >= bufl)
+      return (NULL);
+    memcpy (buf+l, s, nnew);
+    memcpy (buf+l+nnew, e, nent);
+    l += nnew + nent;
   }
 
-  return (sret);
+  /* remaining part of s, including \0 */
+  if (l + (int)strlen (s) >= bufl)
+    return (NULL);
+  strcpy (buf+l, s);
+
+  return (buf);
 }
 
+/* print s to fp replacing all xml-sensitive characters with their entity
+ * sequence equivalents. nothing is malloced.
+ * return number of bytes written.
+ */
+int
+fprEntityXML (FILE *fp, const char *s)
+{
+  const char *ep;
+  int l = 0;
+
+  for (; *(ep = findEntity (s)); s = ep+1) {
+    const char *e = entityStr (*ep);
+    int nent = strlen (e);
+    fwrite (s, 1, ep - s, fp);
+    fwrite (e, 1, nent, fp);
+    l += (ep - s) + nent;
+  }
+  l += strlen (s);
+  fputs (s, fp);
 
+  return (l);
+}
 
+/* return pointer to the first xml-sensitive character in s, else to its \0.
+ * with SSE2 we test 16 chars at a time. loads are aligned so they never
+ * cross into a page not also holding part of s.
+ */
+#if defined(__SSE2__)
+__attribute__((no_sanitize_address))
+static const char *
+findEntity (const char *s)
+{
+  const __m128i amp = _mm_set1_epi8 ('&');
+  const __m128i lt = _mm_set1_epi8 ('<');
+  const __m128i gt = _mm_set1_epi8 ('>');
+  const __m128i apos = _mm_set1_epi8 ('\'');
+  const __m128i quot = _mm_set1_epi8 ('"');
+  const __m128i nul = _mm_setzero_si128 ();
+  int off = (int)((unsigned long)s & 15);
+  const __m128i *p = (const __m128i *)(s - off);
+  unsigned mask;
+
+  for (mask = ~0U << off; ; p++, mask = ~0U) {
+    __m128i v = _mm_load_si128 (p);
+    __m128i m = _mm_or_si128 (
+    		_mm_or_si128 (_mm_cmpeq_epi8 (v, amp), _mm_cmpeq_epi8 (v, lt)),
+    		_mm_or_si128 (_mm_cmpeq_epi8 (v, gt), _mm_cmpeq_epi8 (v, apos)));
+    m = _mm_or_si128 (m, _mm_or_si128 (_mm_cmpeq_epi8 (v, quot),
+    				       _mm_cmpeq_epi8 (v, nul)));
+    mask &= _mm_movemask_epi8 (m);
+    if (mask)
+      return ((const char *)p + __builtin_ctz (mask));
+  }
+}
+#else
+static const char *
+findEntity (const char *s)
+{
+  while (*s && !ISENTITY(*s))
+    s++;
+  return (s);
+}
+#endif
 
 /* if ent is a recognized xml entity sequence, set *cp to char and return 1
  * else return 0
@@ -844,8 +967,12 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
         lp->cs = ENTINATTRV;
       } else if (c == lp->delim)
         lp->cs = LOOK4ATTRN;
-      else if (!iscntrl(c))
-        growString (&lp->ce->at[lp->ce->nat-1]->valu, c);
+      else if (!iscntrl(c)) {
+        XMLAtt *ap = lp->ce->at[lp->ce->nat-1];
+        growString (&ap->valu, c);
+        if (ISENTITY(c))
+          ap->valu_hasent = 1;
+      }
       break;
 
     case ENTINATTRV:		/* working on entity in attr valu */
@@ -856,9 +983,10 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
           growString (&lp->ce->at[lp->ce->nat-1]->valu, c);
         else
           appendString(&lp->ce->at[lp->ce->nat-1]->valu,lp->entity.s);
+        lp->ce->at[lp->ce->nat-1]->valu_hasent = 1;	/* either way */
         freeString (&lp->entity);
         lp->cs = INATTRV;
-      } else
+      } else if (!iscntrl(c))		/* same as rest of valu */
         growString (&lp->entity, c);
       break;
 
@@ -871,6 +999,8 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
         lp->cs = ENTINCON;
       } else if (!isspace(c)) {
         growString (&lp->ce->pcdata, c);
+        if (ISENTITY(c))
+          lp->ce->pcdata_hasent = 1;
         lp->cs = INCON;
       }
       break;
@@ -888,6 +1018,8 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
         lp->cs = SAWLTINCON;
       } else {
         growString (&lp->ce->pcdata, c);
+        if (ISENTITY(c))
+          lp->ce->pcdata_hasent = 1;
       }
       break;
 
@@ -897,10 +1029,9 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
         growString (&lp->entity, c);
         if (decodeEntity (lp->entity.s, &c))
           growString (&lp->ce->pcdata, c);
-        else {
+        else
           appendString(&lp->ce->pcdata, lp->entity.s);
-          lp->ce->pcdata_hasent = 1;
-        }
+        lp->ce->pcdata_hasent = 1;	/* either way */
         freeString (&lp->entity);
         lp->cs = INCON;
       } else
@@ -958,14 +1089,25 @@ oneXMLchar (LilXML *lp, int c, char ynot[])
 static void
 initParser(LilXML *lp)
 {
-  delXMLEle (lp->ce);
+  /* ce may be a child part way through the message */
+  delXMLEle (rootXMLEle (lp->ce));
   freeString (&lp->endtag);
+  freeString (&lp->entity);
   memset (lp, 0, sizeof(*lp));
   newString (&lp->endtag);
   lp->cs = LOOK4START;
   lp->ln = 1;
 }
 
+/* return the top ancestor of ep, which may be ep itself or NULL */
+static XMLEle *
+rootXMLEle (XMLEle *ep)
+{
+  while (ep && ep->pe)
+    ep = ep->pe;
+  return (ep);
+}
+
 /* start a new XMLEle.
  * point ce to a new XMLEle.
  * if ce already set up, add to its list of child elements too.
@@ -1114,6 +1256,161 @@ moremem (void *old, int n)
   return (old ? (*myrealloc)(old, n) : (*mymalloc)(n));
 }
 
+/* make dst an exact copy of src */
+static void
+copyString (String *dst, const String *src)
+{
+  if (dst->sm < src->sl + 1)
+    dst->s = (char *) moremem (dst->s, (dst->sm = src->sl + 1));
+  memcpy (dst->s, src->s, src->sl + 1);
+  dst->sl = src->sl;
+}
+
+/* return the entity sequence to use for c, else NULL if c needs none */
+static const char *
+entityStr (int c)
+{
+  switch (c) {
+    case '&':  return ("&amp;");
+    case '<':  return ("&lt;");
+    case '>':  return ("&gt;");
+    case '\'': return ("&apos;");
+    case '"':  return ("&quot;");
+    default:   return (NULL);
+  }
+}
+
+/* return length of the sl chars at s once entities are replaced.
+ * hasent is a hint, 0 means s is known to contain no entity chars.
+ */
+static int
+entityLen (const char *s, int sl, int hasent)
+{
+  int l = sl;
+  int i;
+
+  if (hasent) {
+    for (i = 0; i < sl; i++) {
+      const char *e = entityStr (s[i]);
+      if (e)
+        l += strlen(e) - 1;
+    }
+  }
+
+  return (l);
+}
+
+/* write out buf to fp, if any, and mark empty */
+static void
+outDrain (XMLOut *op)
+{
+  if (op->fp && op->len > 0) {
+    fwrite (op->buf, 1, op->len, op->fp);
+    op->len = 0;
+  }
+}
+
+/* append n bytes at s to op */
+static void
+outMem (XMLOut *op, const char *s, int n)
+{
+  /* caller's buffer is assumed large enough */
+  if (op->size > 0 || op->fp) {
+    if (op->fp && op->len + n > OUTFLUSH) {
+      outDrain (op);
+      if (n > OUTFLUSH) {
+        fwrite (s, 1, n, op->fp);	/* too big to bother buffering */
+        return;
+      }
+    }
+    if (op->len + n + 1 > op->size) {
+      if (op->size < OUTFLUSH)
+        op->size = OUTFLUSH;
+      while (op->len + n + 1 > op->size)
+        op->size *= 2;
+      op->buf = (char *) moremem (op->buf, op->size);
+    }
+  }
+
+  memcpy (op->buf + op->len, s, n);
+  op->len += n;
+}
+
+/* append n spaces to op */
+static void
+outIndent (XMLOut *op, int n)
+{
+  static const char spaces[] = "                                ";
+  int ns = sizeof(spaces) - 1;
+
+  for (; n > ns; n -= ns)
+    outMem (op, spaces, ns);
+  outMem (op, spaces, n);
+}
+
+/* append the sl chars at s to op replacing entities.
+ * hasent is a hint, 0 means s is known to contain no entity chars.
+ */
+static void
+outEntity (XMLOut *op, const char *s, int sl, int hasent)
+{
+  int i, run;
+
+  if (!hasent) {
+    outMem (op, s, sl);
+    return;
+  }
+
+  for (run = i = 0; i < sl; i++) {
+    const char *e = entityStr (s[i]);
+    if (e) {
+      outMem (op, s + run, i - run);
+      outMem (op, e, strlen(e));
+      run = i + 1;
+    }
+  }
+  outMem (op, s + run, sl - run);
+}
+
+/* append the sample print of ep to op, same format as prXMLEle() */
+static void
+outXMLEle (XMLOut *op, XMLEle *ep, int level)
+{
+  int indent = level*PRINDENT;
+  int i;
+
+  outIndent (op, indent);
+  outMem (op, "<", 1);
+  outMem (op, ep->tag.s, ep->tag.sl);
+  for (i = 0; i < ep->nat; i++) {
+    XMLAtt *ap = ep->at[i];
+    outMem (op, " ", 1);
+    outMem (op, ap->name.s, ap->name.sl);
+    outMem (op, "=\"", 2);
+    outEntity (op, ap->valu.s, ap->valu.sl, ap->valu_hasent);
+    outMem (op, "\"", 1);
+  }
+  if (ep->nel > 0) {
+    outMem (op, ">\n", 2);
+    for (i = 0; i < ep->nel; i++)
+      outXMLEle (op, ep->el[i], level+1);
+  }
+  if (ep->pcdata.sl > 0) {
+    if (ep->nel == 0)
+      outMem (op, ">\n", 2);
+    outEntity (op, ep->pcdata.s, ep->pcdata.sl, ep->pcdata_hasent);
+    if (ep->pcdata.s[ep->pcdata.sl-1] != '\n')
+      outMem (op, "\n", 1);
+  }
+  if (ep->nel > 0 || ep->pcdata.sl > 0) {
+    outIndent (op, indent);
+    outMem (op, "</", 2);
+    outMem (op, ep->tag.s, ep->tag.sl);
+    outMem (op, ">\n", 2);
+  } else
+    outMem (op, "/>\n", 3);
+}
+
 #if defined(MAIN_TST)
 int
 main (int ac, char *av[])
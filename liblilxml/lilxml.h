@@ -72,6 +72,9 @@ extern XMLAtt *addXMLAtt (XMLEle *ep, char *name, char *value);
 extern void rmXMLAtt (XMLEle *ep, char *name);
 extern void editXMLAtt (XMLAtt *ap, char *str);
 extern char *entityXML (char *str);
+extern const char *entityXMLr (const char *str, char *buf, int bufl);
+extern int lenEntityXML (const char *str);
+extern int fprEntityXML (FILE *fp, const char *str);
 
 
 /* convenience functions */
@@ -79,8 +82,10 @@ extern char *findXMLAttValu (XMLEle *ep, const char *name);
 extern void prXMLEle (FILE *fp, XMLEle *e, int level);
 extern int sprXMLEle (char *s, XMLEle *ep, int level);
 extern int sprlXMLEle (XMLEle *ep, int level);
+extern char *asprXMLEle (XMLEle *ep, int level, int *lenp);
 extern XMLEle *cloneXMLEle (XMLEle *ep);
 extern XMLEle *getXMLEle (LilXML *lp);
+extern XMLEle *contentXMLEle (LilXML *lp);
 extern LilXML *cloneLilXML (LilXML *lp);
 
 
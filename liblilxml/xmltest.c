@@ -0,0 +1,646 @@
+/* differential fuzz and throughput tests of the lilxml parser and printers.
+ *
+ * each input file is a stream of INDI messages. the stream is first read with
+ * readXMLEle() one char at a time, which is the reference, and the result kept
+ * as a transcript of each message as printed by prXMLEle() or of why it
+ * failed. every other way of parsing the same stream must then produce exactly
+ * the same transcript, and every other way of printing each message must
+ * produce exactly the same bytes. the same is then done for many random
+ * mutations of the inputs. finally each input is timed to report parsing and
+ * printing MB/s and the number of allocations per message.
+ *
+ * make xmltestrun
+ *
+ * readServerXML() in INDI/serverxml.c is checked against the same reference
+ * and corpus by make svrxmlcheck there.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+
+#include "lilxml.h"
+#include "base64.h"
+
+/* a growing byte buffer */
+typedef struct {
+    char *s;				/* malloced bytes */
+    int l;				/* bytes used */
+    int m;				/* bytes malloced */
+} Buf;
+
+/* one input stream */
+typedef struct {
+    char *name;				/* file name or description */
+    Buf b;				/* contents */
+} Input;
+
+/* a way to parse a whole stream into a transcript */
+typedef struct {
+    const char *name;
+    void (*parse) (const char *s, int l, Buf *tp);
+} ParsePath;
+
+static void usage (char *me);
+static void readInput (char *fn, Input *ip);
+static void makeBigBLOB (Input *ip, int nraw);
+static int checkInput (const char *name, const char *s, int l);
+static int checkPrint (const char *name, XMLEle *root);
+static int checkPrinters (const char *name, XMLEle *root, const char *pr,
+    int prl);
+static void parseRef (const char *s, int l, Buf *tp);
+static void parseFile (const char *s, int l, Buf *tp);
+static void parseFirst (const char *s, int l, Buf *tp);
+static void transcript (Buf *tp, XMLEle *root, const char *ynot);
+static int fuzz (Input *ins, int nin, int nfuzz);
+static void mutate (Buf *bp, Input *ins, int nin);
+static void bench (Input *ip, double tmin);
+static int failed (const char *name, const char *what, const char *s, int l);
+static void bufAdd (Buf *bp, const char *s, int l);
+static double secs (void);
+static void *countMalloc (size_t size);
+static void *countRealloc (void *ptr, size_t size);
+
+/* all ways of parsing a stream, the first is the reference */
+static ParsePath paths[] = {
+    {"readXMLEle", parseRef},
+    {"readXMLFile", parseFile},
+    {"parseXML", parseFirst},
+};
+#define	NPATHS	((int)(sizeof(paths)/sizeof(paths[0])))
+
+static long nalloc;			/* count of malloc and realloc calls */
+static int vflag;			/* verbose */
+
+int
+main (int ac, char *av[])
+{
+	char *me = av[0];
+	Input *ins;
+	int nin = 0;
+	int nfuzz = 20000;
+	int bigblob = 8*1024*1024;
+	double tmin = 0.5;
+	unsigned seed = 1;
+	int nbad = 0;
+	int i;
+
+        /* crack args */
+        while ((--ac > 0) && ((*++av)[0] == '-')) {
+            char *s;
+            for (s = av[0]+1; *s != '\0'; s++) {
+                switch (*s) {
+		case 'b':
+		    if (ac < 2) {
+			fprintf (stderr, "-b requires BLOB size\n");
+			usage (me);
+		    }
+		    bigblob = atoi(*++av);
+		    ac--;
+		    break;
+		case 'f':
+		    if (ac < 2) {
+			fprintf (stderr, "-f requires number of mutations\n");
+			usage (me);
+		    }
+		    nfuzz = atoi(*++av);
+		    ac--;
+		    break;
+		case 's':
+		    if (ac < 2) {
+			fprintf (stderr, "-s requires seed\n");
+			usage (me);
+		    }
+		    seed = atoi(*++av);
+		    ac--;
+		    break;
+		case 't':
+		    if (ac < 2) {
+			fprintf (stderr, "-t requires seconds\n");
+			usage (me);
+		    }
+		    tmin = atof(*++av);
+		    ac--;
+		    break;
+                case 'v':
+		    vflag++;
+		    break;
+		default:
+		    fprintf (stderr, "Unknown flag: %c\n", *s);
+		    usage(me);
+		    break;
+		}
+	    }
+	}
+	if (ac <= 0) {
+	    fprintf (stderr, "No input files\n");
+	    usage(me);
+	}
+
+	lilxmlMalloc (countMalloc, countRealloc, free);
+	srand (seed);
+
+	/* read each file, plus one large BLOB made here */
+	ins = (Input *) calloc (ac+1, sizeof(Input));
+	for (i = 0; i < ac; i++)
+	    readInput (av[i], &ins[nin++]);
+	if (bigblob > 0)
+	    makeBigBLOB (&ins[nin++], bigblob);
+
+	/* each as is */
+	for (i = 0; i < nin; i++)
+	    nbad += checkInput (ins[i].name, ins[i].b.s, ins[i].b.l);
+	printf ("differential: %d inputs %s\n", nin, nbad ? "FAILED" : "ok");
+
+	/* many mutations of the files */
+	if (!nbad && nfuzz > 0) {
+	    nbad += fuzz (ins, ac, nfuzz);
+	    printf ("fuzz: %d mutations, seed %u %s\n", nfuzz, seed,
+	    					nbad ? "FAILED" : "ok");
+	}
+
+	/* throughput */
+	if (tmin > 0) {
+	    printf ("%-24s %8s %8s %9s %9s %8s\n", "input", "bytes", "msgs",
+	    				"parseMB/s", "printMB/s", "allocs");
+	    for (i = 0; i < nin; i++)
+		bench (&ins[i], tmin);
+	}
+
+	for (i = 0; i < nin; i++)
+	    free (ins[i].b.s);
+	free (ins);
+
+	return (nbad ? 1 : 0);
+}
+
+static void
+usage (char *me)
+{
+	fprintf (stderr, "Usage: %s [options] file ...\n", me);
+	fprintf (stderr, "Purpose: check and time lilxml on files of INDI messages\n");
+	fprintf (stderr, "Options:\n");
+	fprintf (stderr, "  -b n  : also use a BLOB of n raw bytes, 0 for none, default 8M\n");
+	fprintf (stderr, "  -f n  : number of random mutations to check, default 20000\n");
+	fprintf (stderr, "  -s n  : random seed, default 1\n");
+	fprintf (stderr, "  -t s  : min seconds to time each input, 0 to skip, default .5\n");
+	fprintf (stderr, "  -v    : verbose\n");
+	fprintf (stderr, "Exit 0 if all ok else 1, first failing input is saved in xmltest.fail\n");
+
+	exit (2);
+}
+
+/* read the named file into ip, or exit */
+static void
+readInput (char *fn, Input *ip)
+{
+	FILE *fp = fopen (fn, "r");
+	char buf[8192];
+	int n;
+
+	if (!fp) {
+	    fprintf (stderr, "%s: %s\n", fn, strerror(errno));
+	    exit(2);
+	}
+	while ((n = fread (buf, 1, sizeof(buf), fp)) > 0)
+	    bufAdd (&ip->b, buf, n);
+	fclose (fp);
+	ip->name = fn;
+}
+
+/* fill ip with a setBLOBVector carrying nraw random bytes, in lines of 72 as
+ * sent by setINDI.
+ */
+static void
+makeBigBLOB (Input *ip, int nraw)
+{
+	unsigned char *raw = (unsigned char *) malloc (nraw);
+	unsigned char *b64 = (unsigned char *) malloc (4*nraw/3+4);
+	static char name[64];
+	char hdr[256];
+	int i, n64;
+
+	for (i = 0; i < nraw; i++)
+	    raw[i] = rand();
+	n64 = to64frombits (b64, raw, nraw);
+
+	bufAdd (&ip->b, hdr, sprintf (hdr,
+		"<setBLOBVector device='CCD' name='CCD1' state='Ok'>\n"
+		"  <oneBLOB name='CCD1' size='%d' format='.fits'>\n", nraw));
+	for (i = 0; i < n64; i += 72) {
+	    bufAdd (&ip->b, (char *)b64+i, n64-i < 72 ? n64-i : 72);
+	    bufAdd (&ip->b, "\n", 1);
+	}
+	bufAdd (&ip->b, "  </oneBLOB>\n</setBLOBVector>\n", 30);
+
+	sprintf (name, "%dKB BLOB", nraw>>10);
+	ip->name = name;
+
+	free (raw);
+	free (b64);
+}
+
+/* parse the l bytes at s every way we know and check they all agree.
+ * return 0 if ok else 1.
+ */
+static int
+checkInput (const char *name, const char *s, int l)
+{
+	Buf ref, alt;
+	LilXML *lp;
+	char ynot[1024];
+	int i;
+	int bad = 0;
+
+	/* the reference transcript */
+	memset (&ref, 0, sizeof(ref));
+	(*paths[0].parse) (s, l, &ref);
+
+	/* all other parsers must match exactly */
+	for (i = 1; !bad && i < NPATHS; i++) {
+	    memset (&alt, 0, sizeof(alt));
+	    (*paths[i].parse) (s, l, &alt);
+	    if (alt.l != ref.l || (ref.l > 0 && memcmp (alt.s, ref.s, ref.l))) {
+		/* parseXML only does the first message */
+		if (paths[i].parse != parseFirst || ref.l < alt.l
+				|| (alt.l > 0 && memcmp (alt.s, ref.s, alt.l)))
+		    bad = failed (name, paths[i].name, s, l);
+	    }
+	    free (alt.s);
+	}
+
+	/* then all printers must match prXMLEle of each message */
+	lp = newLilXML();
+	for (i = 0; !bad && i < l; i++) {
+	    XMLEle *root = readXMLEle (lp, s[i], ynot);
+	    if (root) {
+		bad = checkPrint (name, root);
+		if (bad)
+		    (void) failed (name, "printer", s, l);
+		delXMLEle (root);
+	    }
+	}
+	delLilXML (lp);
+
+	if (vflag && !bad)
+	    printf ("%s: %d bytes ok\n", name, l);
+
+	free (ref.s);
+	return (bad);
+}
+
+/* check each way of printing root matches prXMLEle.
+ * return 0 if ok else 1.
+ */
+static int
+checkPrint (const char *name, XMLEle *root)
+{
+	char *pr;
+	size_t prsz;
+	FILE *fp;
+	int prl, bad;
+
+	fp = open_memstream (&pr, &prsz);
+	prXMLEle (fp, root, 0);
+	fclose (fp);
+	prl = prsz;
+
+	bad = checkPrinters (name, root, pr, prl);
+	free (pr);
+	return (bad);
+}
+
+/* check each way of printing root matches the prl bytes at pr.
+ * return 0 if ok else 1.
+ */
+static int
+checkPrinters (const char *name, XMLEle *root, const char *pr, int prl)
+{
+	char ynot[1024];
+	XMLEle *ep;
+	char *s;
+	int l;
+
+	/* length */
+	l = sprlXMLEle (root, 0);
+	if (l != prl) {
+	    fprintf (stderr, "%s: sprlXMLEle %d != %d\n", name, l, prl);
+	    return (1);
+	}
+
+	/* to caller's string */
+	s = (char *) malloc (l + 1);
+	if (sprXMLEle (s, root, 0) != prl || memcmp (s, pr, prl)) {
+	    fprintf (stderr, "%s: sprXMLEle differs\n", name);
+	    free (s);
+	    return (1);
+	}
+	free (s);
+
+	/* to a new string */
+	s = asprXMLEle (root, 0, &l);
+	if (l != prl || memcmp (s, pr, prl)) {
+	    fprintf (stderr, "%s: asprXMLEle differs\n", name);
+	    free (s);
+	    return (1);
+	}
+
+	/* parsing what was printed must print the same again */
+	ep = parseXML (s, ynot);
+	free (s);
+	if (!ep) {
+	    fprintf (stderr, "%s: reparse failed: %s\n", name, ynot);
+	    return (1);
+	}
+	s = asprXMLEle (ep, 0, &l);
+	delXMLEle (ep);
+	if (l != prl || memcmp (s, pr, prl)) {
+	    fprintf (stderr, "%s: reparse differs\n", name);
+	    free (s);
+	    return (1);
+	}
+	free (s);
+
+	/* a clone must print the same */
+	ep = cloneXMLEle (root);
+	s = asprXMLEle (ep, 0, &l);
+	delXMLEle (ep);
+	if (l != prl || memcmp (s, pr, prl)) {
+	    fprintf (stderr, "%s: cloneXMLEle differs\n", name);
+	    free (s);
+	    return (1);
+	}
+	free (s);
+
+	return (0);
+}
+
+/* add to tp the printed root, or ynot if root is NULL, ending with a \f */
+static void
+transcript (Buf *tp, XMLEle *root, const char *ynot)
+{
+	if (root) {
+	    char *s;
+	    size_t l;
+	    FILE *fp = open_memstream (&s, &l);
+
+	    prXMLEle (fp, root, 0);
+	    fclose (fp);
+	    bufAdd (tp, s, l);
+	    free (s);
+	} else {
+	    bufAdd (tp, "error: ", 7);
+	    bufAdd (tp, ynot, strlen(ynot));
+	}
+	bufAdd (tp, "\f", 1);
+}
+
+/* the reference: readXMLEle() one char at a time */
+static void
+parseRef (const char *s, int l, Buf *tp)
+{
+	LilXML *lp = newLilXML();
+	char ynot[1024];
+	int i;
+
+	for (i = 0; i < l; i++) {
+	    XMLEle *root = readXMLEle (lp, s[i], ynot);
+	    if (root || ynot[0])
+		transcript (tp, root, ynot);
+	    delXMLEle (root);
+	}
+
+	delLilXML (lp);
+}
+
+/* readXMLFile() from a FILE */
+static void
+parseFile (const char *s, int l, Buf *tp)
+{
+	FILE *fp = fmemopen ((void *)s, l, "r");
+	LilXML *lp = newLilXML();
+	char ynot[1024];
+	XMLEle *root;
+
+	while (ynot[0] = '\0', (root = readXMLFile (fp, lp, ynot)) || ynot[0]) {
+	    transcript (tp, root, ynot);
+	    delXMLEle (root);
+	}
+
+	delLilXML (lp);
+	fclose (fp);
+}
+
+/* parseXML() of the first message only, as a string */
+static void
+parseFirst (const char *s, int l, Buf *tp)
+{
+	char *str = (char *) malloc (l + 1);
+	char ynot[1024];
+	XMLEle *root;
+
+	memcpy (str, s, l);
+	str[l] = '\0';
+
+	/* an incomplete message only counts if the stream was cut short */
+	root = parseXML (str, ynot);
+	if (root || (int)strlen(str) < l)
+	    transcript (tp, root, ynot);
+	delXMLEle (root);
+
+	free (str);
+}
+
+/* check nfuzz random mutations of the first nin inputs.
+ * return 0 if all ok else 1.
+ */
+static int
+fuzz (Input *ins, int nin, int nfuzz)
+{
+	Buf b;
+	int i;
+
+	memset (&b, 0, sizeof(b));
+	for (i = 0; i < nfuzz; i++) {
+	    char name[64];
+
+	    mutate (&b, ins, nin);
+	    sprintf (name, "mutation %d", i);
+	    if (checkInput (name, b.s, b.l))
+		return (1);
+	}
+
+	free (b.s);
+	return (0);
+}
+
+/* set bp to a copy of a random input with a few random edits applied.
+ * the edits favor chars that mean something to the parser.
+ */
+static void
+mutate (Buf *bp, Input *ins, int nin)
+{
+	static const char special[] = "<>/&;'\"=!?- \n\tabc#";
+	Input *ip = &ins[rand() % nin];
+	int nedits = 1 + rand() % 8;
+	int maxl = 4096;
+	char dup[16];
+
+	bp->l = 0;
+	bufAdd (bp, ip->b.s, ip->b.l < maxl ? ip->b.l : maxl);
+
+	while (nedits-- > 0 && bp->l > 0) {
+	    int at = rand() % bp->l;
+	    int n = 1 + rand() % 16;
+	    Input *op;
+
+	    if (n > bp->l - at)
+		n = bp->l - at;
+
+	    switch (rand() % 6) {
+	    case 0:	/* replace a char with a special one */
+		bp->s[at] = special[rand() % (sizeof(special)-1)];
+		break;
+	    case 1:	/* replace a char with anything */
+		bp->s[at] = rand();
+		break;
+	    case 2:	/* delete a few chars */
+		memmove (bp->s+at, bp->s+at+n, bp->l-at-n);
+		bp->l -= n;
+		break;
+	    case 3:	/* duplicate a few chars */
+		memcpy (dup, bp->s+at, n);
+		bufAdd (bp, dup, n);
+		memmove (bp->s+at+n, bp->s+at, bp->l-at-2*n);
+		memcpy (bp->s+at, dup, n);
+		break;
+	    case 4:	/* splice in a piece of another input */
+		op = &ins[rand() % nin];
+		at = rand() % op->b.l;
+		n = 1 + rand() % 256;
+		if (n > op->b.l - at)
+		    n = op->b.l - at;
+		bufAdd (bp, op->b.s+at, n);
+		break;
+	    case 5:	/* truncate */
+		bp->l = at;
+		break;
+	    }
+	}
+}
+
+/* report parse and print rate of ip, and allocations per message.
+ * each is repeated for at least tmin seconds.
+ */
+static void
+bench (Input *ip, double tmin)
+{
+	const char *s = ip->b.s;
+	int l = ip->b.l;
+	char ynot[1024];
+	XMLEle **roots = NULL;
+	int nroots = 0;
+	double t0, t, parsemb, printmb;
+	long nprint, rep;
+	long nalloc0;
+	LilXML *lp;
+	int i;
+
+	/* parse once to collect the messages and count allocations */
+	lp = newLilXML();
+	nalloc0 = nalloc;
+	for (i = 0; i < l; i++) {
+	    XMLEle *root = readXMLEle (lp, s[i], ynot);
+	    if (root) {
+		roots = (XMLEle **) realloc (roots, (nroots+1)*sizeof(XMLEle*));
+		roots[nroots++] = root;
+	    }
+	}
+	nalloc0 = nalloc - nalloc0;
+
+	/* parse and discard */
+	t0 = secs();
+	rep = 0;
+	do {
+	    for (i = 0; i < l; i++)
+		delXMLEle (readXMLEle (lp, s[i], ynot));
+	    rep++;
+	} while ((t = secs() - t0) < tmin);
+	parsemb = rep*l/t/1e6;
+	delLilXML (lp);
+
+	/* print and discard */
+	t0 = secs();
+	nprint = 0;
+	do {
+	    for (i = 0; i < nroots; i++) {
+		int pl;
+		char *p = asprXMLEle (roots[i], 0, &pl);
+		nprint += pl;
+		free (p);
+	    }
+	} while ((t = secs() - t0) < tmin && nroots > 0);
+	printmb = nprint/t/1e6;
+
+	printf ("%-24s %8d %8d %9.0f %9.0f %8.1f\n", ip->name, l, nroots,
+			parsemb, printmb, nroots ? (double)nalloc0/nroots : 0.0);
+
+	for (i = 0; i < nroots; i++)
+	    delXMLEle (roots[i]);
+	free (roots);
+}
+
+/* report a failure of what, saving the offending input in xmltest.fail.
+ * return 1.
+ */
+static int
+failed (const char *name, const char *what, const char *s, int l)
+{
+	FILE *fp = fopen ("xmltest.fail", "w");
+
+	fprintf (stderr, "%s: %s does not match readXMLEle, see xmltest.fail\n",
+								name, what);
+	if (fp) {
+	    fwrite (s, 1, l, fp);
+	    fclose (fp);
+	}
+
+	return (1);
+}
+
+/* append the l bytes at s to bp */
+static void
+bufAdd (Buf *bp, const char *s, int l)
+{
+	if (bp->l + l > bp->m) {
+	    bp->m = 2*(bp->l + l);
+	    bp->s = (char *) realloc (bp->s, bp->m);
+	}
+	memcpy (bp->s + bp->l, s, l);
+	bp->l += l;
+}
+
+/* return seconds since some epoch */
+static double
+secs(void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec*1e-6);
+}
+
+static void *
+countMalloc (size_t size)
+{
+	nalloc++;
+	return (malloc (size));
+}
+
+static void *
+countRealloc (void *ptr, size_t size)
+{
+	nalloc++;
+	return (realloc (ptr, size));
+}